@@ -0,0 +1,105 @@
+#include "arena.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+
+constexpr size_t Arena::MIN_BLOCK_SIZE;
+constexpr size_t Arena::HUGE_PAGE_SIZE;
+
+Arena& Arena::operator=(Arena&& other) {
+  if (this != &other) {
+    Release();
+    cur_ = other.cur_;
+    end_ = other.end_;
+    next_block_size_ = other.next_block_size_;
+    allocated_bytes_ = other.allocated_bytes_;
+    blocks_ = std::move(other.blocks_);
+    other.cur_ = other.end_ = nullptr;
+    other.next_block_size_ = MIN_BLOCK_SIZE;
+    other.allocated_bytes_ = 0;
+    other.blocks_.clear();
+  }
+  return *this;
+}
+
+ByteRange Arena::Copy(const char* begin, const char* end) {
+  ByteRange range;
+  size_t size = end - begin;
+  char* p = static_cast<char*>(Alloc(size, 1));
+  memcpy(p, begin, size);
+  range.begin = p;
+  range.end = p + size;
+  return range;
+}
+
+const char* Arena::CopyStr(const char* s) {
+  size_t size = strlen(s) + 1;
+  char* p = static_cast<char*>(Alloc(size, 1));
+  memcpy(p, s, size);
+  return p;
+}
+
+size_t Arena::ReservedBytes() const {
+  size_t result = 0;
+  for (auto& block : blocks_) {
+    result += block.second;
+  }
+  return result;
+}
+
+// If huge_page_size isn't zero, the block is aligned to it and advised to use
+// huge pages.
+static char* MapBlock(size_t size, size_t huge_page_size) {
+  if (huge_page_size == 0) {
+    void* p = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    return p == MAP_FAILED ? nullptr : static_cast<char*>(p);
+  }
+  // Map one more huge page and trim both ends, so the block is huge page aligned.
+  size_t align = huge_page_size;
+  void* p = mmap(nullptr, size + align, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS,
+                 -1, 0);
+  if (p == MAP_FAILED) {
+    return nullptr;
+  }
+  uintptr_t start = reinterpret_cast<uintptr_t>(p);
+  uintptr_t aligned = (start + align - 1) & ~(align - 1);
+  if (aligned > start) {
+    munmap(p, aligned - start);
+  }
+  if (aligned + size < start + size + align) {
+    munmap(reinterpret_cast<void*>(aligned + size), start + size + align - aligned - size);
+  }
+#if defined(MADV_HUGEPAGE)
+  madvise(reinterpret_cast<void*>(aligned), size, MADV_HUGEPAGE);
+#endif
+  return reinterpret_cast<char*>(aligned);
+}
+
+void* Arena::AllocInNewBlock(size_t size, size_t align) {
+  size_t block_size = next_block_size_;
+  while (block_size < size + align) {
+    block_size *= 2;
+  }
+  if (next_block_size_ < HUGE_PAGE_SIZE) {
+    next_block_size_ *= 2;
+  }
+  char* block = MapBlock(block_size, block_size >= HUGE_PAGE_SIZE ? HUGE_PAGE_SIZE : 0);
+  if (block == nullptr) {
+    fprintf(stderr, "failed to map arena block of %zu bytes\n", block_size);
+    abort();
+  }
+  blocks_.push_back(std::make_pair(block, block_size));
+  cur_ = block;
+  end_ = block + block_size;
+  return Alloc(size, align);
+}
+
+void Arena::Release() {
+  for (auto& block : blocks_) {
+    munmap(block.first, block.second);
+  }
+  blocks_.clear();
+  cur_ = end_ = nullptr;
+}
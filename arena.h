@@ -0,0 +1,88 @@
+#ifndef _UNWIND_ARENA_H_
+#define _UNWIND_ARENA_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <new>
+#include <utility>
+#include <vector>
+
+// A range of bytes owned by an Arena.
+struct ByteRange {
+  const char* begin;
+  const char* end;
+
+  ByteRange() : begin(nullptr), end(nullptr) {
+  }
+
+  size_t size() const {
+    return end - begin;
+  }
+};
+
+// Bump allocator for the records parsed from one dso. Memory is never freed
+// piece by piece, all blocks are released together when the Arena is
+// destroyed. So only trivially destructible types can be stored in it.
+class Arena {
+ public:
+  Arena() : cur_(nullptr), end_(nullptr), next_block_size_(MIN_BLOCK_SIZE),
+      allocated_bytes_(0) {
+  }
+
+  Arena(Arena&& other) : Arena() {
+    *this = std::move(other);
+  }
+
+  Arena& operator=(Arena&& other);
+
+  ~Arena() {
+    Release();
+  }
+
+  void* Alloc(size_t size, size_t align) {
+    uintptr_t p = (reinterpret_cast<uintptr_t>(cur_) + align - 1) & ~(align - 1);
+    if (cur_ == nullptr || p + size > reinterpret_cast<uintptr_t>(end_)) {
+      return AllocInNewBlock(size, align);
+    }
+    cur_ = reinterpret_cast<char*>(p + size);
+    allocated_bytes_ += size;
+    return reinterpret_cast<void*>(p);
+  }
+
+  template <typename T>
+  T* New() {
+    return new (Alloc(sizeof(T), alignof(T))) T();
+  }
+
+  ByteRange Copy(const char* begin, const char* end);
+  const char* CopyStr(const char* s);
+
+  // Bytes handed out by Alloc(), not including alignment padding.
+  size_t AllocatedBytes() const {
+    return allocated_bytes_;
+  }
+
+  // Bytes mapped for blocks.
+  size_t ReservedBytes() const;
+
+ private:
+  static constexpr size_t MIN_BLOCK_SIZE = 64 * 1024;
+  // Blocks reaching this size are aligned to it and backed by huge pages when
+  // the kernel allows.
+  static constexpr size_t HUGE_PAGE_SIZE = 2 * 1024 * 1024;
+
+  void* AllocInNewBlock(size_t size, size_t align);
+  void Release();
+
+  char* cur_;
+  char* end_;
+  size_t next_block_size_;
+  size_t allocated_bytes_;
+  std::vector<std::pair<char*, size_t>> blocks_;
+
+  Arena(const Arena&) = delete;
+  void operator=(const Arena&) = delete;
+};
+
+#endif  // _UNWIND_ARENA_H_
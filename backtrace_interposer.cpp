@@ -0,0 +1,236 @@
+// LD_PRELOAD-able replacement of glibc backtrace(), backtrace_symbols_fd()
+// and libgcc _Unwind_Backtrace(), using UnwindCursor instead of libgcc's
+// unwinder and its global lock.
+
+#include <dlfcn.h>
+#include <link.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <unwind.h>
+
+#include "elf_reader.h"
+#include "get_current_regs.h"
+#include "unwind.h"
+
+// The _Unwind_Context passed to the trace function of _Unwind_Backtrace() is
+// the UnwindCursor of this thread. The _Unwind_* functions below taking a
+// context answer for it, and forward other contexts (like those used while
+// throwing exceptions) to libgcc.
+static thread_local UnwindCursor* backtrace_cursor;
+
+static bool IsBacktraceContext(struct _Unwind_Context* context) {
+  return context != nullptr &&
+      reinterpret_cast<UnwindCursor*>(context) == backtrace_cursor;
+}
+
+// The Fde of the frame of a backtrace context is found by the Step() to its
+// caller, so step a copy of the cursor.
+static Fde* GetContextFde(struct _Unwind_Context* context, uint64_t* load_bias) {
+  UnwindCursor next = *reinterpret_cast<UnwindCursor*>(context);
+  next.Step();
+  return next.GetLastFde(load_bias);
+}
+
+template <typename FuncType>
+static FuncType GetNextFunction(const char* name) {
+  void* func = dlsym(RTLD_NEXT, name);
+  if (func == nullptr) {
+    fprintf(stderr, "can't find %s\n", name);
+    abort();
+  }
+  return reinterpret_cast<FuncType>(func);
+}
+
+extern "C" {
+
+int backtrace(void** buffer, int size) {
+  uint64_t regs[UNWIND_MAX_REGS];
+  GET_CURRENT_REGS(regs);
+  UnwindCursor cursor;
+  cursor.Init(regs);
+  // Like glibc, skip the frame of backtrace() itself.
+  int count = 0;
+  while (count < size && cursor.Step()) {
+    buffer[count++] = reinterpret_cast<void*>(cursor.GetPc());
+  }
+  return count;
+}
+
+static void WriteString(int fd, const char* s) {
+  size_t len = strlen(s);
+  while (len > 0) {
+    ssize_t n = write(fd, s, len);
+    if (n <= 0) {
+      return;
+    }
+    s += n;
+    len -= n;
+  }
+}
+
+// Write lines like glibc: "module(symbol+0xoffset)[0xaddr]", or
+// "module(+0xoffset)[0xaddr]" with the offset from the load bias when no
+// symbol is found. Only write() is used, as callers may be crashing.
+void backtrace_symbols_fd(void* const* buffer, int size, int fd) {
+  for (int i = 0; i < size; ++i) {
+    char line[64];
+    uintptr_t addr = reinterpret_cast<uintptr_t>(buffer[i]);
+    Dl_info info;
+    struct link_map* map = nullptr;
+    if (dladdr1(buffer[i], &info, reinterpret_cast<void**>(&map), RTLD_DL_LINKMAP) != 0 &&
+        info.dli_fname != nullptr) {
+      WriteString(fd, info.dli_fname);
+      uintptr_t base = (info.dli_sname != nullptr)
+                           ? reinterpret_cast<uintptr_t>(info.dli_saddr)
+                           : (map != nullptr ? map->l_addr : 0);
+      // Like glibc, nothing is added for addresses in a non-PIE executable
+      // without a symbol.
+      if (info.dli_sname != nullptr || base != 0) {
+        WriteString(fd, "(");
+        if (info.dli_sname != nullptr) {
+          WriteString(fd, info.dli_sname);
+        }
+        if (addr >= base) {
+          snprintf(line, sizeof(line), "+0x%lx)", static_cast<unsigned long>(addr - base));
+        } else {
+          snprintf(line, sizeof(line), "-0x%lx)", static_cast<unsigned long>(base - addr));
+        }
+        WriteString(fd, line);
+      }
+    }
+    snprintf(line, sizeof(line), "[%p]\n", buffer[i]);
+    WriteString(fd, line);
+  }
+}
+
+_Unwind_Reason_Code _Unwind_Backtrace(_Unwind_Trace_Fn trace, void* arg) {
+  uint64_t regs[UNWIND_MAX_REGS];
+  GET_CURRENT_REGS(regs);
+  UnwindCursor cursor;
+  cursor.Init(regs);
+  UnwindCursor* saved_cursor = backtrace_cursor;
+  backtrace_cursor = &cursor;
+  // Like libgcc, the first frame passed to trace is the caller.
+  _Unwind_Reason_Code result = _URC_END_OF_STACK;
+  while (cursor.Step()) {
+    struct _Unwind_Context* context = reinterpret_cast<struct _Unwind_Context*>(&cursor);
+    if (trace(context, arg) != _URC_NO_REASON) {
+      result = _URC_FATAL_PHASE1_ERROR;
+      break;
+    }
+  }
+  if (result == _URC_END_OF_STACK && !cursor.Finished()) {
+    result = _URC_FATAL_PHASE1_ERROR;
+  }
+  backtrace_cursor = saved_cursor;
+  return result;
+}
+
+_Unwind_Ptr _Unwind_GetIP(struct _Unwind_Context* context) {
+  static auto next = GetNextFunction<_Unwind_Ptr (*)(struct _Unwind_Context*)>("_Unwind_GetIP");
+  if (IsBacktraceContext(context)) {
+    return reinterpret_cast<UnwindCursor*>(context)->GetPc();
+  }
+  return next(context);
+}
+
+_Unwind_Ptr _Unwind_GetIPInfo(struct _Unwind_Context* context, int* ip_before_insn) {
+  static auto next = GetNextFunction<_Unwind_Ptr (*)(struct _Unwind_Context*, int*)>(
+      "_Unwind_GetIPInfo");
+  if (IsBacktraceContext(context)) {
+    *ip_before_insn = 0;
+    return reinterpret_cast<UnwindCursor*>(context)->GetPc();
+  }
+  return next(context, ip_before_insn);
+}
+
+_Unwind_Word _Unwind_GetGR(struct _Unwind_Context* context, int index) {
+  static auto next = GetNextFunction<_Unwind_Word (*)(struct _Unwind_Context*, int)>(
+      "_Unwind_GetGR");
+  if (IsBacktraceContext(context)) {
+    uint64_t value = 0;
+    reinterpret_cast<UnwindCursor*>(context)->GetReg(index, &value);
+    return value;
+  }
+  return next(context, index);
+}
+
+// Like libgcc, the cfa of a context is the sp of its frame.
+_Unwind_Word _Unwind_GetCFA(struct _Unwind_Context* context) {
+  static auto next = GetNextFunction<_Unwind_Word (*)(struct _Unwind_Context*)>(
+      "_Unwind_GetCFA");
+  if (IsBacktraceContext(context)) {
+    uint64_t value = 0;
+    reinterpret_cast<UnwindCursor*>(context)->GetReg(CURRENT_REGS_SP, &value);
+    return value;
+  }
+  return next(context);
+}
+
+_Unwind_Ptr _Unwind_GetRegionStart(struct _Unwind_Context* context) {
+  static auto next = GetNextFunction<_Unwind_Ptr (*)(struct _Unwind_Context*)>(
+      "_Unwind_GetRegionStart");
+  if (IsBacktraceContext(context)) {
+    uint64_t load_bias;
+    Fde* fde = GetContextFde(context, &load_bias);
+    return (fde != nullptr) ? fde->func_start + load_bias : 0;
+  }
+  return next(context);
+}
+
+void* _Unwind_GetLanguageSpecificData(struct _Unwind_Context* context) {
+  static auto next = GetNextFunction<void* (*)(struct _Unwind_Context*)>(
+      "_Unwind_GetLanguageSpecificData");
+  if (IsBacktraceContext(context)) {
+    uint64_t load_bias;
+    Fde* fde = GetContextFde(context, &load_bias);
+    if (fde == nullptr || fde->lsda == 0) {
+      return nullptr;
+    }
+    return reinterpret_cast<void*>(static_cast<uintptr_t>(fde->lsda + load_bias));
+  }
+  return next(context);
+}
+
+// Data and text relative pointer encodings aren't used on the supported
+// arches, where libgcc also returns 0.
+_Unwind_Ptr _Unwind_GetDataRelBase(struct _Unwind_Context* context) {
+  static auto next = GetNextFunction<_Unwind_Ptr (*)(struct _Unwind_Context*)>(
+      "_Unwind_GetDataRelBase");
+  if (IsBacktraceContext(context)) {
+    return 0;
+  }
+  return next(context);
+}
+
+_Unwind_Ptr _Unwind_GetTextRelBase(struct _Unwind_Context* context) {
+  static auto next = GetNextFunction<_Unwind_Ptr (*)(struct _Unwind_Context*)>(
+      "_Unwind_GetTextRelBase");
+  if (IsBacktraceContext(context)) {
+    return 0;
+  }
+  return next(context);
+}
+
+// Frames passed to trace functions can't be resumed, so setting their
+// registers is ignored.
+void _Unwind_SetGR(struct _Unwind_Context* context, int index, _Unwind_Word value) {
+  static auto next = GetNextFunction<void (*)(struct _Unwind_Context*, int, _Unwind_Word)>(
+      "_Unwind_SetGR");
+  if (!IsBacktraceContext(context)) {
+    next(context, index, value);
+  }
+}
+
+void _Unwind_SetIP(struct _Unwind_Context* context, _Unwind_Ptr value) {
+  static auto next = GetNextFunction<void (*)(struct _Unwind_Context*, _Unwind_Ptr)>(
+      "_Unwind_SetIP");
+  if (!IsBacktraceContext(context)) {
+    next(context, value);
+  }
+}
+
+}  // extern "C"
@@ -0,0 +1,70 @@
+// Measure backtrace() throughput with 1 or more threads, each taking
+// backtraces from under DEPTH recursive calls. Run it as is for glibc, and with
+// LD_PRELOAD=./libbacktrace_interposer.so for UnwindCursor.
+// `bench_backtrace symbols` prints a backtrace with backtrace_symbols_fd()
+// instead, to compare the formats.
+
+#include <execinfo.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <vector>
+
+static constexpr int ITERATIONS = 20000;
+static constexpr int DEPTH = 10;
+
+static uint64_t NowNs() {
+  timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+__attribute__((noinline)) static int TakeBacktraces() {
+  void* buffer[64];
+  int frames = 0;
+  for (int i = 0; i < ITERATIONS; ++i) {
+    frames += backtrace(buffer, 64);
+  }
+  return frames;
+}
+
+__attribute__((noinline)) static int Recurse(int depth) {
+  if (depth == 0) {
+    return TakeBacktraces();
+  }
+  int result = Recurse(depth - 1);
+  __asm__ __volatile__("");
+  return result + 1;
+}
+
+static void* ThreadMain(void*) {
+  Recurse(DEPTH);
+  return nullptr;
+}
+
+int main(int argc, char** argv) {
+  if (argc > 1 && strcmp(argv[1], "symbols") == 0) {
+    void* buffer[8];
+    int frames = backtrace(buffer, 8);
+    backtrace_symbols_fd(buffer, frames, STDOUT_FILENO);
+    return 0;
+  }
+  int thread_count = argc > 1 ? atoi(argv[1]) : 1;
+  std::vector<pthread_t> threads(thread_count);
+  uint64_t start = NowNs();
+  for (auto& thread : threads) {
+    pthread_create(&thread, nullptr, ThreadMain, nullptr);
+  }
+  for (auto& thread : threads) {
+    pthread_join(thread, nullptr);
+  }
+  double seconds = (NowNs() - start) / 1e9;
+  printf("%d threads: %.0f backtraces/s\n", thread_count,
+         static_cast<double>(thread_count) * ITERATIONS / seconds);
+  return 0;
+}
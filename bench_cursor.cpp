@@ -0,0 +1,58 @@
+// Measure UnwindCursor stepping the top few frames and the full stack, from
+// a fixed depth.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "get_current_regs.h"
+#include "unwind.h"
+
+static constexpr int ITERATIONS = 2000;
+static constexpr int DEPTH = 40;
+
+static uint64_t NowNs() {
+  timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+// Step until max_frames frames are seen, or the whole stack if it's 0.
+__attribute__((noinline)) static void Measure(int max_frames) {
+  int frames = 0;
+  uint64_t start = NowNs();
+  for (int i = 0; i < ITERATIONS; ++i) {
+    uint64_t regs[UNWIND_MAX_REGS];
+    GET_CURRENT_REGS(regs);
+    UnwindCursor cursor;
+    cursor.Init(regs);
+    frames = 1;
+    while ((max_frames == 0 || frames < max_frames) && cursor.Step()) {
+      frames++;
+    }
+  }
+  uint64_t ns = NowNs() - start;
+  if (max_frames == 0) {
+    printf("full stack: %d frames, %.1f us per unwind\n", frames, ns / 1e3 / ITERATIONS);
+  } else {
+    printf("top-%d: %.1f us per unwind\n", max_frames, ns / 1e3 / ITERATIONS);
+  }
+}
+
+__attribute__((noinline)) static int Recurse(int depth) {
+  if (depth == 0) {
+    Measure(1);
+    Measure(3);
+    Measure(0);
+    return 0;
+  }
+  int result = Recurse(depth - 1);
+  __asm__ __volatile__("");
+  return result + 1;
+}
+
+int main(int argc, char** argv) {
+  int depth = argc > 1 ? atoi(argv[1]) : DEPTH;
+  Recurse(depth);
+  return 0;
+}
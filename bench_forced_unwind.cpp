@@ -0,0 +1,79 @@
+// Measure forced unwinds: cancel threads parked under DEPTH frames, each
+// holding an object with a destructor, and join them all. Run
+// bench_forced_unwind_libgcc for libgcc running all cleanups, and
+// bench_forced_unwind for eh_unwind.cpp running them after the first one.
+// Usage: bench_forced_unwind [threads] [depth]
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <atomic>
+#include <vector>
+
+#include "prewarm.h"
+
+static constexpr int THREADS = 1000;
+static constexpr int DEPTH = 100;
+
+static std::atomic<int> destructor_count(0);
+static std::atomic<int> parked_count(0);
+
+static uint64_t NowNs() {
+  timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+struct D {
+  ~D() {
+    destructor_count++;
+  }
+};
+
+__attribute__((noinline)) static void Park(int depth) {
+  D d;
+  if (depth == 0) {
+    parked_count++;
+    while (true) {
+      pause();
+    }
+  }
+  Park(depth - 1);
+  __asm__ __volatile__("");
+}
+
+static void* ThreadMain(void* arg) {
+  D d;
+  Park(*static_cast<int*>(arg));
+  return nullptr;
+}
+
+int main(int argc, char** argv) {
+  int thread_count = argc > 1 ? atoi(argv[1]) : THREADS;
+  int depth = argc > 2 ? atoi(argv[2]) : DEPTH;
+  // Unwind tables are loaded first, so eh_unwind.cpp doesn't leave frames
+  // to libgcc for want of them.
+  Prewarm(nullptr);
+  BackgroundLoader::GetInstance().Wait();
+  std::vector<pthread_t> threads(thread_count);
+  for (auto& thread : threads) {
+    pthread_create(&thread, nullptr, ThreadMain, &depth);
+  }
+  while (parked_count < thread_count) {
+    usleep(1000);
+  }
+  uint64_t start = NowNs();
+  for (auto& thread : threads) {
+    pthread_cancel(thread);
+  }
+  for (auto& thread : threads) {
+    pthread_join(thread, nullptr);
+  }
+  double ms = (NowNs() - start) / 1e6;
+  printf("%d threads, depth %d: %.1f ms, %d of %d destructors run\n", thread_count, depth, ms,
+         destructor_count.load(), thread_count * (depth + 2));
+  return 0;
+}
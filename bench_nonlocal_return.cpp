@@ -0,0 +1,136 @@
+// Measure early exits from DEPTH frames, each holding an object with a
+// destructor: throw (of the system libstdc++), longjmp (skipping the
+// destructors) and nonlocal_return (running them). Also measure the cost of
+// registering the cleanups on paths returning normally.
+
+#include <setjmp.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <time.h>
+
+#include "nonlocal_return.h"
+
+static constexpr int ITERATIONS = 200000;
+static constexpr int DEPTHS[] = {1, 4, 16};
+
+static uint64_t destructor_count;
+static jmp_buf longjmp_env;
+static NonlocalTarget* nonlocal_target;
+
+struct Token {
+  char buf[16];
+  ~Token() {
+    destructor_count++;
+    __asm__ __volatile__("" : : : "memory");
+  }
+};
+
+struct ParseError {};
+
+static uint64_t NowNs() {
+  timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+__attribute__((noinline)) static void ExitByThrow(int depth) {
+  Token token;
+  if (depth == 1) {
+    throw ParseError();
+  }
+  ExitByThrow(depth - 1);
+  __asm__ __volatile__("");
+}
+
+__attribute__((noinline)) static void ExitByLongjmp(int depth) {
+  Token token;
+  if (depth == 1) {
+    longjmp(longjmp_env, 1);
+  }
+  ExitByLongjmp(depth - 1);
+  __asm__ __volatile__("");
+}
+
+__attribute__((noinline)) static void ExitByNonlocalReturn(int depth) {
+  Token token;
+  ScopedCleanup cleanup(RunDestructor<Token>, &token);
+  if (depth == 1) {
+    nonlocal_return(nonlocal_target, 1);
+  }
+  ExitByNonlocalReturn(depth - 1);
+  __asm__ __volatile__("");
+}
+
+__attribute__((noinline)) static void Return(int depth) {
+  Token token;
+  if (depth == 1) {
+    return;
+  }
+  Return(depth - 1);
+  __asm__ __volatile__("");
+}
+
+__attribute__((noinline)) static void ReturnRegistered(int depth) {
+  Token token;
+  ScopedCleanup cleanup(RunDestructor<Token>, &token);
+  if (depth == 1) {
+    return;
+  }
+  ReturnRegistered(depth - 1);
+  __asm__ __volatile__("");
+}
+
+static void Report(int depth, const char* name, uint64_t start, uint64_t destructors) {
+  printf("%2d frames %-16s %8.1f ns, %.0f destructors per exit\n", depth, name,
+         static_cast<double>(NowNs() - start) / ITERATIONS,
+         static_cast<double>(destructor_count - destructors) / ITERATIONS);
+}
+
+int main() {
+  for (int depth : DEPTHS) {
+    uint64_t destructors = destructor_count;
+    uint64_t start = NowNs();
+    for (int i = 0; i < ITERATIONS; ++i) {
+      try {
+        ExitByThrow(depth);
+      } catch (ParseError&) {
+      }
+    }
+    Report(depth, "throw", start, destructors);
+
+    destructors = destructor_count;
+    start = NowNs();
+    for (int i = 0; i < ITERATIONS; ++i) {
+      if (!setjmp(longjmp_env)) {
+        ExitByLongjmp(depth);
+      }
+    }
+    Report(depth, "longjmp", start, destructors);
+
+    destructors = destructor_count;
+    start = NowNs();
+    for (int i = 0; i < ITERATIONS; ++i) {
+      NonlocalTarget target;
+      nonlocal_target = &target;
+      if (!setjmp(target.env)) {
+        ExitByNonlocalReturn(depth);
+      }
+    }
+    Report(depth, "nonlocal_return", start, destructors);
+
+    destructors = destructor_count;
+    start = NowNs();
+    for (int i = 0; i < ITERATIONS; ++i) {
+      Return(depth);
+    }
+    Report(depth, "return", start, destructors);
+
+    destructors = destructor_count;
+    start = NowNs();
+    for (int i = 0; i < ITERATIONS; ++i) {
+      ReturnRegistered(depth);
+    }
+    Report(depth, "return+register", start, destructors);
+  }
+  return 0;
+}
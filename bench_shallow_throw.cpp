@@ -0,0 +1,79 @@
+// Measure throws caught a few frames up. Run bench_shallow_throw_libgcc for
+// the two phase unwind of libgcc, and bench_shallow_throw for the fast path
+// of eh_unwind.cpp, taken for handlers up to SetShallowThrowFrames() frames
+// away.
+// Usage: bench_shallow_throw [cleanup_frames]
+// With -1, the thrower is called by the handler frame. With 0 or more, that
+// many frames with a destructor are between them.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "prewarm.h"
+
+static constexpr int ITERATIONS = 200000;
+
+struct ParseError {
+  int code;
+};
+
+static int destructor_count;
+
+struct Guard {
+  ~Guard() {
+    destructor_count++;
+  }
+};
+
+static uint64_t NowNs() {
+  timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+__attribute__((noinline)) static void Parse(int i) {
+  if (i >= 0) {
+    throw ParseError{i};
+  }
+}
+
+__attribute__((noinline)) static void Guarded(int depth, int i) {
+  Guard guard;
+  if (depth == 0) {
+    Parse(i);
+  } else {
+    Guarded(depth - 1, i);
+  }
+}
+
+__attribute__((noinline)) static int ThrowAndCatch(int depth, int iterations) {
+  int caught = 0;
+  for (int i = 0; i < iterations; ++i) {
+    try {
+      if (depth < 0) {
+        Parse(i);
+      } else {
+        Guarded(depth, i);
+      }
+    } catch (ParseError&) {
+      caught++;
+    }
+  }
+  return caught;
+}
+
+int main(int argc, char** argv) {
+  int depth = argc > 1 ? atoi(argv[1]) : 0;
+  // The fast path only uses unwind tables already loaded.
+  Prewarm(nullptr);
+  BackgroundLoader::GetInstance().Wait();
+  ThrowAndCatch(depth, 1000);
+  uint64_t start = NowNs();
+  int caught = ThrowAndCatch(depth, ITERATIONS);
+  uint64_t ns = NowNs() - start;
+  printf("%d cleanup frames: %.0f ns per throw, %d caught, %d destructors run\n",
+         depth < 0 ? 0 : depth + 1, static_cast<double>(ns) / ITERATIONS, caught,
+         destructor_count);
+  return 0;
+}
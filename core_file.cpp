@@ -0,0 +1,276 @@
+#include "core_file.h"
+
+#include <elf.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/procfs.h>
+#include <sys/stat.h>
+#include <sys/user.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+#include <thread>
+
+#if defined(__x86_64__)
+static constexpr uint16_t CURRENT_MACHINE = EM_X86_64;
+#elif defined(__i386__)
+static constexpr uint16_t CURRENT_MACHINE = EM_386;
+#elif defined(__aarch64__)
+static constexpr uint16_t CURRENT_MACHINE = EM_AARCH64;
+#elif defined(__arm__)
+static constexpr uint16_t CURRENT_MACHINE = EM_ARM;
+#endif
+
+// Serves memory from PT_LOAD segments of a mapped core file.
+class CoreMemory : public UnwindMemory {
+ public:
+  CoreMemory(const char* addr, size_t size, std::vector<ElfSegment> segments)
+      : addr_(addr), size_(size), segments_(std::move(segments)) {
+    std::sort(segments_.begin(), segments_.end(), [](const ElfSegment& a, const ElfSegment& b) {
+      return a.vaddr < b.vaddr;
+    });
+  }
+
+  bool Read(uint64_t addr, void* buf, size_t size) override {
+    auto it = std::upper_bound(segments_.begin(), segments_.end(), addr,
+                               [](uint64_t addr, const ElfSegment& seg) {
+                                 return addr < seg.vaddr;
+                               });
+    if (it == segments_.begin()) {
+      return false;
+    }
+    --it;
+    // Pages not dumped, like those of read-only file mappings, have no data.
+    uint64_t offset_in_seg = addr - it->vaddr;
+    if (offset_in_seg >= it->filesz || size > it->filesz - offset_in_seg ||
+        it->offset + it->filesz > size_) {
+      return false;
+    }
+    memcpy(buf, addr_ + it->offset + offset_in_seg, size);
+    return true;
+  }
+
+ private:
+  const char* addr_;
+  size_t size_;
+  std::vector<ElfSegment> segments_;
+};
+
+static bool GetRegsFromPrstatus(const std::vector<char>& desc, CoreThread* thread) {
+  if (desc.size() < sizeof(elf_prstatus)) {
+    return false;
+  }
+  elf_prstatus prstatus;
+  memcpy(&prstatus, desc.data(), sizeof(prstatus));
+  thread->tid = prstatus.pr_pid;
+  thread->signo = prstatus.pr_cursig;
+  memset(thread->regs, 0, sizeof(thread->regs));
+  uintptr_t* regs = thread->regs;
+#if defined(__x86_64__)
+  const user_regs_struct* r = reinterpret_cast<const user_regs_struct*>(&prstatus.pr_reg);
+  const unsigned long long values[] = {
+    r->rax, r->rdx, r->rcx, r->rbx, r->rsi, r->rdi, r->rbp, r->rsp,
+    r->r8, r->r9, r->r10, r->r11, r->r12, r->r13, r->r14, r->r15, r->rip,
+  };
+  for (size_t i = 0; i < sizeof(values) / sizeof(values[0]); ++i) {
+    regs[i] = values[i];
+  }
+#elif defined(__i386__)
+  const user_regs_struct* r = reinterpret_cast<const user_regs_struct*>(&prstatus.pr_reg);
+  const long values[] = {
+    r->eax, r->edx, r->ecx, r->ebx, r->esp, r->ebp, r->esi, r->edi, r->eip,
+  };
+  for (size_t i = 0; i < sizeof(values) / sizeof(values[0]); ++i) {
+    regs[i] = values[i];
+  }
+#elif defined(__aarch64__)
+  // x0 to x30, sp and pc, like GetRegsFromUcontext().
+  for (int i = 0; i < 33; ++i) {
+    regs[i] = prstatus.pr_reg[i];
+  }
+#elif defined(__arm__)
+  for (int i = 0; i < 16; ++i) {
+    regs[i] = prstatus.pr_reg[i];
+  }
+#endif
+  return true;
+}
+
+// NT_FILE: count, page size, count * (start, end, page offset), then count
+// '\0' terminated file names. All numbers are words of the core.
+static bool ParseFileNote(const std::vector<char>& desc, bool is64,
+                          std::vector<CoreMapping>* mappings) {
+  size_t word_size = is64 ? 8 : 4;
+  const char* p = desc.data();
+  const char* end = p + desc.size();
+  auto read_word = [&](uint64_t* value) {
+    if (static_cast<size_t>(end - p) < word_size) {
+      return false;
+    }
+    *value = 0;
+    memcpy(value, p, word_size);
+    p += word_size;
+    return true;
+  };
+  uint64_t count;
+  uint64_t page_size;
+  if (!read_word(&count) || !read_word(&page_size) ||
+      count > desc.size() / (3 * word_size)) {
+    return false;
+  }
+  size_t first = mappings->size();
+  for (uint64_t i = 0; i < count; ++i) {
+    CoreMapping mapping;
+    uint64_t pgoff;
+    if (!read_word(&mapping.start) || !read_word(&mapping.end) || !read_word(&pgoff)) {
+      return false;
+    }
+    mapping.file_offset = pgoff * page_size;
+    mappings->push_back(mapping);
+  }
+  for (uint64_t i = 0; i < count; ++i) {
+    const char* name_end = static_cast<const char*>(memchr(p, '\0', end - p));
+    if (name_end == nullptr) {
+      return false;
+    }
+    (*mappings)[first + i].filename.assign(p, name_end);
+    p = name_end + 1;
+  }
+  return true;
+}
+
+std::unique_ptr<CoreFile> CoreFile::Open(const char* filename) {
+  std::unique_ptr<ElfReader> reader = ElfReader::OpenFile(filename, 0);
+  if (reader == nullptr) {
+    return nullptr;
+  }
+  if (!reader->IsCore()) {
+    fprintf(stderr, "%s isn't a core file\n", filename);
+    return nullptr;
+  }
+  if (reader->GetMachine() != CURRENT_MACHINE) {
+    fprintf(stderr, "%s is for machine %u, can't be unwound on this arch\n", filename,
+            reader->GetMachine());
+    return nullptr;
+  }
+  std::unique_ptr<CoreFile> core(new CoreFile);
+  if (!core->ReadNotes(reader.get())) {
+    fprintf(stderr, "failed to read notes of %s\n", filename);
+    return nullptr;
+  }
+  int fd = open(filename, O_RDONLY | O_CLOEXEC);
+  if (fd == -1) {
+    fprintf(stderr, "failed to open %s: %s\n", filename, strerror(errno));
+    return nullptr;
+  }
+  struct stat st;
+  if (fstat(fd, &st) != 0) {
+    fprintf(stderr, "failed to stat %s: %s\n", filename, strerror(errno));
+    close(fd);
+    return nullptr;
+  }
+  void* addr = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (addr == MAP_FAILED) {
+    fprintf(stderr, "failed to map %s: %s\n", filename, strerror(errno));
+    return nullptr;
+  }
+  core->addr_ = static_cast<const char*>(addr);
+  core->size_ = st.st_size;
+  std::vector<ElfSegment> segments = reader->GetSegments();
+  core->BuildMaps(segments);
+  std::vector<ElfSegment> loads;
+  for (auto& seg : segments) {
+    if (seg.type == PT_LOAD) {
+      loads.push_back(seg);
+    }
+  }
+  core->memory_.reset(new CoreMemory(core->addr_, core->size_, std::move(loads)));
+  return core;
+}
+
+CoreFile::~CoreFile() {
+  if (addr_ != nullptr) {
+    munmap(const_cast<char*>(addr_), size_);
+  }
+}
+
+bool CoreFile::ReadNotes(ElfReader* reader) {
+  std::vector<ElfNote> notes;
+  if (!reader->ReadNotes(&notes)) {
+    return false;
+  }
+  bool is64 = sizeof(uintptr_t) == 8;
+  for (auto& note : notes) {
+    if (note.name != "CORE") {
+      continue;
+    }
+    if (note.type == NT_PRSTATUS) {
+      CoreThread thread;
+      if (!GetRegsFromPrstatus(note.desc, &thread)) {
+        return false;
+      }
+      threads_.push_back(thread);
+    } else if (note.type == NT_FILE) {
+      if (!ParseFileNote(note.desc, is64, &mappings_)) {
+        return false;
+      }
+    } else if (note.type == NT_AUXV) {
+      const uintptr_t* p = reinterpret_cast<const uintptr_t*>(note.desc.data());
+      size_t count = note.desc.size() / (2 * sizeof(uintptr_t));
+      for (size_t i = 0; i < count && p[2 * i] != AT_NULL; ++i) {
+        auxv_.push_back(std::make_pair(p[2 * i], p[2 * i + 1]));
+      }
+    }
+  }
+  return true;
+}
+
+// Executable maps are file mappings covered by executable PT_LOAD segments.
+// The segments of file-backed text are in the core even if their pages aren't
+// dumped.
+void CoreFile::BuildMaps(const std::vector<ElfSegment>& segments) {
+  for (auto& mapping : mappings_) {
+    for (auto& seg : segments) {
+      if (seg.type == PT_LOAD && (seg.flags & PF_X) && seg.vaddr <= mapping.start &&
+          seg.vaddr + seg.memsz >= mapping.end) {
+        maps_.AddMap(mapping.start, mapping.end, mapping.filename);
+        break;
+      }
+    }
+  }
+}
+
+bool CoreFile::UnwindThread(const CoreThread& thread, std::vector<UnwindFrame>* frames) {
+  UnwindOptions options;
+  options.maps = &maps_;
+  options.memory = memory_.get();
+  return UnwindFromSignalContext(thread.regs, options, frames);
+}
+
+bool CoreFile::UnwindAllThreads(int jobs, std::vector<std::vector<UnwindFrame>>* stacks) {
+  stacks->clear();
+  stacks->resize(threads_.size());
+  std::atomic<size_t> next(0);
+  std::atomic<bool> result(true);
+  auto work = [&]() {
+    size_t i;
+    while ((i = next++) < threads_.size()) {
+      if (!UnwindThread(threads_[i], &(*stacks)[i])) {
+        result = false;
+      }
+    }
+  };
+  std::vector<std::thread> workers;
+  for (int i = 1; i < jobs && static_cast<size_t>(i) < threads_.size(); ++i) {
+    workers.emplace_back(work);
+  }
+  work();
+  for (auto& worker : workers) {
+    worker.join();
+  }
+  return result;
+}
@@ -0,0 +1,85 @@
+#ifndef _UNWIND_CORE_FILE_H_
+#define _UNWIND_CORE_FILE_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <memory>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "elf_reader.h"
+#include "map.h"
+#include "unwind.h"
+
+struct CoreThread {
+  int tid;
+  int signo;
+  // Word sized values in dwarf register order, like those saved by
+  // GET_CURRENT_REGS(), but with the pc the thread stopped at. Unwound with
+  // UnwindCursor::InitFromSignalContext().
+  uintptr_t regs[UNWIND_MAX_REGS];
+};
+
+// A file mapping from NT_FILE.
+struct CoreMapping {
+  uint64_t start;
+  uint64_t end;
+  uint64_t file_offset;
+  std::string filename;
+};
+
+// An ELF core file of a process of the current arch. Memory is served from
+// PT_LOAD segments of the mapped core, so only pages touched by unwinding are
+// read. Dsos are opened by the paths in NT_FILE on the local machine.
+class CoreFile {
+ public:
+  static std::unique_ptr<CoreFile> Open(const char* filename);
+
+  ~CoreFile();
+
+  const std::vector<CoreThread>& GetThreads() const {
+    return threads_;
+  }
+
+  const std::vector<CoreMapping>& GetMappings() const {
+    return mappings_;
+  }
+
+  // (type, value) pairs from NT_AUXV.
+  const std::vector<std::pair<uint64_t, uint64_t>>& GetAuxv() const {
+    return auxv_;
+  }
+
+  MapTree* GetMaps() {
+    return &maps_;
+  }
+
+  UnwindMemory* GetMemory() {
+    return memory_.get();
+  }
+
+  bool UnwindThread(const CoreThread& thread, std::vector<UnwindFrame>* frames);
+
+  // Unwind all threads with up to jobs threads. Return false if any thread
+  // isn't unwound to the end of its stack.
+  bool UnwindAllThreads(int jobs, std::vector<std::vector<UnwindFrame>>* stacks);
+
+ private:
+  CoreFile() : addr_(nullptr), size_(0) {
+  }
+
+  bool ReadNotes(ElfReader* reader);
+  void BuildMaps(const std::vector<ElfSegment>& segments);
+
+  const char* addr_;
+  size_t size_;
+  std::vector<CoreThread> threads_;
+  std::vector<CoreMapping> mappings_;
+  std::vector<std::pair<uint64_t, uint64_t>> auxv_;
+  MapTree maps_;
+  std::unique_ptr<UnwindMemory> memory_;
+};
+
+#endif  // _UNWIND_CORE_FILE_H_
@@ -0,0 +1,449 @@
+#include "crash_handler.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+
+#include "map.h"
+#include "snapshot.h"
+#include "unwind.h"
+
+static constexpr int CRASH_SIGNALS[] = {SIGSEGV, SIGBUS, SIGABRT, SIGFPE};
+static constexpr size_t CRASH_ALT_STACK_SIZE = 64 * 1024;
+// Time to wait for other threads to unwind themselves.
+static constexpr uint64_t CRASH_DUMP_TIMEOUT_NS = 200000000;
+static constexpr int CRASH_MAX_SNAPSHOT_REGIONS = 16;
+
+struct ThreadSlot {
+  std::atomic<int> tid;
+  std::atomic<bool> done;
+  uint16_t flags;
+  uint16_t frame_count;
+  uint64_t pcs[CRASH_MAX_FRAMES];
+  // Registers at the signal, kept for the snapshot.
+  uintptr_t regs[UNWIND_MAX_REGS];
+};
+
+struct CrashSnapshotRegion {
+  uint64_t start;
+  size_t size;
+};
+
+// Everything below is set up in InstallCrashHandler(), and only read or
+// written in place by the handlers.
+static char report_path[PATH_MAX];
+static ThreadSlot* thread_slots;
+static int crash_dump_signal;
+static std::atomic<int> crash_tid(0);
+static std::atomic<int> skipped_thread_count(0);
+// Actions of CRASH_SIGNALS before the first InstallCrashHandler().
+static struct sigaction old_crash_actions[sizeof(CRASH_SIGNALS) / sizeof(CRASH_SIGNALS[0])];
+static bool old_crash_actions_saved;
+static char snapshot_path[PATH_MAX];
+static char* snapshot_buf;
+static size_t snapshot_stack_bytes;
+static CrashSnapshotRegion snapshot_regions[CRASH_MAX_SNAPSHOT_REGIONS];
+static std::atomic<int> snapshot_region_count(0);
+
+static int GetTid() {
+  return syscall(SYS_gettid);
+}
+
+static uint64_t GetTimeInNs() {
+  timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return static_cast<uint64_t>(ts.tv_sec) * 1000000000 + ts.tv_nsec;
+}
+
+static void SleepUs(long us) {
+  timespec ts;
+  ts.tv_sec = 0;
+  ts.tv_nsec = us * 1000;
+  nanosleep(&ts, nullptr);
+}
+
+static void UnwindToSlot(void* ucontext, ThreadSlot* slot) {
+  uintptr_t* regs = slot->regs;
+  GetRegsFromUcontext(ucontext, regs);
+  UnwindOptions options;
+  options.signal_safe = true;
+  UnwindCursor cursor(options);
+  cursor.InitFromSignalContext(regs);
+  slot->frame_count = 0;
+  while (slot->frame_count < CRASH_MAX_FRAMES) {
+    slot->pcs[slot->frame_count++] = cursor.GetPc();
+    if (!cursor.Step()) {
+      break;
+    }
+  }
+  slot->flags = 0;
+  if (cursor.Finished()) {
+    slot->flags |= CRASH_THREAD_FINISHED;
+  }
+  if (cursor.IsUnresolved()) {
+    slot->flags |= CRASH_THREAD_UNRESOLVED;
+  }
+}
+
+// Buffers small writes, so the report is written in a few write() calls.
+class ReportWriter {
+ public:
+  explicit ReportWriter(int fd) : fd_(fd), size_(0), failed_(false) {
+  }
+
+  void Write(const void* data, size_t size) {
+    const char* p = static_cast<const char*>(data);
+    while (size > 0) {
+      if (size_ == sizeof(buf_)) {
+        Flush();
+      }
+      size_t n = sizeof(buf_) - size_;
+      if (n > size) {
+        n = size;
+      }
+      memcpy(buf_ + size_, p, n);
+      size_ += n;
+      p += n;
+      size -= n;
+    }
+  }
+
+  bool Flush() {
+    const char* p = buf_;
+    while (size_ > 0 && !failed_) {
+      ssize_t n = TEMP_FAILURE_RETRY(write(fd_, p, size_));
+      if (n <= 0) {
+        failed_ = true;
+        break;
+      }
+      p += n;
+      size_ -= n;
+    }
+    size_ = 0;
+    return !failed_;
+  }
+
+ private:
+  int fd_;
+  char buf_[4096];
+  size_t size_;
+  bool failed_;
+};
+
+static void WriteReport(int signo, siginfo_t* info, int thread_count) {
+  int fd = open(report_path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+  if (fd == -1) {
+    return;
+  }
+  ProcessMapsGuard maps_guard;
+  MapTree* map_tree = MapTree::GetProcessMaps();
+  ReportWriter writer(fd);
+  CrashReportHeader header;
+  memset(&header, 0, sizeof(header));
+  header.magic = CRASH_REPORT_MAGIC;
+  header.version = CRASH_REPORT_VERSION;
+  header.pid = getpid();
+  header.crash_tid = crash_tid;
+  header.signo = signo;
+  header.si_code = info->si_code;
+  header.fault_addr = reinterpret_cast<uintptr_t>(info->si_addr);
+  header.thread_count = thread_count;
+  header.map_count = map_tree->GetMaps().size();
+  header.skipped_thread_count = skipped_thread_count;
+  writer.Write(&header, sizeof(header));
+  for (int i = 0; i < thread_count; ++i) {
+    ThreadSlot& slot = thread_slots[i];
+    CrashReportThread thread;
+    thread.tid = slot.tid;
+    thread.flags = slot.flags;
+    thread.frame_count = slot.frame_count;
+    if (!slot.done) {
+      thread.flags = CRASH_THREAD_TIMEOUT;
+      thread.frame_count = 0;
+    }
+    writer.Write(&thread, sizeof(thread));
+    writer.Write(slot.pcs, thread.frame_count * sizeof(uint64_t));
+  }
+  for (auto& pair : map_tree->GetMaps()) {
+    const Map& map = pair.second;
+    ElfReader* reader = map.dso_reader;
+    CrashReportMap m;
+    memset(&m, 0, sizeof(m));
+    m.start = map.start;
+    m.end = map.end;
+    m.min_vaddr = (reader != nullptr) ? reader->GetMinVaddr() : 0;
+    m.name_size = map.dso.size();
+    m.build_id_size = (reader != nullptr) ? reader->GetBuildId().size() : 0;
+    writer.Write(&m, sizeof(m));
+    if (m.build_id_size != 0) {
+      writer.Write(reader->GetBuildId().data(), m.build_id_size);
+    }
+    writer.Write(map.dso.data(), m.name_size);
+  }
+  writer.Flush();
+  close(fd);
+}
+
+static void WriteSnapshot(int signo, int thread_count) {
+  int fd = open(snapshot_path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+  if (fd == -1) {
+    return;
+  }
+  SnapshotWriter writer(fd, snapshot_buf, snapshot_stack_bytes);
+  writer.WriteHeader();
+  for (int i = 0; i < thread_count; ++i) {
+    ThreadSlot& slot = thread_slots[i];
+    if (slot.done && slot.frame_count != 0) {
+      writer.WriteThread(slot.tid, (i == 0) ? signo : 0, slot.regs, snapshot_stack_bytes);
+    }
+  }
+  ProcessMapsGuard maps_guard;
+  writer.WriteModules(MapTree::GetProcessMaps());
+  int region_count = snapshot_region_count;
+  for (int i = 0; i < region_count; ++i) {
+    CrashSnapshotRegion& region = snapshot_regions[i];
+    for (size_t off = 0; off < region.size; off += snapshot_stack_bytes) {
+      writer.WriteRegion(region.start + off, std::min(snapshot_stack_bytes, region.size - off));
+    }
+  }
+  writer.Finish();
+  close(fd);
+}
+
+// Linux dirent layout returned by getdents64, not declared by libc.
+struct LinuxDirent64 {
+  uint64_t d_ino;
+  int64_t d_off;
+  unsigned short d_reclen;
+  unsigned char d_type;
+  char d_name[];
+};
+
+// Send dump_signal to all other threads, return the count of used slots.
+// Slot 0 is the crashing thread. Threads beyond CRASH_MAX_THREADS are counted
+// in skipped_thread_count.
+static int StopOtherThreads(int dump_signal) {
+  int fd = open("/proc/self/task", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+  if (fd == -1) {
+    return 1;
+  }
+  pid_t pid = getpid();
+  int self = crash_tid;
+  int count = 1;
+  char buf[4096];
+  long n;
+  while ((n = syscall(SYS_getdents64, fd, buf, sizeof(buf))) > 0) {
+    for (long pos = 0; pos < n;) {
+      LinuxDirent64* entry = reinterpret_cast<LinuxDirent64*>(buf + pos);
+      pos += entry->d_reclen;
+      int tid = 0;
+      const char* p = entry->d_name;
+      for (; *p >= '0' && *p <= '9'; ++p) {
+        tid = tid * 10 + (*p - '0');
+      }
+      if (*p != '\0' || tid == 0 || tid == self) {
+        continue;
+      }
+      if (count == CRASH_MAX_THREADS) {
+        skipped_thread_count++;
+        continue;
+      }
+      ThreadSlot& slot = thread_slots[count++];
+      slot.done = false;
+      slot.frame_count = 0;
+      slot.tid = tid;
+      if (syscall(SYS_tgkill, pid, tid, dump_signal) != 0) {
+        // The thread has exited.
+        slot.flags = 0;
+        slot.done = true;
+      }
+    }
+  }
+  close(fd);
+  return count;
+}
+
+static void WaitOtherThreads(int thread_count) {
+  uint64_t deadline = GetTimeInNs() + CRASH_DUMP_TIMEOUT_NS;
+  for (int i = 1; i < thread_count; ++i) {
+    while (!thread_slots[i].done && GetTimeInNs() < deadline) {
+      SleepUs(100);
+    }
+  }
+}
+
+static void DumpSignalHandler(int, siginfo_t*, void* ucontext) {
+  if (crash_tid == 0) {
+    return;
+  }
+  int tid = GetTid();
+  for (int i = 1; i < CRASH_MAX_THREADS; ++i) {
+    ThreadSlot& slot = thread_slots[i];
+    if (slot.tid == tid && !slot.done) {
+      UnwindToSlot(ucontext, &slot);
+      slot.done = true;
+      break;
+    }
+  }
+  // Stay stopped until the report is written. The process is usually killed
+  // by the crash signal then, but a chained handler may recover from it.
+  while (crash_tid != 0) {
+    SleepUs(1000);
+  }
+}
+
+static void RestoreOldCrashActions() {
+  if (!old_crash_actions_saved) {
+    return;
+  }
+  for (size_t i = 0; i < sizeof(CRASH_SIGNALS) / sizeof(CRASH_SIGNALS[0]); ++i) {
+    sigaction(CRASH_SIGNALS[i], &old_crash_actions[i], nullptr);
+  }
+}
+
+static void CrashSignalHandler(int signo, siginfo_t* info, void* ucontext) {
+  int tid = GetTid();
+  int expected = 0;
+  if (!crash_tid.compare_exchange_strong(expected, tid)) {
+    if (expected == tid) {
+      // Crashed again while writing the report, let the default action run.
+      signal(signo, SIG_DFL);
+      return;
+    }
+    // Another thread is writing the report. Once it is done, returning faults
+    // again into the restored actions.
+    while (crash_tid != 0) {
+      SleepUs(1000);
+    }
+    if (info->si_code <= 0) {
+      syscall(SYS_tgkill, getpid(), tid, signo);
+    }
+    return;
+  }
+  ThreadSlot& slot = thread_slots[0];
+  slot.tid = tid;
+  UnwindToSlot(ucontext, &slot);
+  slot.done = true;
+  int thread_count = StopOtherThreads(crash_dump_signal);
+  WaitOtherThreads(thread_count);
+  WriteReport(signo, info, thread_count);
+  if (snapshot_path[0] != '\0') {
+    WriteSnapshot(signo, thread_count);
+  }
+
+  // Returning with the old actions restored faults again into the old handler
+  // or the default action, or lets abort() go on. Signals sent by kill() need
+  // to be raised again, they are delivered once this handler returns.
+  RestoreOldCrashActions();
+  crash_tid = 0;
+  if (info->si_code <= 0) {
+    syscall(SYS_tgkill, getpid(), tid, signo);
+  }
+}
+
+bool InstallCrashAltStack() {
+  stack_t ss;
+  ss.ss_sp = mmap(nullptr, CRASH_ALT_STACK_SIZE, PROT_READ | PROT_WRITE,
+                  MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (ss.ss_sp == MAP_FAILED) {
+    fprintf(stderr, "failed to map alternate signal stack: %s\n", strerror(errno));
+    return false;
+  }
+  ss.ss_size = CRASH_ALT_STACK_SIZE;
+  ss.ss_flags = 0;
+  if (sigaltstack(&ss, nullptr) != 0) {
+    fprintf(stderr, "sigaltstack failed: %s\n", strerror(errno));
+    munmap(ss.ss_sp, CRASH_ALT_STACK_SIZE);
+    return false;
+  }
+  return true;
+}
+
+bool InstallCrashHandler(const char* path, int dump_signal) {
+  if (strlen(path) >= sizeof(report_path)) {
+    fprintf(stderr, "crash report path %s is too long\n", path);
+    return false;
+  }
+  strcpy(report_path, path);
+  if (thread_slots == nullptr) {
+    void* p = mmap(nullptr, sizeof(ThreadSlot) * CRASH_MAX_THREADS, PROT_READ | PROT_WRITE,
+                   MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (p == MAP_FAILED) {
+      fprintf(stderr, "failed to map crash thread slots: %s\n", strerror(errno));
+      return false;
+    }
+    thread_slots = static_cast<ThreadSlot*>(p);
+  }
+  {
+    ProcessMapsGuard maps_guard;
+    MapTree::RefreshProcessMaps(MapTree::GetProcessMaps())->LoadUnwindSections();
+  }
+  stack_t old_ss;
+  if (sigaltstack(nullptr, &old_ss) == 0 && (old_ss.ss_flags & SS_DISABLE) &&
+      !InstallCrashAltStack()) {
+    return false;
+  }
+  crash_dump_signal = dump_signal;
+  struct sigaction sa;
+  memset(&sa, 0, sizeof(sa));
+  sigemptyset(&sa.sa_mask);
+  sa.sa_sigaction = DumpSignalHandler;
+  sa.sa_flags = SA_SIGINFO | SA_RESTART;
+  if (sigaction(dump_signal, &sa, nullptr) != 0) {
+    fprintf(stderr, "failed to set handler of signal %d: %s\n", dump_signal, strerror(errno));
+    return false;
+  }
+  sa.sa_sigaction = CrashSignalHandler;
+  sa.sa_flags = SA_SIGINFO | SA_ONSTACK;
+  for (size_t i = 0; i < sizeof(CRASH_SIGNALS) / sizeof(CRASH_SIGNALS[0]); ++i) {
+    int signo = CRASH_SIGNALS[i];
+    // Calling again keeps the actions saved by the first call.
+    struct sigaction* old = old_crash_actions_saved ? nullptr : &old_crash_actions[i];
+    if (sigaction(signo, &sa, old) != 0) {
+      fprintf(stderr, "failed to set handler of signal %d: %s\n", signo, strerror(errno));
+      return false;
+    }
+  }
+  old_crash_actions_saved = true;
+  return true;
+}
+
+bool SetCrashSnapshot(const char* path, size_t stack_bytes) {
+  if (strlen(path) >= sizeof(snapshot_path)) {
+    fprintf(stderr, "crash snapshot path %s is too long\n", path);
+    return false;
+  }
+  if (snapshot_buf == nullptr) {
+    void* p = mmap(nullptr, stack_bytes, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS,
+                   -1, 0);
+    if (p == MAP_FAILED) {
+      fprintf(stderr, "failed to map crash snapshot buffer: %s\n", strerror(errno));
+      return false;
+    }
+    snapshot_buf = static_cast<char*>(p);
+    snapshot_stack_bytes = stack_bytes;
+  }
+  strcpy(snapshot_path, path);
+  return true;
+}
+
+bool AddCrashSnapshotRegion(const void* start, size_t size) {
+  int i = snapshot_region_count;
+  if (i == CRASH_MAX_SNAPSHOT_REGIONS) {
+    fprintf(stderr, "too many crash snapshot regions\n");
+    return false;
+  }
+  snapshot_regions[i].start = reinterpret_cast<uintptr_t>(start);
+  snapshot_regions[i].size = size;
+  snapshot_region_count = i + 1;
+  return true;
+}
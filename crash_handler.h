@@ -0,0 +1,83 @@
+#ifndef _UNWIND_CRASH_HANDLER_H_
+#define _UNWIND_CRASH_HANDLER_H_
+
+#include <signal.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// Layout of a crash report file. It contains a header, the stacks of all
+// threads, and the executable maps of the process, so the pcs can be
+// symbolized offline. A stack is a CrashReportThread followed by frame_count
+// uint64_t pcs. A map is a CrashReportMap followed by build_id_size bytes of
+// build id and name_size bytes of dso name, without '\0'.
+static constexpr uint32_t CRASH_REPORT_MAGIC = 0x52435755;  // "UWCR"
+static constexpr uint32_t CRASH_REPORT_VERSION = 2;
+
+struct CrashReportHeader {
+  uint32_t magic;
+  uint32_t version;
+  int32_t pid;
+  int32_t crash_tid;
+  int32_t signo;
+  int32_t si_code;
+  uint64_t fault_addr;
+  uint32_t thread_count;
+  uint32_t map_count;
+  // Threads not dumped, as there were more than CRASH_MAX_THREADS.
+  uint32_t skipped_thread_count;
+  uint32_t reserved;
+};
+
+// Flags of CrashReportThread.
+static constexpr uint16_t CRASH_THREAD_FINISHED = 1;
+// Stopped at a dso whose unwind table wasn't loaded when installing.
+static constexpr uint16_t CRASH_THREAD_UNRESOLVED = 2;
+// The thread didn't answer the dump signal in time, it has no frames.
+static constexpr uint16_t CRASH_THREAD_TIMEOUT = 4;
+
+struct CrashReportThread {
+  int32_t tid;
+  uint16_t flags;
+  uint16_t frame_count;
+};
+
+struct CrashReportMap {
+  uint64_t start;
+  uint64_t end;
+  // vaddr_in_file of a pc is pc - start + min_vaddr.
+  uint64_t min_vaddr;
+  uint16_t name_size;
+  uint16_t build_id_size;
+  uint32_t reserved;
+};
+
+static constexpr int CRASH_MAX_THREADS = 1024;
+static constexpr int CRASH_MAX_FRAMES = 64;
+
+// Install handlers of SIGSEGV, SIGBUS, SIGABRT and SIGFPE writing a crash
+// report to report_path. Everything the handlers need is prepared here: the
+// unwind tables of all executable maps are loaded, and the buffers for the
+// stacks are allocated. In the handler, the crashing thread is unwound from
+// its signal context, other threads are sent dump_signal with tgkill() and
+// unwind themselves, then the report is written with write() only. Then the
+// handlers installed before are restored, and the signal goes on to them, or
+// to the default action.
+// Call it again after dlopen() to load the unwind tables of new dsos.
+bool InstallCrashHandler(const char* report_path, int dump_signal = SIGRTMIN + 3);
+
+// Crash handlers run on an alternate signal stack, so stack overflows can be
+// reported. InstallCrashHandler() sets it up for the calling thread, other
+// threads can call this to have one.
+bool InstallCrashAltStack();
+
+// Also write a snapshot (see snapshot.h) to path when crashing, with
+// stack_bytes of stack from the sp of each unwound thread. The buffer for
+// copying memory is allocated by the first call.
+bool SetCrashSnapshot(const char* path, size_t stack_bytes = 32 * 1024);
+
+// Add a memory range to crash snapshots, like a heap object worth looking at
+// offline. Ranges are read with process_vm_readv(), and cut at the first
+// unreadable page.
+bool AddCrashSnapshotRegion(const void* start, size_t size);
+
+#endif  // _UNWIND_CRASH_HANDLER_H_
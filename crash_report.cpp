@@ -0,0 +1,105 @@
+// Print a crash report written by the crash handler. Pcs are printed as
+// dso and vaddr_in_file, which can be symbolized with addr2line.
+
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <string>
+#include <vector>
+
+#include "crash_handler.h"
+
+struct ReportMap {
+  CrashReportMap map;
+  std::string build_id;
+  std::string name;
+};
+
+static bool ReadFully(FILE* fp, void* buf, size_t size) {
+  return size == 0 || fread(buf, size, 1, fp) == 1;
+}
+
+static bool ReadString(FILE* fp, size_t size, std::string* s) {
+  s->resize(size);
+  return ReadFully(fp, &(*s)[0], size);
+}
+
+static void PrintPc(uint64_t pc, const std::vector<ReportMap>& maps) {
+  for (auto& m : maps) {
+    if (pc >= m.map.start && pc < m.map.end) {
+      printf("  0x%016" PRIx64 "  %s+0x%" PRIx64 "\n", pc, m.name.c_str(),
+             pc - m.map.start + m.map.min_vaddr);
+      return;
+    }
+  }
+  printf("  0x%016" PRIx64 "  ???\n", pc);
+}
+
+static bool PrintReport(const char* filename) {
+  FILE* fp = fopen(filename, "rbe");
+  if (fp == nullptr) {
+    fprintf(stderr, "can't open %s\n", filename);
+    return false;
+  }
+  CrashReportHeader header;
+  if (!ReadFully(fp, &header, sizeof(header)) || header.magic != CRASH_REPORT_MAGIC ||
+      header.version != CRASH_REPORT_VERSION) {
+    fprintf(stderr, "%s isn't a crash report\n", filename);
+    fclose(fp);
+    return false;
+  }
+  struct Thread {
+    CrashReportThread thread;
+    std::vector<uint64_t> pcs;
+  };
+  std::vector<Thread> threads(header.thread_count);
+  for (auto& t : threads) {
+    if (!ReadFully(fp, &t.thread, sizeof(t.thread))) {
+      break;
+    }
+    t.pcs.resize(t.thread.frame_count);
+    if (!ReadFully(fp, t.pcs.data(), t.pcs.size() * sizeof(uint64_t))) {
+      break;
+    }
+  }
+  std::vector<ReportMap> maps(header.map_count);
+  for (auto& m : maps) {
+    if (!ReadFully(fp, &m.map, sizeof(m.map)) ||
+        !ReadString(fp, m.map.build_id_size, &m.build_id) ||
+        !ReadString(fp, m.map.name_size, &m.name)) {
+      fprintf(stderr, "%s is truncated\n", filename);
+      fclose(fp);
+      return false;
+    }
+  }
+  fclose(fp);
+  printf("pid %d, tid %d, signal %d, code %d, fault addr 0x%" PRIx64 "\n", header.pid,
+         header.crash_tid, header.signo, header.si_code, header.fault_addr);
+  if (header.skipped_thread_count != 0) {
+    printf("%u threads not dumped\n", header.skipped_thread_count);
+  }
+  for (auto& t : threads) {
+    const char* state = "";
+    if (t.thread.flags & CRASH_THREAD_TIMEOUT) {
+      state = " (timeout)";
+    } else if (t.thread.flags & CRASH_THREAD_UNRESOLVED) {
+      state = " (unresolved)";
+    } else if (!(t.thread.flags & CRASH_THREAD_FINISHED)) {
+      state = " (incomplete)";
+    }
+    printf("thread %d%s\n", t.thread.tid, state);
+    for (auto pc : t.pcs) {
+      PrintPc(pc, maps);
+    }
+  }
+  return true;
+}
+
+int main(int argc, char** argv) {
+  if (argc != 2) {
+    fprintf(stderr, "usage: crash_report <report_file>\n");
+    exit(1);
+  }
+  return PrintReport(argv[1]) ? 0 : 1;
+}
@@ -5,8 +5,28 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+#include <time.h>
+#include <unwind.h>
+
+#include <algorithm>
+#include <atomic>
+#include <typeinfo>
+
+#include "eh_unwind.h"
+#include "exception_stats.h"
+#include "lsda.h"
 
+// eh_unwind.cpp is optional, see eh_unwind.h.
+#pragma weak EhUnwind
+#pragma weak EhInstallContext
+#pragma weak EhCaptureThrowStack
+
+// Benchmarks build it with NDEBUG, to time the runtime without the prints.
+#if !defined(NDEBUG)
 #define DEBUG
+#endif
 
 #if defined(DEBUG)
 #define D(format,...) \
@@ -24,6 +44,462 @@ namespace __cxxabiv1 {
 #define EXCEPTION_BUFF_SIZE 255
 static char exception_buff[EXCEPTION_BUFF_SIZE];
 
+// Throw sampling, see exception_stats.h.
+static constexpr int THROW_SAMPLE_TABLE_SIZE = 1024;
+// Frames of the sampler and __cxa_throw, captured before the wanted ones.
+static constexpr int THROW_SAMPLE_EXTRA_FRAMES = 4;
+// Checks of an entry being filled by another thread, before dropping the
+// sample.
+static constexpr int THROW_SAMPLE_READY_SPINS = 128;
+
+struct ThrowSampleEntry {
+  // Hash of type and pcs, 0 if the entry is unused.
+  std::atomic<uint64_t> hash;
+  // Set after sample is filled by the thread taking the entry.
+  std::atomic<bool> ready;
+  std::atomic<uint64_t> count;
+  ThrowSample sample;
+};
+
+static ThrowSampleEntry throw_sample_table[THROW_SAMPLE_TABLE_SIZE];
+static std::atomic<uint32_t> throw_sample_period;
+static std::atomic<int> throw_sample_max_frames;
+static std::atomic<ThrowStackCapture> throw_stack_capture;
+static std::atomic<uint64_t> dropped_throw_samples;
+// Throws left before the next sample in this thread.
+static __thread uint32_t throw_countdown;
+static __thread uint32_t throw_sample_random;
+
+struct BacktraceState {
+  uintptr_t* pcs;
+  int count;
+  int max_frames;
+};
+
+static _Unwind_Reason_Code BacktraceCallback(_Unwind_Context* context, void* arg) {
+  BacktraceState* state = static_cast<BacktraceState*>(arg);
+  if (state->count == state->max_frames) {
+    return _URC_END_OF_STACK;
+  }
+  state->pcs[state->count++] = _Unwind_GetIP(context);
+  return _URC_NO_REASON;
+}
+
+static int CaptureByUnwindBacktrace(uintptr_t* pcs, int max_frames) {
+  BacktraceState state;
+  state.pcs = pcs;
+  state.count = 0;
+  state.max_frames = max_frames;
+  _Unwind_Backtrace(BacktraceCallback, &state);
+  return state.count;
+}
+
+static uint64_t HashThrowSample(const std::type_info* type, const uintptr_t* pcs, int count) {
+  uint64_t hash = 14695981039346656037ULL ^ reinterpret_cast<uintptr_t>(type);
+  for (int i = 0; i < count; ++i) {
+    hash = (hash ^ pcs[i]) * 1099511628211ULL;
+  }
+  return (hash != 0) ? hash : 1;
+}
+
+// Count a sample in the table. Entries are taken by setting their hash, and
+// never freed, so the table needs no lock.
+static void AddThrowSample(const std::type_info* type, const uintptr_t* pcs, int count) {
+  uint64_t hash = HashThrowSample(type, pcs, count);
+  for (int i = 0; i < THROW_SAMPLE_TABLE_SIZE; ++i) {
+    ThrowSampleEntry& entry = throw_sample_table[(hash + i) % THROW_SAMPLE_TABLE_SIZE];
+    uint64_t entry_hash = entry.hash.load(std::memory_order_acquire);
+    if (entry_hash == 0 && entry.hash.compare_exchange_strong(entry_hash, hash)) {
+      entry.sample.type = type;
+      entry.sample.frame_count = count;
+      memcpy(entry.sample.pcs, pcs, count * sizeof(uintptr_t));
+      entry.ready.store(true, std::memory_order_release);
+      entry.count.fetch_add(1, std::memory_order_relaxed);
+      return;
+    }
+    if (entry_hash != hash) {
+      continue;
+    }
+    // Another thread may still be filling the entry. Don't wait for it long:
+    // it may be preempted, or be this thread interrupted by a signal handler.
+    int spins = 0;
+    while (!entry.ready.load(std::memory_order_acquire)) {
+      if (++spins == THROW_SAMPLE_READY_SPINS) {
+        dropped_throw_samples.fetch_add(1, std::memory_order_relaxed);
+        return;
+      }
+    }
+    if (entry.sample.type == type && entry.sample.frame_count == count &&
+        memcmp(entry.sample.pcs, pcs, count * sizeof(uintptr_t)) == 0) {
+      entry.count.fetch_add(1, std::memory_order_relaxed);
+      return;
+    }
+  }
+  dropped_throw_samples.fetch_add(1, std::memory_order_relaxed);
+}
+
+static inline bool ShouldSampleThrow() {
+  uint32_t period = throw_sample_period.load(std::memory_order_relaxed);
+  if (period == 0) {
+    return false;
+  }
+  uint32_t countdown = throw_countdown;
+  if (countdown > 1 && countdown < 2 * period) {
+    throw_countdown = countdown - 1;
+    return false;
+  }
+  // The distance to the next sample is random in [1, 2 * period - 1], so
+  // throws repeating in a cycle aren't always sampled at the same step.
+  uint32_t x = throw_sample_random;
+  if (x == 0) {
+    x = static_cast<uint32_t>(reinterpret_cast<uintptr_t>(&throw_countdown)) | 1;
+  }
+  x ^= x << 13;
+  x ^= x >> 17;
+  x ^= x << 5;
+  throw_sample_random = x;
+  throw_countdown = 1 + x % (2 * period - 1);
+  return countdown != 0;
+}
+
+static __attribute__((noinline)) void SampleThrow(const std::type_info* type,
+                                                  uintptr_t caller_pc) {
+  int max_frames = throw_sample_max_frames.load(std::memory_order_relaxed);
+  ThrowStackCapture capture = throw_stack_capture.load(std::memory_order_relaxed);
+  if (capture == nullptr) {
+    capture = (EhCaptureThrowStack != nullptr) ? EhCaptureThrowStack : CaptureByUnwindBacktrace;
+  }
+  uintptr_t pcs[THROW_SAMPLE_MAX_FRAMES + THROW_SAMPLE_EXTRA_FRAMES];
+  int count = capture(pcs, max_frames + THROW_SAMPLE_EXTRA_FRAMES);
+  if (count == 0 && capture != CaptureByUnwindBacktrace) {
+    count = CaptureByUnwindBacktrace(pcs, max_frames + THROW_SAMPLE_EXTRA_FRAMES);
+  }
+  int start = 0;
+  for (int i = 0; i < count; ++i) {
+    if (pcs[i] == caller_pc) {
+      start = i;
+      break;
+    }
+  }
+  AddThrowSample(type, pcs + start, std::min(count - start, max_frames));
+}
+
+void SetThrowSampling(uint32_t period, int max_frames, ThrowStackCapture capture) {
+  throw_sample_max_frames = std::max(1, std::min(max_frames, THROW_SAMPLE_MAX_FRAMES));
+  throw_stack_capture = capture;
+  throw_sample_period = std::min(period, 1u << 30);
+}
+
+size_t GetThrowSamples(void (*callback)(const ThrowSample* sample, void* arg), void* arg) {
+  size_t n = 0;
+  for (auto& entry : throw_sample_table) {
+    if (entry.ready.load(std::memory_order_acquire)) {
+      ThrowSample sample = entry.sample;
+      sample.count = entry.count.load(std::memory_order_relaxed);
+      callback(&sample, arg);
+      ++n;
+    }
+  }
+  return n;
+}
+
+uint64_t GetDroppedThrowSamples() {
+  return dropped_throw_samples;
+}
+
+// Throw instrumentation, see exception_stats.h. Each thread adds to its own
+// stats, so counters are only written by one thread, and read by others with
+// relaxed atomics.
+struct ThrowThreadStats {
+  ThrowThreadStats* next;
+  std::atomic<uint64_t> counters[sizeof(ThrowStats) / sizeof(uint64_t)];
+  // The throw in progress.
+  bool active;
+  uint64_t start_ns;
+  uint64_t phase1_end_ns;
+  uint64_t lsda_bytes;
+  uint64_t personality_ns;
+  int search_calls;
+  int cleanup_calls;
+  SlowThrowRecord record;
+};
+
+#define THROW_COUNTER(field) (offsetof(ThrowStats, field) / sizeof(uint64_t))
+
+static std::atomic<bool> throw_instrumentation;
+static std::atomic<uint64_t> slow_throw_threshold_ns;
+static std::atomic<SlowThrowCallback> slow_throw_callback;
+// All ThrowThreadStats, never freed, so stats of exited threads are kept.
+static std::atomic<ThrowThreadStats*> throw_thread_stats_list;
+static __thread ThrowThreadStats* throw_thread_stats;
+
+static uint64_t GetTimeInNs() {
+  timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return static_cast<uint64_t>(ts.tv_sec) * 1000000000 + ts.tv_nsec;
+}
+
+static ThrowThreadStats* GetThrowThreadStats() {
+  ThrowThreadStats* stats = throw_thread_stats;
+  if (stats == nullptr) {
+    // calloc() leaves the atomics zero, and doesn't need the C++ runtime.
+    stats = static_cast<ThrowThreadStats*>(calloc(1, sizeof(ThrowThreadStats)));
+    if (stats == nullptr) {
+      return nullptr;
+    }
+    stats->next = throw_thread_stats_list.load();
+    while (!throw_thread_stats_list.compare_exchange_weak(stats->next, stats)) {
+    }
+    throw_thread_stats = stats;
+  }
+  return stats;
+}
+
+static void AddCounter(ThrowThreadStats* stats, size_t index, uint64_t value) {
+  std::atomic<uint64_t>& counter = stats->counters[index];
+  counter.store(counter.load(std::memory_order_relaxed) + value, std::memory_order_relaxed);
+}
+
+static void AddToHistogram(ThrowThreadStats* stats, size_t index, uint64_t value) {
+  int bucket = (value == 0) ? 0 : 64 - __builtin_clzll(value);
+  AddCounter(stats, index + std::min(bucket, THROW_HISTOGRAM_BUCKETS - 1), 1);
+}
+
+static void BeginThrowRecord(const std::type_info* type) {
+  ThrowThreadStats* stats = GetThrowThreadStats();
+  if (stats == nullptr) {
+    return;
+  }
+  // A throw from a destructor run in phase 2 replaces the throw in progress.
+  stats->active = true;
+  stats->phase1_end_ns = 0;
+  stats->lsda_bytes = 0;
+  stats->personality_ns = 0;
+  stats->search_calls = 0;
+  stats->cleanup_calls = 0;
+  stats->record.type = type;
+  stats->record.frame_count = 0;
+  stats->start_ns = GetTimeInNs();
+}
+
+static void AddPersonalityCall(_Unwind_Action actions, _Unwind_Reason_Code result, uintptr_t ip,
+                               size_t lsda_bytes, uint64_t start_ns, uint64_t end_ns) {
+  ThrowThreadStats* stats = throw_thread_stats;
+  if (stats == nullptr || !stats->active) {
+    return;
+  }
+  bool search = actions & _UA_SEARCH_PHASE;
+  if (search) {
+    stats->search_calls++;
+    if (result == _URC_HANDLER_FOUND) {
+      stats->phase1_end_ns = end_ns;
+    }
+  } else {
+    stats->cleanup_calls++;
+  }
+  stats->lsda_bytes += lsda_bytes;
+  stats->personality_ns += end_ns - start_ns;
+  SlowThrowRecord& record = stats->record;
+  if (record.frame_count < SLOW_THROW_MAX_FRAMES) {
+    ThrowFrameRecord& frame = record.frames[record.frame_count];
+    frame.phase = search ? 1 : 2;
+    frame.result = result;
+    frame.ip = ip;
+    frame.lsda_bytes = lsda_bytes;
+    frame.personality_ns = end_ns - start_ns;
+  }
+  record.frame_count++;
+}
+
+static void EndThrowRecord(bool caught) {
+  ThrowThreadStats* stats = throw_thread_stats;
+  if (stats == nullptr || !stats->active) {
+    return;
+  }
+  stats->active = false;
+  uint64_t end_ns = GetTimeInNs();
+  uint64_t phase1_end_ns = caught ? stats->phase1_end_ns : end_ns;
+  uint64_t phase1_ns = phase1_end_ns - stats->start_ns;
+  uint64_t phase2_ns = end_ns - phase1_end_ns;
+  AddCounter(stats, THROW_COUNTER(throws), 1);
+  AddCounter(stats, THROW_COUNTER(uncaught), caught ? 0 : 1);
+  AddCounter(stats, THROW_COUNTER(search_personality_calls), stats->search_calls);
+  AddCounter(stats, THROW_COUNTER(cleanup_personality_calls), stats->cleanup_calls);
+  AddCounter(stats, THROW_COUNTER(lsda_bytes), stats->lsda_bytes);
+  AddCounter(stats, THROW_COUNTER(personality_ns), stats->personality_ns);
+  AddToHistogram(stats, THROW_COUNTER(phase1_ns), phase1_ns);
+  AddToHistogram(stats, THROW_COUNTER(phase2_ns), phase2_ns);
+  AddToHistogram(stats, THROW_COUNTER(total_ns), phase1_ns + phase2_ns);
+  AddToHistogram(stats, THROW_COUNTER(frames), stats->search_calls + stats->cleanup_calls);
+  SlowThrowCallback callback = slow_throw_callback.load(std::memory_order_relaxed);
+  if (callback != nullptr &&
+      phase1_ns + phase2_ns >= slow_throw_threshold_ns.load(std::memory_order_relaxed)) {
+    stats->record.phase1_ns = phase1_ns;
+    stats->record.phase2_ns = phase2_ns;
+    stats->record.caught = caught;
+    callback(&stats->record);
+  }
+}
+
+void SetThrowInstrumentation(bool enabled, uint64_t slow_threshold_ns,
+                             SlowThrowCallback callback) {
+  slow_throw_threshold_ns = slow_threshold_ns;
+  slow_throw_callback = callback;
+  throw_instrumentation = enabled;
+}
+
+static void ReadThrowStats(ThrowThreadStats* thread_stats, ThrowStats* stats) {
+  uint64_t* values = reinterpret_cast<uint64_t*>(stats);
+  for (size_t i = 0; i < sizeof(ThrowStats) / sizeof(uint64_t); ++i) {
+    values[i] += thread_stats->counters[i].load(std::memory_order_relaxed);
+  }
+}
+
+void GetThreadThrowStats(ThrowStats* stats) {
+  memset(stats, 0, sizeof(*stats));
+  if (throw_thread_stats != nullptr) {
+    ReadThrowStats(throw_thread_stats, stats);
+  }
+}
+
+void GetThrowStats(ThrowStats* stats) {
+  memset(stats, 0, sizeof(*stats));
+  for (ThrowThreadStats* p = throw_thread_stats_list; p != nullptr; p = p->next) {
+    ReadThrowStats(p, stats);
+  }
+}
+
+struct LsdaMatch {
+  uintptr_t landing_pad;
+  int selector;
+  // A catch clause matched, not a cleanup.
+  bool handler;
+};
+
+struct LsdaScan {
+  const char* type_name;
+  bool forced;
+  bool cleanup;
+  uintptr_t throw_ip;
+  const uint8_t* lsda;
+  const LSDA_Header* header;
+  LsdaBase base;
+  LsdaMatch* match;
+  size_t* lsda_bytes;
+
+  // Inlined in ScanLsda(), so the fields above stay in registers.
+  template <int CALL_SITE_ENCODING, int TYPE_ENCODING>
+  __attribute__((always_inline)) inline bool Visit();
+};
+
+template <int CALL_SITE_ENCODING, int TYPE_ENCODING>
+bool LsdaScan::Visit() {
+  size_t action_bytes = 0;
+  const uint8_t* p = header->call_site_start;
+  while (p < header->call_site_end) {
+    LSDA_Call_Site cs;
+    if (!cs.Read<CALL_SITE_ENCODING>(p, *header, base.address_size)) {
+      break;
+    }
+    D("Found a CS:\n");
+    D("\tcs_start: %llx\n", (unsigned long long)cs.cs_start);
+    D("\tcs_len: %llx\n", (unsigned long long)cs.cs_len);
+    D("\tcs_lp: %llx\n", (unsigned long long)cs.cs_lp);
+    D("\tcs_action: %llx\n", cs.cs_action);
+    // Call sites are sorted by start.
+    uintptr_t cs_start = base.func_start + cs.cs_start;
+    if (throw_ip < cs_start) {
+      break;
+    }
+    if (throw_ip >= cs_start + cs.cs_len) {
+      continue;
+    }
+    if (cs.cs_lp == 0) {
+      break;
+    }
+    bool saw_cleanup = (cs.cs_action == 0);
+    bool handler = false;
+    int64_t type_filter = 0;
+    if (cs.cs_action != 0) {
+      const uint8_t* action = header->action_table + (cs.cs_action - 1);
+      while (true) {
+        const uint8_t* record = action;
+        type_filter = ReadSleb128(action);
+        const uint8_t* next_field = action;
+        int64_t next = ReadSleb128(action);
+        action_bytes += action - record;
+        D("\ttype_filter: %lld\n", (long long)type_filter);
+        // Negative filters are exception specifications, which aren't checked.
+        if (type_filter == 0) {
+          saw_cleanup = true;
+        } else if (type_filter > 0) {
+          uint64_t type_info;
+          if (!ReadTypeTableEntry<TYPE_ENCODING>(*header, type_filter, base, &type_info)) {
+            break;
+          }
+          action_bytes += GetEncodedSize(header->lsda_type_encoding, base.address_size);
+          const std::type_info* catch_ti = (const std::type_info*)(uintptr_t)type_info;
+          // A null type_info is catch (...), which catches foreign exceptions
+          // too, but never forced unwinds. Typed clauses only catch ours.
+          if ((catch_ti == nullptr) ? !forced
+                                    : (type_name != nullptr && catch_ti->name() == type_name)) {
+            D("%s\n", (catch_ti != nullptr) ? catch_ti->name() : "...");
+            handler = true;
+            break;
+          }
+        }
+        if (next == 0) {
+          break;
+        }
+        action = next_field + next;
+      }
+    }
+    if (!handler && !(cleanup && saw_cleanup)) {
+      break;
+    }
+    *lsda_bytes = (p - lsda) + action_bytes;
+    match->landing_pad = header->landing_pad_base + cs.cs_lp;
+    // The landing pad compares the selector with the type filters of its
+    // catch clauses, 0 matches none of them.
+    match->selector = handler ? type_filter : 0;
+    match->handler = handler;
+    return true;
+  }
+  *lsda_bytes = (p - lsda) + action_bytes;
+  return false;
+}
+
+// Find the landing pad for ip in lsda. type_name is the name of the type
+// thrown, or nullptr for forced unwinds and foreign exceptions, which are
+// only caught by catch (...) if not forced. Cleanups are only matched if
+// cleanup is set. Sets lsda_bytes to the bytes of LSDA read.
+static bool ScanLsda(const char* type_name, bool forced, bool cleanup, uintptr_t ip,
+                     uintptr_t func_start, const uint8_t* lsda, LsdaMatch* match,
+                     size_t* lsda_bytes) {
+  LsdaScan scan;
+  scan.type_name = type_name;
+  scan.forced = forced;
+  scan.cleanup = cleanup;
+  scan.throw_ip = ip - 1;
+  scan.lsda = lsda;
+  scan.base.func_start = func_start;
+  scan.match = match;
+  scan.lsda_bytes = lsda_bytes;
+  const uint8_t* p = lsda;
+  LSDA_Header header(p, scan.base);
+  D("throw_ip = %lx\n", (unsigned long)scan.throw_ip);
+  D("func_start = %lx\n", (unsigned long)func_start);
+  D("lsda_start_encoding = %x\n", header.lsda_start_encoding);
+  D("type_table_offset = %llx\n", header.type_table_offset);
+  D("call_site_length = %lld\n", header.call_site_length);
+  *lsda_bytes = p - lsda;
+  if (!header.valid) {
+    return false;
+  }
+  scan.header = &header;
+  return VisitLsdaEncodings(header, scan);
+}
+
 extern "C" {
 void* __cxa_allocate_exception(size_t thrown_size) {
   D("alloc ex %zu\n", thrown_size);
@@ -62,19 +538,38 @@ struct __cxa_exception {
 #define container_of(p, global_struct, member) \
   (global_struct*)(((uintptr_t)p) - (uintptr_t)(&((global_struct*)0)->member))
 
+// "GNUCC++\0", the class of exceptions thrown by __cxa_throw().
+static const uint64_t CXX_EXCEPTION_CLASS = 0x474e5543432b2b00ULL;
+
+static std::atomic<int> shallow_throw_frames(4);
+
+static bool ShallowThrow(__cxa_exception* header, uintptr_t throw_pc);
+
 void __cxa_throw(void* thrown_exception,
                  std::type_info* tinfo,
                  void (*dest)(void*)) {
   D("__cxa_throw called, thrown_exception = %p\n", thrown_exception);
   __cxa_exception* header = ((__cxa_exception*)thrown_exception);
   header->exceptionType = tinfo;
+  header->unwindHeader.exception_class = CXX_EXCEPTION_CLASS;
+  if (ShouldSampleThrow()) {
+    SampleThrow(tinfo, reinterpret_cast<uintptr_t>(__builtin_return_address(0)));
+  }
+  if (throw_instrumentation.load(std::memory_order_relaxed)) {
+    BeginThrowRecord(tinfo);
+  }
   D("header = %p, &header->unwindHeader = %p\n", header, &header->unwindHeader);
+  if (EhUnwind != nullptr && shallow_throw_frames.load(std::memory_order_relaxed) > 0) {
+    ShallowThrow(header, reinterpret_cast<uintptr_t>(__builtin_return_address(0)));
+  }
   _Unwind_RaiseException(&header->unwindHeader);
+  EndThrowRecord(false);
   D("no one handled __cxa_throw, terminate\n");
   exit(0);
 }
 
 void __cxa_begin_catch() {
+  EndThrowRecord(true);
   D("begin catch\n");
 }
 
@@ -82,160 +577,304 @@ void __cxa_end_catch() {
   D("end catch\n");
 }
 
-typedef unsigned long long uleb128_t;
+// Sets lsda_bytes to the bytes of LSDA read.
+static _Unwind_Reason_Code Personality(_Unwind_Action actions, uint64_t exception_class,
+                                       _Unwind_Exception* unwind_exception,
+                                       _Unwind_Context* context, size_t* lsda_bytes) {
+  *lsda_bytes = 0;
+  if (actions & (_UA_SEARCH_PHASE | _UA_CLEANUP_PHASE)) {
+    if (actions & _UA_SEARCH_PHASE) {
+      D("lookup phase\n");
+    } else if (actions & _UA_FORCE_UNWIND) {
+      D("forced unwind\n");
+    } else {
+      D("cleanup phase\n");
+    }
+    // Forced unwinds (like pthread_exit()) only run cleanups, exceptions of
+    // other runtimes are only caught by catch (...).
+    bool forced = (actions & _UA_FORCE_UNWIND) != 0;
+    const char* type_name = nullptr;
+    if (!forced && exception_class == CXX_EXCEPTION_CLASS) {
+      __cxa_exception* exception_header = container_of(unwind_exception, __cxa_exception, unwindHeader);
+      type_name = exception_header->exceptionType->name();
+    }
+    uintptr_t ip = _Unwind_GetIP(context);
+    uintptr_t func_start = _Unwind_GetRegionStart(context);
+    const uint8_t* lsda = (const uint8_t*)_Unwind_GetLanguageSpecificData(context);
+    if (lsda == nullptr) {
+      return _URC_CONTINUE_UNWIND;
+    }
+    LsdaMatch match;
+    if (!ScanLsda(type_name, forced, (actions & _UA_CLEANUP_PHASE) != 0, ip, func_start, lsda,
+                  &match, lsda_bytes)) {
+      return _URC_CONTINUE_UNWIND;
+    }
+    if (actions & _UA_SEARCH_PHASE) {
+      return _URC_HANDLER_FOUND;
+    }
+    int r0 = __builtin_eh_return_data_regno(0);
+    int r1 = __builtin_eh_return_data_regno(1);
+    _Unwind_SetGR(context, r0, (uintptr_t)(unwind_exception));
+    _Unwind_SetGR(context, r1, (uintptr_t)(match.selector));
+    _Unwind_SetIP(context, match.landing_pad);
+    return _URC_INSTALL_CONTEXT;
+  } else {
+    D("error actions %x\n", actions);
+    return _URC_FATAL_PHASE1_ERROR;
+  }
+}
 
-static uleb128_t ReadUleb128(const uint8_t*& p) {
-  uleb128_t result = 0;
-  int shift = 0;
-  while (*p & 0x80) {
-    result |= (*p & 0x7f) << shift;
-    shift += 7;
-    p++;
+_Unwind_Reason_Code __gxx_personality_v0 (int version, _Unwind_Action actions,
+                                          uint64_t exceptionClass,
+                                          _Unwind_Exception* unwind_exception,
+                                          _Unwind_Context* context) {
+  D("personality function_v0\n");
+  size_t lsda_bytes;
+  if (!throw_instrumentation.load(std::memory_order_relaxed)) {
+    return Personality(actions, exceptionClass, unwind_exception, context, &lsda_bytes);
   }
-  result |= (*p & 0x7f) << shift;
-  p++;
+  uintptr_t ip = _Unwind_GetIP(context);
+  uint64_t start_ns = GetTimeInNs();
+  _Unwind_Reason_Code result = Personality(actions, exceptionClass, unwind_exception, context,
+                                           &lsda_bytes);
+  AddPersonalityCall(actions, result, ip, lsda_bytes, start_ns, GetTimeInNs());
   return result;
 }
 
-// structure in .gcc_except_table
-struct LSDA_Header {
-  uint8_t lsda_start_encoding;
-  uint8_t lsda_type_encoding;
-  uleb128_t type_table_offset; // from next position
-  uint8_t call_site_encoding;
-  uleb128_t call_site_length;
-
-  const uint8_t* call_site_start;
-  const uint8_t* call_site_end;
-  const uint8_t* action_table;
-  const uint32_t* type_table;
-
-  LSDA_Header(const uint8_t*& ptr) {
-    lsda_start_encoding = *ptr++;
-    lsda_type_encoding = *ptr++;
-    if (lsda_type_encoding == 0xff) {
-      type_table_offset = 0;
-      type_table = NULL;
-    } else {
-      type_table_offset = ReadUleb128(ptr);
-      type_table = (const uint32_t*)(ptr + type_table_offset);
+// Landing pads found by the project's unwinder (see eh_unwind.h), jumped to
+// one by one as each of them resumes the exception.
+static constexpr int EH_PLAN_MAX_FRAMES = 8;
+
+struct EhPlanFrame {
+  EhFrame frame;
+  uintptr_t landing_pad;
+  int selector;
+};
+
+struct EhPlan {
+  // The exception unwound, nullptr if there is no plan.
+  _Unwind_Exception* exception;
+  int count;
+  int next;
+  // Walk the stack again after the last frame, instead of leaving the rest
+  // of the unwind to libgcc.
+  bool rewalk;
+  // The last frame catches the exception, the plan ends when it is installed.
+  bool handler;
+  EhPlanFrame frames[EH_PLAN_MAX_FRAMES];
+};
+
+static __thread EhPlan eh_plan;
+
+static void AddPlanFrame(EhPlan* plan, const EhFrame* frame, const LsdaMatch& match) {
+  EhPlanFrame& plan_frame = plan->frames[plan->count++];
+  plan_frame.frame = *frame;
+  plan_frame.landing_pad = match.landing_pad;
+  plan_frame.selector = match.selector;
+}
+
+static void InstallPlanFrame(EhPlan* plan) {
+  const EhPlanFrame& plan_frame = plan->frames[plan->next++];
+  uintptr_t exception = reinterpret_cast<uintptr_t>(plan->exception);
+  if (plan->handler && plan->next == plan->count) {
+    plan->exception = nullptr;
+  }
+  EhInstallContext(&plan_frame.frame, plan_frame.landing_pad, exception, plan_frame.selector);
+}
+
+struct ShallowThrowState {
+  EhPlan* plan;
+  const char* type_name;
+  uintptr_t throw_pc;
+  int runtime_frames;
+  // Frames walked from the caller of __cxa_throw, -1 before reaching it.
+  int frames;
+  int max_frames;
+};
+
+// Plan the landing pads of a throw, until its handler. Give up on frames only
+// libgcc can handle, and on handlers more than max_frames frames away.
+static bool PlanShallowThrow(const EhFrame* frame, void* arg) {
+  ShallowThrowState* state = static_cast<ShallowThrowState*>(arg);
+  EhPlan* plan = state->plan;
+  if (state->frames < 0) {
+    // Skip frames of ShallowThrow() and __cxa_throw(), if not inlined.
+    if (frame->ip != state->throw_pc) {
+      return ++state->runtime_frames <= 2;
     }
-    call_site_encoding = *ptr++;
-    call_site_length = ReadUleb128(ptr);
-    call_site_start = ptr;
-    call_site_end = ptr + call_site_length;
-    action_table = ptr + call_site_length;
+    state->frames = 0;
+  }
+  if (++state->frames > state->max_frames) {
+    return false;
+  }
+  if (frame->personality == 0 || frame->lsda == 0) {
+    return true;
+  }
+  if (frame->personality != reinterpret_cast<uintptr_t>(__gxx_personality_v0)) {
+    return false;
+  }
+  bool instrumented = throw_instrumentation.load(std::memory_order_relaxed);
+  uint64_t start_ns = instrumented ? GetTimeInNs() : 0;
+  LsdaMatch match;
+  size_t lsda_bytes;
+  bool found = ScanLsda(state->type_name, false, true, frame->ip, frame->func_start,
+                        reinterpret_cast<const uint8_t*>(frame->lsda), &match, &lsda_bytes);
+  if (instrumented) {
+    AddPersonalityCall(_UA_SEARCH_PHASE,
+                       (found && match.handler) ? _URC_HANDLER_FOUND : _URC_CONTINUE_UNWIND,
+                       frame->ip, lsda_bytes, start_ns, GetTimeInNs());
+  }
+  if (!found) {
+    return true;
   }
+  if (plan->count == EH_PLAN_MAX_FRAMES) {
+    return false;
+  }
+  AddPlanFrame(plan, frame, match);
+  if (match.handler) {
+    plan->handler = true;
+    return false;
+  }
+  return true;
+}
+
+// Throw sites whose last throw has its handler too far away aren't tried
+// again for the next SHALLOW_THROW_RETRY throws from them, so deep throws
+// don't pay for a failed walk each time.
+static constexpr int SHALLOW_THROW_SKIP_SLOTS = 64;
+static constexpr uint32_t SHALLOW_THROW_RETRY = 64;
+
+struct ShallowThrowSkip {
+  uintptr_t throw_pc;
+  uint32_t countdown;
 };
 
-struct LSDA_Call_Site {
-  LSDA_Call_Site(const uint8_t*& ptr) {
-    cs_start = ReadUleb128(ptr);
-    cs_len = ReadUleb128(ptr);
-    cs_lp = ReadUleb128(ptr);
-    cs_action = ReadUleb128(ptr);
+static __thread ShallowThrowSkip shallow_throw_skips[SHALLOW_THROW_SKIP_SLOTS];
+
+// Throws caught a few frames up don't need two phases: if the handler is
+// found within shallow_throw_frames frames, and each frame up to it is
+// unwound by rules already loaded, the landing pads are jumped to with the
+// registers recorded while searching. Return false if the throw is left to
+// _Unwind_RaiseException().
+static bool ShallowThrow(__cxa_exception* header, uintptr_t throw_pc) {
+  EhPlan* plan = &eh_plan;
+  // A throw from a landing pad of a plan leaves that plan to libgcc.
+  if (plan->exception != nullptr) {
+    return false;
+  }
+  ShallowThrowSkip& skip = shallow_throw_skips[(throw_pc >> 2) % SHALLOW_THROW_SKIP_SLOTS];
+  if (skip.throw_pc == throw_pc && skip.countdown > 0) {
+    skip.countdown--;
+    return false;
   }
+  ShallowThrowState state;
+  state.plan = plan;
+  state.type_name = header->exceptionType->name();
+  state.throw_pc = throw_pc;
+  state.runtime_frames = 0;
+  state.frames = -1;
+  state.max_frames = shallow_throw_frames.load(std::memory_order_relaxed);
+  plan->count = 0;
+  plan->next = 0;
+  plan->rewalk = false;
+  plan->handler = false;
+  bool walked = EhUnwind(PlanShallowThrow, &state);
+  if (!plan->handler) {
+    // Frames not unwound may only wait for their unwind tables to be loaded.
+    if (walked) {
+      skip.throw_pc = throw_pc;
+      skip.countdown = SHALLOW_THROW_RETRY;
+    }
+    return false;
+  }
+  plan->exception = &header->unwindHeader;
+  InstallPlanFrame(plan);
+  return true;
+}
 
-  uleb128_t cs_start;
-  uleb128_t cs_len;
-  uleb128_t cs_lp;  // landing pad position
-  uleb128_t cs_action;  // cs.action is the offset + 1; cs.action == 0 means
-    // there is no associated entry in the action table.
+void SetShallowThrowFrames(int max_frames) {
+  shallow_throw_frames.store(max_frames, std::memory_order_relaxed);
+}
+
+struct ForcedUnwindState {
+  EhPlan* plan;
+  // The return address into the caller of EhResume(), the frames up to it
+  // are of the runtime.
+  uintptr_t resume_pc;
+  int runtime_frames;
+  bool resumed;
 };
 
-_Unwind_Reason_Code __gxx_personality_v0 (int version, _Unwind_Action actions,
-                                          uint64_t exceptionClass,
-                                          _Unwind_Exception* unwind_exception,
-                                          _Unwind_Context* context) {
-  D("personality function_v0\n");
-  if (actions & (_UA_SEARCH_PHASE | _UA_CLEANUP_PHASE)) {
-    if (actions & _UA_SEARCH_PHASE) {
-      D("lookup phase\n");
-    } else {
-      D("cleanup phase\n");
+// Plan the cleanups of a forced unwind, until a frame only libgcc can handle.
+// The stop function of the unwind also runs cleanups, like the handlers of
+// pthread_cleanup_push() in C, so frames without a personality routine
+// aren't passed: libgcc calls the stop function for them in order.
+static bool PlanForcedUnwind(const EhFrame* frame, void* arg) {
+  ForcedUnwindState* state = static_cast<ForcedUnwindState*>(arg);
+  EhPlan* plan = state->plan;
+  if (!state->resumed) {
+    // Skip frames of EhResume() and its caller.
+    state->resumed = frame->ip == state->resume_pc;
+    return ++state->runtime_frames <= 2;
+  }
+  if (frame->personality == 0) {
+    return false;
+  }
+  if (frame->lsda == 0) {
+    return true;
+  }
+  if (frame->personality != reinterpret_cast<uintptr_t>(__gxx_personality_v0)) {
+    return false;
+  }
+  LsdaMatch match;
+  size_t lsda_bytes;
+  if (ScanLsda(nullptr, true, true, frame->ip, frame->func_start,
+               reinterpret_cast<const uint8_t*>(frame->lsda), &match, &lsda_bytes)) {
+    AddPlanFrame(plan, frame, match);
+    if (plan->count == EH_PLAN_MAX_FRAMES) {
+      plan->rewalk = true;
+      return false;
     }
-    __cxa_exception* exception_header = container_of(unwind_exception, __cxa_exception, unwindHeader);
-    const char* type_name = exception_header->exceptionType->name();
-    uintptr_t throw_ip = _Unwind_GetIP(context) - 1;
-    uintptr_t func_start = _Unwind_GetRegionStart(context);
-    const uint8_t* lsda = (const uint8_t*)_Unwind_GetLanguageSpecificData(context);
+  }
+  return true;
+}
 
-    LSDA_Header header(lsda);
-    const uint8_t* p;
-    size_t i;
-    D("throw_ip = %lx\n", (unsigned long)throw_ip);
-    D("func_start = %lx\n", (unsigned long)func_start);
-    D("lsda_start_encoding = %x\n", header.lsda_start_encoding);
-    D("type_table_offset = %llx\n", header.type_table_offset);
-    D("call_site_length = %lld\n", header.call_site_length);
-    for (i = 0, p = header.call_site_start; p < header.call_site_end; i++) {
-      LSDA_Call_Site cs(p);
-      D("Found a CS:\n");
-      D("\tcs_start: %llx\n", cs.cs_start);
-      D("\tcs_len: %llx\n", cs.cs_len);
-      D("\tcs_lp: %llx\n", cs.cs_lp);
-      D("\tcs_action: %llx\n", cs.cs_action);
-      if (cs.cs_lp == 0) {
-        continue;
-      }
-      if (func_start + cs.cs_start > throw_ip || throw_ip >= func_start + cs.cs_start + cs.cs_len) {
-        continue;
-      }
-      if (cs.cs_action == 0 && (actions & _UA_SEARCH_PHASE)) {
-        continue;
-      }
-      bool found = (cs.cs_action == 0);
-      int type_index;
-      int action_index;
-      int action_position = 1;
-      if (cs.cs_action != 0) {
-        type_index = header.action_table[cs.cs_action - 1];
-        action_index = cs.cs_action - 1;
-      }
-      while (!found) {
-        D("\ttype_index: %d\n", type_index);
-        if (type_index == 0) {
-          if (actions & _UA_CLEANUP_PHASE) {
-            found = true;
-          }
-          break;
-        }
-        uint32_t catch_type_info = header.type_table[-1 * type_index];
-        const std::type_info* catch_ti = (const std::type_info*)(uint64_t)catch_type_info;
-        D("%s\n", catch_ti->name());
-        if (catch_ti->name() == type_name) {
-          found = true;
-          break;
-        }
-        action_index++;
-        if (header.action_table[action_index] == 0) {
-          break;
-        }
-        action_index += header.action_table[action_index];
-        if (action_index >= 128) {
-          action_index -= 128;
-        }
-        type_index = header.action_table[action_index];
-        action_position++;
-      }
-      if (!found) {
-        continue;
-      }
-      if (actions & _UA_SEARCH_PHASE) {
-        return _URC_HANDLER_FOUND;
-      }
-      int r0 = __builtin_eh_return_data_regno(0);
-      int r1 = __builtin_eh_return_data_regno(1);
-      _Unwind_SetGR(context, r0, (uintptr_t)(unwind_exception));
-      _Unwind_SetGR(context, r1, (uintptr_t)(action_position));
-      _Unwind_SetIP(context, func_start + cs.cs_lp);
-      return _URC_INSTALL_CONTEXT;
-    }
-    return _URC_CONTINUE_UNWIND;
-  } else {
-    D("error actions %x\n", actions);
-    return _URC_FATAL_PHASE1_ERROR;
+bool EhResume(_Unwind_Exception* exception) {
+  EhPlan* plan = &eh_plan;
+  if (plan->exception == exception) {
+    if (plan->next < plan->count) {
+      InstallPlanFrame(plan);
+    }
+    plan->exception = nullptr;
+    if (!plan->rewalk) {
+      return false;
+    }
+  }
+  // libgcc keeps the stop function of a forced unwind in private_1. Forced
+  // unwinds have no search phase, so their cleanups can be run as they are
+  // found. The stop function isn't called for frames passed here, it is
+  // called again once libgcc takes over, at the first frame without a
+  // personality routine at the latest.
+  if (exception->private_1 == 0) {
+    return false;
+  }
+  plan->exception = exception;
+  plan->count = 0;
+  plan->next = 0;
+  plan->rewalk = false;
+  plan->handler = false;
+  ForcedUnwindState state;
+  state.plan = plan;
+  state.resume_pc = reinterpret_cast<uintptr_t>(__builtin_return_address(0));
+  state.runtime_frames = 0;
+  state.resumed = false;
+  EhUnwind(PlanForcedUnwind, &state);
+  if (plan->count == 0) {
+    plan->exception = nullptr;
+    return false;
   }
+  InstallPlanFrame(plan);
+  return true;
 }
 
 }
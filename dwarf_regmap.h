@@ -102,7 +102,8 @@ enum AARCH64_REGMAP {
   AARCH64_X29 = 29,
   AARCH64_IP = 30,
   AARCH64_SP = 31,
-  AARCH64_REG_COUNT = 32
+  AARCH64_PC = 32,
+  AARCH64_REG_COUNT = 33
 };
 
 static const std::unordered_map<int, const char*> AARCH64_REG_NAME_MAP = {
@@ -138,6 +139,7 @@ static const std::unordered_map<int, const char*> AARCH64_REG_NAME_MAP = {
   {AARCH64_X29, "AARCH64_X29"},
   {AARCH64_IP, "AARCH64_IP"},
   {AARCH64_SP, "AARCH64_SP"},
+  {AARCH64_PC, "AARCH64_PC"},
 };
 
 enum ARM_REGMAP {
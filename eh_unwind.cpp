@@ -0,0 +1,113 @@
+#include "eh_unwind.h"
+
+#include <stdlib.h>
+
+#include "elf_reader.h"
+#include "get_current_regs.h"
+#include "unwind.h"
+
+static_assert(EH_FRAME_REGS == UNWIND_MAX_REGS, "EhFrame has wrong register count");
+
+bool EhUnwind(bool (*callback)(const EhFrame* frame, void* arg), void* arg) {
+#if defined(__x86_64__)
+  uint64_t current_regs[UNWIND_MAX_REGS];
+  GET_CURRENT_REGS(current_regs);
+  UnwindOptions options;
+  options.non_blocking = true;
+  UnwindCursor cursor(options);
+  cursor.Init(current_regs);
+  // Skip the frame of EhUnwind().
+  if (!cursor.Step()) {
+    return false;
+  }
+  while (true) {
+    EhFrame frame;
+    frame.ip = cursor.GetPc();
+    for (int i = 0; i < EH_FRAME_REGS; ++i) {
+      uint64_t value = 0;
+      cursor.GetReg(i, &value);
+      frame.regs[i] = value;
+    }
+    bool stepped = cursor.Step();
+    uint64_t load_bias;
+    Fde* fde = cursor.GetLastFde(&load_bias);
+    // Fdes of .debug_frame don't tell the personality.
+    if (fde == nullptr || !fde->cie->has_eh_info) {
+      return false;
+    }
+    const Cie* cie = fde->cie;
+    frame.func_start = fde->func_start + load_bias;
+    frame.lsda = (fde->lsda != 0) ? fde->lsda + load_bias : 0;
+    frame.personality = 0;
+    if (cie->personality != 0) {
+      frame.personality = cie->personality + load_bias;
+      if (cie->personality_indirect) {
+        frame.personality = *reinterpret_cast<const uintptr_t*>(frame.personality);
+      }
+    }
+    if (!callback(&frame, arg)) {
+      return true;
+    }
+    if (!stepped) {
+      return cursor.Finished();
+    }
+  }
+#else
+  return false;
+#endif
+}
+
+int EhCaptureThrowStack(uintptr_t* pcs, int max_frames) {
+  uintptr_t current_regs[UNWIND_MAX_REGS];
+  GET_CURRENT_REGS(current_regs);
+  UnwindOptions options;
+  options.non_blocking = true;
+  UnwindCursor cursor(options);
+  cursor.Init(current_regs);
+  int count = 0;
+  while (count < max_frames) {
+    pcs[count++] = cursor.GetPc();
+    if (!cursor.Step()) {
+      // Leave a dso not loaded yet to the fallback.
+      return cursor.IsUnresolved() ? 0 : count;
+    }
+  }
+  return count;
+}
+
+void EhInstallContext(const EhFrame* frame, uintptr_t landing_pad, uintptr_t exception,
+                      uintptr_t selector) {
+#if defined(__x86_64__)
+  uintptr_t regs[EH_FRAME_REGS];
+  for (int i = 0; i < EH_FRAME_REGS; ++i) {
+    regs[i] = frame->regs[i];
+  }
+  regs[0] = exception;
+  regs[1] = selector;
+  regs[16] = landing_pad;
+  // The pc is loaded before switching to the new sp, as a signal handler
+  // may write over regs once it is above sp.
+  __asm__ __volatile__(
+      "movq 0x00(%0), %%rax\n"
+      "movq 0x08(%0), %%rdx\n"
+      "movq 0x18(%0), %%rbx\n"
+      "movq 0x30(%0), %%rbp\n"
+      "movq 0x60(%0), %%r12\n"
+      "movq 0x68(%0), %%r13\n"
+      "movq 0x70(%0), %%r14\n"
+      "movq 0x78(%0), %%r15\n"
+      "movq 0x80(%0), %%rsi\n"
+      "movq 0x38(%0), %%rsp\n"
+      "jmpq *%%rsi\n"
+      : : "c"(regs) : "memory");
+#endif
+  abort();
+}
+
+extern "C" void __real__Unwind_Resume(_Unwind_Exception* exception);
+
+extern "C" void __wrap__Unwind_Resume(_Unwind_Exception* exception) {
+  EhResume(exception);
+  __real__Unwind_Resume(exception);
+  abort();
+}
@@ -0,0 +1,62 @@
+#ifndef _UNWIND_EH_UNWIND_H_
+#define _UNWIND_EH_UNWIND_H_
+
+#include <stdint.h>
+
+struct _Unwind_Exception;
+
+// Unwinding exceptions of the C++ runtime in cxxabi.cpp with UnwindCursor
+// instead of libgcc. Frame rules come from the unwind tables the unwinder
+// keeps loaded, and the registers of each frame walked are kept, so a landing
+// pad found can be jumped to without walking the stack again.
+//
+// It is optional: cxxabi.cpp references it weakly, and only uses libgcc when
+// it isn't linked. Programs linking it pass -Wl,--wrap=_Unwind_Resume, so
+// landing pads finishing their cleanups come back here. Jumping to landing
+// pads is only done on x86_64, on other archs EhUnwind() always fails.
+
+// Registers of a frame, in the layout of GET_CURRENT_REGS().
+static constexpr int EH_FRAME_REGS = 33;
+
+struct EhFrame {
+  // The return address into the frame, like _Unwind_GetIP().
+  uintptr_t ip;
+  uintptr_t func_start;
+  // 0 if the frame has no lsda or personality routine.
+  uintptr_t lsda;
+  uintptr_t personality;
+  uintptr_t regs[EH_FRAME_REGS];
+};
+
+extern "C" {
+
+// Walk frames from the function calling EhUnwind(), and call callback for
+// each until it returns false. Only unwind tables already loaded are used,
+// dsos not loaded yet are queued to the BackgroundLoader. Return false if a
+// frame can't be unwound before callback stops or the stack ends.
+bool EhUnwind(bool (*callback)(const EhFrame* frame, void* arg), void* arg);
+
+// A ThrowStackCapture (see exception_stats.h) stepping UnwindCursor, used by
+// throw sampling when no capture is set. Like EhUnwind(), it only uses unwind
+// tables already loaded, and returns 0 if it needs another one, so the stack
+// is captured by _Unwind_Backtrace() instead.
+int EhCaptureThrowStack(uintptr_t* pcs, int max_frames);
+
+// Jump to landing_pad in frame, passing exception and selector in the
+// registers of __builtin_eh_return_data_regno(0) and (1).
+void EhInstallContext(const EhFrame* frame, uintptr_t landing_pad, uintptr_t exception,
+                      uintptr_t selector) __attribute__((noreturn));
+
+// Defined in cxxabi.cpp. Called by landing pads resuming exception, jump to
+// the next landing pad found by the project's unwinder. Return false if the
+// unwind is left to libgcc.
+bool EhResume(_Unwind_Exception* exception);
+
+// Defined in cxxabi.cpp. Throws caught within max_frames frames of the
+// thrower skip the two phases of libgcc, if the unwind tables of the frames
+// up to the handler are loaded. 0 turns it off, the default is 4.
+void SetShallowThrowFrames(int max_frames);
+
+}
+
+#endif  // _UNWIND_EH_UNWIND_H_
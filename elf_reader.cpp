@@ -7,6 +7,7 @@
 #include <string.h>
 #include <unistd.h>
 
+#include <algorithm>
 #include <map>
 #include <memory>
 #include <string>
@@ -19,12 +20,29 @@
 
 #include "dwarf.h"
 #include "dwarf_string.h"
+#include "insts_pool.h"
 #include "read_utils.h"
 
 #define CHECK(expr) \
   if (!(expr)) \
     abort()
 
+// Convert a pointer read with encoding from vaddr pc to a vaddr, 0 stays 0.
+// Clear known for encodings relative to bases not tracked here.
+static uint64_t EhPointerToVaddr(uint64_t value, uint8_t encoding, uint64_t pc, bool* known) {
+  if (value == 0) {
+    return 0;
+  }
+  switch (encoding & 0x70) {
+    case DW_EH_PE_absptr:
+      return value;
+    case DW_EH_PE_pcrel:
+      return pc + value;
+  }
+  *known = false;
+  return 0;
+}
+
 static void PrintHex(const char* p, uint64_t len) {
   for (uint64_t i = 0; i < len; ++i) {
     printf("%x ", (unsigned char)p[i]);
@@ -117,6 +135,7 @@ struct Elf64Struct {
   using Elf_Ehdr = Elf64_Ehdr;
   using Elf_Shdr = Elf64_Shdr;
   using Elf_Phdr = Elf64_Phdr;
+  using Elf_Sym = Elf64_Sym;
   static const int ELFCLASS = ELFCLASS64;
 };
 
@@ -124,6 +143,7 @@ struct Elf32Struct {
   using Elf_Ehdr = Elf32_Ehdr;
   using Elf_Shdr = Elf32_Shdr;
   using Elf_Phdr = Elf32_Phdr;
+  using Elf_Sym = Elf32_Sym;
   static const int ELFCLASS = ELFCLASS32;
 };
 
@@ -133,6 +153,7 @@ class ElfReaderImpl : public ElfReader {
   using Elf_Ehdr = typename ElfStruct::Elf_Ehdr;
   using Elf_Shdr = typename ElfStruct::Elf_Shdr;
   using Elf_Phdr = typename ElfStruct::Elf_Phdr;
+  using Elf_Sym = typename ElfStruct::Elf_Sym;
 
   ElfReaderImpl(std::unique_ptr<ReadHelper> read_helper, int log_flag)
       : read_helper_(std::move(read_helper)), log_flag_(log_flag),
@@ -172,6 +193,9 @@ class ElfReaderImpl : public ElfReader {
   }
 
   bool ReadSecHeaders() override {
+    if (IsCore()) {
+      return true;
+    }
     if (header_.e_shstrndx == 0) {
       fprintf(stderr, "string section is empty\n");
       return false;
@@ -242,10 +266,141 @@ class ElfReaderImpl : public ElfReader {
     return min_vaddr;
   }
 
+  std::string ReadBuildId() override {
+    auto it = sec_headers_.find(".note.gnu.build-id");
+    if (it == sec_headers_.end()) {
+      return std::string();
+    }
+    std::vector<char> data = ReadSection(&it->second);
+    const char* p = data.data();
+    const char* end = p + data.size();
+    while (p + 12 <= end) {
+      uint32_t namesz = Read(p, 4);
+      uint32_t descsz = Read(p, 4);
+      uint32_t type = Read(p, 4);
+      const char* name = p;
+      p += (namesz + 3) & ~3;
+      const char* desc = p;
+      p += (descsz + 3) & ~3;
+      if (p > end) {
+        break;
+      }
+      if (type == NT_GNU_BUILD_ID && namesz == 4 && memcmp(name, "GNU", 4) == 0) {
+        return std::string(desc, descsz);
+      }
+    }
+    return std::string();
+  }
+
   bool HasSection(const char* name) override {
     return GetSection(name) != nullptr;
   }
 
+ public:
+  bool IsCore() const override {
+    return header_.e_type == ET_CORE;
+  }
+
+  uint16_t GetMachine() const override {
+    return header_.e_machine;
+  }
+
+  std::vector<ElfSegment> GetSegments() const override {
+    std::vector<ElfSegment> segments;
+    for (const auto& ph : program_headers_) {
+      ElfSegment seg;
+      seg.type = ph.p_type;
+      seg.flags = ph.p_flags;
+      seg.offset = ph.p_offset;
+      seg.vaddr = ph.p_vaddr;
+      seg.filesz = ph.p_filesz;
+      seg.memsz = ph.p_memsz;
+      segments.push_back(seg);
+    }
+    return segments;
+  }
+
+  bool ReadNotes(std::vector<ElfNote>* notes) override {
+    for (const auto& ph : program_headers_) {
+      if (ph.p_type != PT_NOTE) {
+        continue;
+      }
+      std::vector<char> data(ph.p_filesz);
+      if (!ReadFully(data.data(), data.size(), ph.p_offset)) {
+        return false;
+      }
+      const char* p = data.data();
+      const char* end = p + data.size();
+      while (p + 12 <= end) {
+        uint32_t namesz = Read(p, 4);
+        uint32_t descsz = Read(p, 4);
+        uint32_t type = Read(p, 4);
+        const char* name = p;
+        if (namesz > static_cast<size_t>(end - p)) {
+          break;
+        }
+        p += (namesz + 3) & ~3;
+        const char* desc = p;
+        if (p > end || descsz > static_cast<size_t>(end - p)) {
+          break;
+        }
+        p += (descsz + 3) & ~3;
+        ElfNote note;
+        note.type = type;
+        note.name.assign(name, strnlen(name, namesz));
+        note.desc.assign(desc, desc + descsz);
+        notes->push_back(std::move(note));
+      }
+    }
+    return true;
+  }
+
+  bool ReadSymbols(std::vector<ElfSymbol>* symbols) override {
+    auto sym_it = sec_headers_.find(".symtab");
+    auto str_it = sec_headers_.find(".strtab");
+    if (sym_it == sec_headers_.end() || str_it == sec_headers_.end()) {
+      sym_it = sec_headers_.find(".dynsym");
+      str_it = sec_headers_.find(".dynstr");
+      if (sym_it == sec_headers_.end() || str_it == sec_headers_.end()) {
+        return false;
+      }
+    }
+    std::vector<char> sym_data = ReadSection(&sym_it->second);
+    std::vector<char> str_data = ReadSection(&str_it->second);
+    if (sym_data.empty() || str_data.empty()) {
+      return false;
+    }
+    str_data.push_back('\0');
+    for (size_t offset = 0; offset + sizeof(Elf_Sym) <= sym_data.size();
+         offset += sizeof(Elf_Sym)) {
+      Elf_Sym sym;
+      memcpy(&sym, &sym_data[offset], sizeof(sym));
+      if ((sym.st_info & 0xf) != STT_FUNC || sym.st_shndx == SHN_UNDEF || sym.st_value == 0 ||
+          sym.st_name >= str_data.size()) {
+        continue;
+      }
+      ElfSymbol symbol;
+      symbol.vaddr = sym.st_value;
+      symbol.size = sym.st_size;
+      symbol.name = &str_data[sym.st_name];
+      symbols->push_back(std::move(symbol));
+    }
+    std::sort(symbols->begin(), symbols->end(), [](const ElfSymbol& a, const ElfSymbol& b) {
+      return a.vaddr < b.vaddr;
+    });
+    return true;
+  }
+
+  bool ReadSectionData(const char* name, std::vector<char>* data, uint64_t* vaddr) override {
+    const Elf_Shdr* section = GetSection(name);
+    if (section == nullptr) {
+      return false;
+    }
+    *data = ReadSection(section);
+    *vaddr = section->sh_addr;
+    return data->size() == section->sh_size;
+  }
+
  private:
   bool ReadFully(void* buf, size_t size, size_t offset) {
     return read_helper_->ReadFully(buf, size, offset);
@@ -256,7 +411,9 @@ class ElfReaderImpl : public ElfReader {
     if (it != sec_headers_.end()) {
       return &it->second;
     }
-    fprintf(stderr, "No %s section in %s\n", name, read_helper_->GetName());
+    if (log_flag_ & LOG_SECTION_HEADERS) {
+      printf("No %s section in %s\n", name, read_helper_->GetName());
+    }
     return nullptr;
   }
 
@@ -384,8 +541,10 @@ bool ElfReaderImpl<ElfStruct>::ReadGnuDebugData() {
     return false;
   }
   ElfReaderImpl<ElfStruct>* p = reinterpret_cast<ElfReaderImpl<ElfStruct>*>(reader.get());
+  arena_ = std::move(p->arena_);
   cie_table_ = std::move(p->cie_table_);
   fde_table_ = std::move(p->fde_table_);
+  insts_refs_ = std::move(p->insts_refs_);
   read_section_flag_ |= READ_GNU_DEBUG_DATA_SECTION;
   return true;
 }
@@ -397,7 +556,8 @@ bool ElfReaderImpl<ElfStruct>::ReadEhOrDebugFrame(const Elf_Shdr* sec, const std
   const char* p;
   if (log_flag_ & LOG_EH_FRAME_SECTION) {
     printf("%s of %s:\n", is_eh_frame ? ".eh_frame" : ".debug_frame", read_helper_->GetName());
-    CieTable cie_table;
+    Arena arena;
+    CieTable cie_table(&arena);
     for (p = begin; p < end;) {
       const char* cie_begin = p;
       bool section64 = false;
@@ -692,7 +852,7 @@ bool ElfReaderImpl<ElfStruct>::ReadEhOrDebugFrame(const Elf_Shdr* sec, const std
       cie->section64 = section64;
       uint8_t version = Read(p, 1);
       const char* augmentation = ReadStr(p);
-      cie->augmentation = augmentation;
+      cie->augmentation = InstsPool::GetInstance().InternStr(augmentation, &insts_refs_);
       CHECK(augmentation[0] == '\0' || augmentation[0] == 'z');
       uint8_t address_size = Is64() ? 8 : 4; // ELF32 or ELF64
       if (version >= 4) {
@@ -703,6 +863,7 @@ bool ElfReaderImpl<ElfStruct>::ReadEhOrDebugFrame(const Elf_Shdr* sec, const std
       uint64_t code_alignment_factor = ReadULEB128(p);
       int64_t data_alignment_factor = ReadLEB128(p);
       cie->data_alignment_factor = data_alignment_factor;
+      cie->has_eh_info = is_eh_frame;
       uint64_t return_address_register;
       if (version == 1) {
         return_address_register = Read(p, 1);
@@ -718,7 +879,11 @@ bool ElfReaderImpl<ElfStruct>::ReadEhOrDebugFrame(const Elf_Shdr* sec, const std
             cie->fde_pointer_encoding = fde_pointer_encoding;
           } else if (c == 'P') {
             uint8_t encoding = Read(p, 1);
+            uint64_t pc = sec->sh_addr + (p - begin);
             uint64_t personality_handler = ReadEhEncoding(p, encoding, Is64());
+            cie->personality = EhPointerToVaddr(personality_handler, encoding, pc,
+                                             &cie->has_eh_info);
+            cie->personality_indirect = (encoding & DW_EH_PE_indirect) != 0;
           } else if (c == 'L') {
             uint8_t lsda_encoding = Read(p, 1);
             cie->lsda_encoding = lsda_encoding;
@@ -731,7 +896,7 @@ bool ElfReaderImpl<ElfStruct>::ReadEhOrDebugFrame(const Elf_Shdr* sec, const std
         }
       }
       // initial_instructions
-      cie->insts.insert(cie->insts.begin(), p, cie_end);
+      cie->insts = InstsPool::GetInstance().Intern(p, cie_end, &insts_refs_);
     } else {
       uint64_t cie_offset = (is_eh_frame ? p - secbytes - begin - cie_id : cie_id);
       cie = cie_table_.FindCie(cie_offset);
@@ -754,11 +919,13 @@ bool ElfReaderImpl<ElfStruct>::ReadEhOrDebugFrame(const Elf_Shdr* sec, const std
         uint64_t augmentation_len = ReadULEB128(p);
         for (int i = 1; cie->augmentation[i] != '\0'; ++i) {
           if (cie->augmentation[i] == 'L') {
+            uint64_t pc = sec->sh_addr + (p - begin);
             uint64_t lsda = ReadEhEncoding(p, cie->lsda_encoding, Is64());
+            fde->lsda = EhPointerToVaddr(lsda, cie->lsda_encoding, pc, &fde->cie->has_eh_info);
           }
         }
       }
-      fde->insts.insert(fde->insts.begin(), p, cie_end);
+      fde->insts = InstsPool::GetInstance().Intern(p, cie_end, &insts_refs_);
     }
     p = cie_end;
   }
@@ -792,6 +959,7 @@ std::unique_ptr<ElfReader> ElfReader::Open(std::unique_ptr<ReadHelper> read_help
     return nullptr;
   }
   int elf_class = buf[EI_CLASS];
+  std::string filename = read_helper->GetName();
   std::unique_ptr<ElfReader> result;
   if (elf_class == ELFCLASS64) {
     result.reset(new ElfReaderImpl<Elf64Struct>(std::move(read_helper), log_flag));
@@ -806,17 +974,93 @@ std::unique_ptr<ElfReader> ElfReader::Open(std::unique_ptr<ReadHelper> read_help
     return nullptr;
   }
   result->ReadMinVaddr();
+  result->build_id_ = result->ReadBuildId();
+  result->filename_ = std::move(filename);
+  return result;
+}
+
+bool ElfReader::ReadUnwindSection() {
+  std::lock_guard<std::mutex> lock(unwind_section_mutex_);
+  if (shared_index_ != nullptr) {
+    return true;
+  }
+  bool first_read = !shared_index_checked_;
+  if (first_read) {
+    shared_index_checked_ = true;
+    shared_index_ = SharedIndex::Open(build_id_);
+    if (shared_index_ != nullptr) {
+      unwind_section_ready_ = true;
+      return true;
+    }
+  }
+  bool result;
+  if (HasSection(".debug_frame")) {
+    result = ReadDebugFrame();
+  } else if (HasSection(".gnu_debugdata")) {
+    result = ReadGnuDebugData();
+  } else if (HasSection(".eh_frame")) {
+    result = ReadEhFrame();
+  } else {
+    return false;
+  }
+  if (result && first_read) {
+    SharedIndex::Publish(build_id_, fde_table_);
+  }
+  if (result) {
+    unwind_section_ready_ = true;
+  }
   return result;
 }
 
+std::mutex& ElfReaderManager::mutex_ = *new std::mutex;
 std::unordered_map<std::string, std::unique_ptr<ElfReader>>& ElfReaderManager::reader_table_ =
     *new std::unordered_map<std::string, std::unique_ptr<ElfReader>>;
+std::unordered_map<std::string, uint32_t>& ElfReaderManager::module_ids_ =
+    *new std::unordered_map<std::string, uint32_t>;
+std::vector<ElfReader*>& ElfReaderManager::modules_ = *new std::vector<ElfReader*>;
 
 ElfReader* ElfReaderManager::OpenElf(const std::string& filename) {
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    auto it = reader_table_.find(filename);
+    if (it != reader_table_.end()) {
+      return it->second.get();
+    }
+  }
+  // Open the file without holding the lock, so FindElf() never waits for I/O.
+  std::unique_ptr<ElfReader> reader = ElfReader::OpenFile(filename.c_str(), 0);
+  std::lock_guard<std::mutex> lock(mutex_);
+  auto it = reader_table_.find(filename);
+  if (it == reader_table_.end()) {
+    if (reader != nullptr) {
+      // Build ids are prefixed with '\\0', which is never in a filename.
+      std::string key = reader->GetBuildId().empty() ? filename : '\0' + reader->GetBuildId();
+      auto id_it = module_ids_.emplace(key, modules_.size()).first;
+      if (id_it->second == modules_.size()) {
+        modules_.push_back(reader.get());
+      }
+      reader->module_id_ = id_it->second;
+    }
+    it = reader_table_.insert(std::make_pair(filename, std::move(reader))).first;
+  }
+  return it->second.get();
+}
+
+ElfReader* ElfReaderManager::GetModule(uint32_t module_id) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  return (module_id < modules_.size()) ? modules_[module_id] : nullptr;
+}
+
+uint32_t ElfReaderManager::GetModuleCount() {
+  std::lock_guard<std::mutex> lock(mutex_);
+  return modules_.size();
+}
+
+ElfReader* ElfReaderManager::FindElf(const std::string& filename) {
+  std::lock_guard<std::mutex> lock(mutex_);
   auto it = reader_table_.find(filename);
   if (it != reader_table_.end()) {
     return it->second.get();
   }
-  reader_table_[filename] = ElfReader::OpenFile(filename.c_str(), 0);
-  return reader_table_[filename].get();
+  return nullptr;
 }
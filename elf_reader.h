@@ -6,12 +6,18 @@
 #include <stdio.h>
 #include <sys/types.h>
 
+#include <atomic>
 #include <map>
 #include <memory>
+#include <mutex>
 #include <string>
 #include <unordered_map>
 #include <vector>
 
+#include "arena.h"
+#include "insts_pool.h"
+#include "shared_index.h"
+
 struct Cie {
   bool section64;
   uint8_t fde_pointer_encoding;
@@ -19,7 +25,13 @@ struct Cie {
   int address_size;
   const char* augmentation;
   uint64_t data_alignment_factor;
-  std::vector<char> insts;
+  ByteRange insts;
+  // Read from .eh_frame, so personality and the lsdas of its Fdes are known.
+  bool has_eh_info;
+  // Vaddr of the personality routine, or of a pointer to it if
+  // personality_indirect is set. 0 if there is no personality routine.
+  uint64_t personality;
+  bool personality_indirect;
 };
 
 struct Fde {
@@ -27,31 +39,28 @@ struct Fde {
   bool section64;
   uint64_t func_start;
   uint64_t func_end;
-  std::vector<char> insts;
+  ByteRange insts;
+  // Vaddr of the lsda, 0 if there is none.
+  uint64_t lsda;
 };
 
+// Cies and Fdes are allocated in the arena of the ElfReader owning the table,
+// and are freed together with it. Their instructions live in InstsPool,
+// referred to by the insts_refs_ of the reader.
 class CieTable {
  public:
-  CieTable() {
+  explicit CieTable(Arena* arena) : arena_(arena) {
   }
 
+  // Only moves the table, the caller should also move the arena owning the Cies.
   void operator=(CieTable&& other) {
-    for (auto& pair : table_) {
-      delete pair.second;
-    }
     table_ = std::move(other.table_);
     other.table_.clear();
   }
 
-  ~CieTable() {
-    for (auto& pair : table_) {
-      delete pair.second;
-    }
-  }
-
   Cie* CreateCie(uint64_t offset) {
     Cie*& cie = table_[offset];
-    cie = new Cie;
+    cie = arena_->New<Cie>();
     cie->fde_pointer_encoding = 0;
     cie->lsda_encoding = 0;
     cie->address_size = 0;
@@ -70,9 +79,8 @@ class CieTable {
   }
 
  private:
+  Arena* arena_;
   // From offset in .debug_frame or .eh_frame to CIE.
-  // Store Cie* instead of Cie, because we don't want Cie pointers to be invalid
-  // after inserting new Cies.
   std::unordered_map<uint64_t, Cie*> table_;
 
   CieTable(const CieTable&) = delete;
@@ -81,16 +89,18 @@ class CieTable {
 
 class FdeTable {
  public:
-  FdeTable() {
+  explicit FdeTable(Arena* arena) : arena_(arena) {
   }
 
+  // Only moves the table, the caller should also move the arena owning the Fdes.
   void operator=(FdeTable&& other) {
     table_ = std::move(other.table_);
     other.table_.clear();
   }
 
   Fde* CreateFde(uint64_t func_start) {
-    Fde* fde = &table_[func_start];
+    Fde*& fde = table_[func_start];
+    fde = arena_->New<Fde>();
     fde->cie = nullptr;
     fde->func_start = func_start;
     fde->func_end = 0;
@@ -101,19 +111,47 @@ class FdeTable {
     auto it = table_.upper_bound(ip);
     if (it != table_.begin()) {
       --it;
-      return &it->second;
+      return it->second;
     }
     return nullptr;
   }
 
+  const std::map<uint64_t, Fde*>& GetFdes() const {
+    return table_;
+  }
+
  private:
+  Arena* arena_;
   // From start of function to Fde.
-  std::map<uint64_t, Fde> table_;
+  std::map<uint64_t, Fde*> table_;
 
   FdeTable(const FdeTable&) = delete;
   void operator=(const FdeTable&) = delete;
 };
 
+// A program header, in the same form for 32-bit and 64-bit elf files.
+struct ElfSegment {
+  uint32_t type;
+  uint32_t flags;
+  uint64_t offset;
+  uint64_t vaddr;
+  uint64_t filesz;
+  uint64_t memsz;
+};
+
+struct ElfNote {
+  uint32_t type;
+  std::string name;
+  std::vector<char> desc;
+};
+
+// A function symbol of an elf file.
+struct ElfSymbol {
+  uint64_t vaddr;
+  uint64_t size;
+  std::string name;
+};
+
 class ReadHelper {
  public:
   ReadHelper(const char* name) : name_(name) {
@@ -129,7 +167,12 @@ class ReadHelper {
   const std::string name_;
 };
 
+// Module id of dsos not opened by ElfReaderManager.
+static constexpr uint32_t UNKNOWN_MODULE_ID = UINT32_MAX;
+
 class ElfReader {
+  friend class ElfReaderManager;
+
  protected:
   static const int READ_DEBUG_ABBREV_SECTION = 1;
   static const int READ_DEBUG_STR_SECTION = 2;
@@ -156,41 +199,87 @@ class ElfReader {
     return min_vaddr_;
   }
 
+  // Raw bytes of the GNU build id, empty if the elf file doesn't have one.
+  const std::string& GetBuildId() const {
+    return build_id_;
+  }
+
+  const std::string& GetFileName() const {
+    return filename_;
+  }
+
+  // Set by ElfReaderManager, see ElfReaderManager::GetModule().
+  uint32_t GetModuleId() const {
+    return module_id_;
+  }
+
   Fde* GetFdeForVaddrInFile(uint64_t vaddr_in_file) {
+    if (shared_index_ != nullptr) {
+      return shared_index_->FindFde(vaddr_in_file);
+    }
     return fde_table_.FindFde(vaddr_in_file);
   }
 
-  bool ReadUnwindSection() {
-    if (HasSection(".debug_frame")) {
-      return ReadDebugFrame();
-    } else if (HasSection(".gnu_debugdata")) {
-      return ReadGnuDebugData();
-    } else if (HasSection(".eh_frame")) {
-      return ReadEhFrame();
-    } else {
-      return false;
+  // Like above without locks or memory allocation, for signal handlers. An
+  // Fde of a shared index is built in *storage instead of being kept.
+  Fde* GetFdeForVaddrInFileSignalSafe(uint64_t vaddr_in_file, Fde* storage) {
+    if (shared_index_ != nullptr) {
+      return shared_index_->FindFde(vaddr_in_file, storage) ? storage : nullptr;
     }
+    return fde_table_.FindFde(vaddr_in_file);
+  }
+
+  bool ReadUnwindSection();
+
+  // Return true if ReadUnwindSection() has succeeded. It doesn't wait for a
+  // ReadUnwindSection() running in another thread.
+  bool IsUnwindSectionReady() const {
+    return unwind_section_ready_;
   }
 
   virtual bool ReadEhFrame() = 0;
   virtual bool ReadDebugFrame() = 0;
   virtual bool ReadGnuDebugData() = 0;
 
+  // Core files have no sections, only segments and notes.
+  virtual bool IsCore() const = 0;
+  virtual uint16_t GetMachine() const = 0;
+  virtual std::vector<ElfSegment> GetSegments() const = 0;
+  // Read notes in all PT_NOTE segments.
+  virtual bool ReadNotes(std::vector<ElfNote>* notes) = 0;
+  // Read function symbols in .symtab, or in .dynsym if there is no .symtab,
+  // sorted by vaddr.
+  virtual bool ReadSymbols(std::vector<ElfSymbol>* symbols) = 0;
+
+  // Read the contents and the vaddr of section name.
+  virtual bool ReadSectionData(const char* name, std::vector<char>* data, uint64_t* vaddr) = 0;
+
+  // Fdes read by ReadEhFrame() and ReadDebugFrame(), keyed by func_start.
+  const std::map<uint64_t, Fde*>& GetFdes() const {
+    return fde_table_.GetFdes();
+  }
+
  protected:
   static std::unique_ptr<ElfReader> Open(std::unique_ptr<ReadHelper> read_helper,
                                          int log_flag);
 
-  ElfReader() : min_vaddr_(0) {
+  ElfReader() : cie_table_(&arena_), fde_table_(&arena_), min_vaddr_(0),
+      module_id_(UNKNOWN_MODULE_ID), unwind_section_ready_(false), shared_index_checked_(false) {
   }
 
   virtual bool ReadHeader() = 0;
   virtual bool ReadSecHeaders() = 0;
   virtual bool ReadProgramHeaders() = 0;
   virtual uint64_t ReadMinVirtualAddress() = 0;
+  virtual std::string ReadBuildId() = 0;
   virtual bool HasSection(const char* name) = 0;
 
+  // Holds all Cies and Fdes read from the dso.
+  Arena arena_;
   CieTable cie_table_;
   FdeTable fde_table_;
+  // The instructions and augmentation strings of the Cies and Fdes.
+  InstsPool::Refs insts_refs_;
 
  private:
   void ReadMinVaddr() {
@@ -198,13 +287,36 @@ class ElfReader {
   }
 
   uint64_t min_vaddr_;
+  std::string build_id_;
+  std::string filename_;
+  uint32_t module_id_;
+  // Serializes ReadUnwindSection(), which may be called from the background loader.
+  std::mutex unwind_section_mutex_;
+  std::atomic<bool> unwind_section_ready_;
+  bool shared_index_checked_;
+  // Set when the unwind index is mapped from another process.
+  std::unique_ptr<SharedIndex> shared_index_;
 };
 
 class ElfReaderManager {
  public:
   static ElfReader* OpenElf(const std::string& filename);
+  // Return the reader if filename has been opened, without opening it.
+  static ElfReader* FindElf(const std::string& filename);
+
+  // Each opened dso is given a module id, the index of its build id (or its
+  // filename if it has no build id) in the order first seen. So frames in the
+  // same dso get the same module id, whatever process or path they come from.
+  // Return the first reader opened with the module id, or nullptr if there is
+  // no such module.
+  static ElfReader* GetModule(uint32_t module_id);
+  static uint32_t GetModuleCount();
+
  private:
+  static std::mutex& mutex_;
   static std::unordered_map<std::string, std::unique_ptr<ElfReader>>& reader_table_;
+  static std::unordered_map<std::string, uint32_t>& module_ids_;
+  static std::vector<ElfReader*>& modules_;
 };
 
 #endif  // _UNWIND_ELF_READER_H_
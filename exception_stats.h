@@ -0,0 +1,110 @@
+#ifndef _EXCEPTION_STATS_H_
+#define _EXCEPTION_STATS_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <typeinfo>
+
+// Throw sampling: one in every `period` throws of each thread captures the
+// thrown type and the top frames of the throwing stack, and counts it per
+// (type, stack). Other throws only decrease a thread local countdown.
+
+static constexpr int THROW_SAMPLE_MAX_FRAMES = 16;
+
+struct ThrowSample {
+  const std::type_info* type;
+  // Sampled throws, about count * period throws in total.
+  uint64_t count;
+  int frame_count;
+  // Pcs from the function calling __cxa_throw to its callers.
+  uintptr_t pcs[THROW_SAMPLE_MAX_FRAMES];
+};
+
+// Capture up to max_frames pcs of the current thread, return the count
+// captured, or 0 to capture with _Unwind_Backtrace() instead. Frames above
+// the caller of __cxa_throw are dropped afterwards.
+typedef int (*ThrowStackCapture)(uintptr_t* pcs, int max_frames);
+
+extern "C" {
+
+// Sample one in period throws, 0 stops sampling. Stacks are captured by
+// capture. If it is nullptr, they are captured by EhCaptureThrowStack() when
+// eh_unwind.cpp is linked, or by _Unwind_Backtrace() otherwise.
+void SetThrowSampling(uint32_t period, int max_frames, ThrowStackCapture capture);
+
+// Call callback for each (type, stack) sampled. Return the count of them.
+size_t GetThrowSamples(void (*callback)(const ThrowSample* sample, void* arg), void* arg);
+
+// Sampled throws not counted because the table was full, or their entry was
+// still being filled by another throw.
+uint64_t GetDroppedThrowSamples();
+
+}
+
+// Throw instrumentation: each throw is timed from __cxa_throw to the end of
+// phase 1 (the search phase finding a handler), and from there to
+// __cxa_begin_catch (phase 2, the cleanup phase, including the destructors
+// run by cleanup landing pads). Calls of __gxx_personality_v0 are counted
+// and timed, with the LSDA bytes they decode. Frames without a personality
+// routine are passed over by the unwinder without being seen here.
+
+// Bucket i counts values in [2^(i-1), 2^i), bucket 0 counts 0.
+static constexpr int THROW_HISTOGRAM_BUCKETS = 32;
+
+struct ThrowStats {
+  uint64_t throws;
+  // Throws reaching no handler.
+  uint64_t uncaught;
+  uint64_t search_personality_calls;
+  uint64_t cleanup_personality_calls;
+  uint64_t lsda_bytes;
+  uint64_t personality_ns;
+  uint64_t phase1_ns[THROW_HISTOGRAM_BUCKETS];
+  uint64_t phase2_ns[THROW_HISTOGRAM_BUCKETS];
+  uint64_t total_ns[THROW_HISTOGRAM_BUCKETS];
+  // Personality calls of both phases per throw.
+  uint64_t frames[THROW_HISTOGRAM_BUCKETS];
+};
+
+static constexpr int SLOW_THROW_MAX_FRAMES = 32;
+
+struct ThrowFrameRecord {
+  // 1 for the search phase, 2 for the cleanup phase.
+  int phase;
+  // The result of the personality routine.
+  int result;
+  uintptr_t ip;
+  uint32_t lsda_bytes;
+  uint64_t personality_ns;
+};
+
+// Details of a throw slower than the threshold.
+struct SlowThrowRecord {
+  const std::type_info* type;
+  uint64_t phase1_ns;
+  uint64_t phase2_ns;
+  bool caught;
+  // Personality calls, only the first SLOW_THROW_MAX_FRAMES are in frames.
+  int frame_count;
+  ThrowFrameRecord frames[SLOW_THROW_MAX_FRAMES];
+};
+
+typedef void (*SlowThrowCallback)(const SlowThrowRecord* record);
+
+extern "C" {
+
+// Start or stop instrumenting throws. Throws taking at least
+// slow_threshold_ns are passed to callback, in the catching thread.
+void SetThrowInstrumentation(bool enabled, uint64_t slow_threshold_ns,
+                             SlowThrowCallback callback);
+
+// Get stats of throws in the calling thread.
+void GetThreadThrowStats(ThrowStats* stats);
+
+// Get stats of throws in all threads added up.
+void GetThrowStats(ThrowStats* stats);
+
+}
+
+#endif  // _EXCEPTION_STATS_H_
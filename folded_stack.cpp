@@ -0,0 +1,164 @@
+#include "folded_stack.h"
+
+#include <cxxabi.h>
+#include <inttypes.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <algorithm>
+
+SymbolCache::Dso* SymbolCache::GetDso(const RecordModule& module) {
+  std::string key = module.build_id + '\0' + module.name;
+  auto it = dsos_.find(key);
+  if (it != dsos_.end()) {
+    return it->second.get();
+  }
+  std::unique_ptr<Dso> dso;
+  if (!module.name.empty() && module.name[0] != '[') {
+    std::unique_ptr<ElfReader> reader = ElfReader::OpenFile(module.name.c_str(), 0);
+    if (reader != nullptr && reader->GetBuildId() == module.build_id) {
+      dso.reset(new Dso);
+      reader->ReadSymbols(&dso->symbols);
+      dso->names.resize(dso->symbols.size());
+    } else if (reader != nullptr) {
+      fprintf(stderr, "build id of %s doesn't match the record\n", module.name.c_str());
+    }
+  }
+  return (dsos_[key] = std::move(dso)).get();
+}
+
+const std::string& SymbolCache::GetName(const RecordModule& module, uint64_t vaddr_in_file) {
+  Dso* dso = GetDso(module);
+  if (dso != nullptr) {
+    auto it = std::upper_bound(dso->symbols.begin(), dso->symbols.end(), vaddr_in_file,
+                               [](uint64_t vaddr, const ElfSymbol& symbol) {
+                                 return vaddr < symbol.vaddr;
+                               });
+    if (it != dso->symbols.begin()) {
+      --it;
+      if (it->size == 0 || vaddr_in_file < it->vaddr + it->size) {
+        std::string& name = dso->names[it - dso->symbols.begin()];
+        if (name.empty()) {
+          int status;
+          char* demangled = abi::__cxa_demangle(it->name.c_str(), nullptr, nullptr, &status);
+          name = (demangled != nullptr) ? demangled : it->name;
+          free(demangled);
+        }
+        return name;
+      }
+    }
+  }
+  const char* basename = strrchr(module.name.c_str(), '/');
+  basename = (basename != nullptr) ? basename + 1 : module.name.c_str();
+  char buf[32];
+  snprintf(buf, sizeof(buf), "+0x%" PRIx64, vaddr_in_file);
+  return *unknown_names_.insert(std::string(basename) + buf).first;
+}
+
+StackFolder::StackFolder(RecordFile* file) : file_(file) {
+  for (auto& module : file->GetModules()) {
+    modules_[module.pid].push_back(&module);
+  }
+  for (auto& pair : modules_) {
+    std::sort(pair.second.begin(), pair.second.end(),
+              [](const RecordModule* a, const RecordModule* b) { return a->start < b->start; });
+  }
+}
+
+const std::string& StackFolder::GetFrameName(int pid, uint64_t pc, bool is_leaf) {
+  // Pcs of callers are return addresses, which may be past the end of the
+  // calling function, or of its module.
+  pc -= is_leaf ? 0 : 1;
+  const std::string*& name = frame_names_[pid][pc];
+  if (name != nullptr) {
+    return *name;
+  }
+  const RecordModule* module = nullptr;
+  auto modules_it = modules_.find(pid);
+  if (modules_it != modules_.end()) {
+    auto& modules = modules_it->second;
+    auto it = std::upper_bound(modules.begin(), modules.end(), pc,
+                               [](uint64_t pc, const RecordModule* m) { return pc < m->start; });
+    if (it != modules.begin() && pc < (*(it - 1))->end) {
+      module = *(it - 1);
+    }
+  }
+  if (module != nullptr) {
+    uint64_t vaddr_in_file = pc - module->start + module->min_vaddr;
+    name = &symbols_.GetName(*module, vaddr_in_file);
+  } else {
+    static const std::string unknown = "[unknown]";
+    name = &unknown;
+  }
+  return *name;
+}
+
+bool StackFolder::Fold(uint64_t start_time, uint64_t end_time, int tid,
+                       const std::function<void(const std::string&, uint64_t)>& callback) {
+  // A stack may be sampled in several processes, so count by pid too.
+  std::unordered_map<uint64_t, uint64_t> counts;
+  bool result = file_->ReadSamples(start_time, end_time, tid, [&](const RecordSample& sample) {
+    ++counts[static_cast<uint64_t>(sample.stack_id) << 32 | static_cast<uint32_t>(sample.pid)];
+  });
+  if (!result) {
+    return false;
+  }
+  std::vector<std::pair<uint64_t, uint64_t>> sorted_counts(counts.begin(), counts.end());
+  std::sort(sorted_counts.begin(), sorted_counts.end());
+  std::vector<uint64_t> pcs;
+  std::string line;
+  for (auto& pair : sorted_counts) {
+    if (!file_->GetStack(pair.first >> 32, &pcs)) {
+      return false;
+    }
+    int pid = static_cast<int>(pair.first & 0xffffffff);
+    line.clear();
+    for (size_t i = pcs.size(); i > 0; --i) {
+      if (!line.empty()) {
+        line.push_back(';');
+      }
+      line.append(GetFrameName(pid, pcs[i - 1], i == 1));
+    }
+    callback(line, pair.second);
+  }
+  return true;
+}
+
+bool WriteFoldedStacks(RecordFile* file, uint64_t start_time, uint64_t end_time, int tid,
+                       FILE* fp) {
+  StackFolder folder(file);
+  return folder.Fold(start_time, end_time, tid, [&](const std::string& stack, uint64_t count) {
+    fprintf(fp, "%s %" PRIu64 "\n", stack.c_str(), count);
+  });
+}
+
+bool WriteFoldedStackDiff(RecordFile* before, RecordFile* after, FILE* fp) {
+  std::unordered_map<std::string, std::pair<uint64_t, uint64_t>> counts;
+  StackFolder before_folder(before);
+  StackFolder after_folder(after);
+  if (!before_folder.Fold(0, UINT64_MAX, -1, [&](const std::string& stack, uint64_t count) {
+        counts[stack].first += count;
+      }) ||
+      !after_folder.Fold(0, UINT64_MAX, -1, [&](const std::string& stack, uint64_t count) {
+        counts[stack].second += count;
+      })) {
+    return false;
+  }
+  using Entry = std::pair<const std::string, std::pair<uint64_t, uint64_t>>;
+  std::vector<const Entry*> entries;
+  for (auto& entry : counts) {
+    entries.push_back(&entry);
+  }
+  auto change = [](const Entry* e) {
+    return (e->second.first > e->second.second) ? e->second.first - e->second.second
+                                                : e->second.second - e->second.first;
+  };
+  std::sort(entries.begin(), entries.end(), [&](const Entry* a, const Entry* b) {
+    return change(a) > change(b) || (change(a) == change(b) && a->first < b->first);
+  });
+  for (auto entry : entries) {
+    fprintf(fp, "%s %" PRIu64 " %" PRIu64 "\n", entry->first.c_str(), entry->second.first,
+            entry->second.second);
+  }
+  return true;
+}
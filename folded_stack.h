@@ -0,0 +1,80 @@
+#ifndef _UNWIND_FOLDED_STACK_H_
+#define _UNWIND_FOLDED_STACK_H_
+
+#include <stdint.h>
+#include <stdio.h>
+
+#include <functional>
+#include <map>
+#include <memory>
+#include <string>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+
+#include "elf_reader.h"
+#include "record_file.h"
+
+// Converts pcs of dsos to function names. Symbols of each dso are read once,
+// and only if its build id matches the module recorded.
+class SymbolCache {
+ public:
+  // Return the demangled name of the function holding vaddr_in_file, or
+  // "dso+0xvaddr_in_file" if it isn't found. The string lives as long as the
+  // cache.
+  const std::string& GetName(const RecordModule& module, uint64_t vaddr_in_file);
+
+ private:
+  struct Dso {
+    std::vector<ElfSymbol> symbols;
+    // Demangled names of symbols, empty until used.
+    std::vector<std::string> names;
+  };
+
+  Dso* GetDso(const RecordModule& module);
+
+  // Keyed by build id and path, nullptr if the dso can't be read.
+  std::unordered_map<std::string, std::unique_ptr<Dso>> dsos_;
+  // Names of pcs not in any symbol.
+  std::unordered_set<std::string> unknown_names_;
+};
+
+// Turns samples of a record file into stacks in the collapsed stack format
+// read by flame graph tools: function names from the root frame to the leaf
+// frame, separated by ';'.
+class StackFolder {
+ public:
+  explicit StackFolder(RecordFile* file);
+
+  // Count samples with time in [start_time, end_time] of thread tid (or of
+  // all threads if tid is -1) by stack, and call callback for each stack
+  // sampled, in stack id order. Stacks of different pcs may fold to the same
+  // line, tools reading the format add them up.
+  bool Fold(uint64_t start_time, uint64_t end_time, int tid,
+            const std::function<void(const std::string& stack, uint64_t count)>& callback);
+
+ private:
+  const std::string& GetFrameName(int pid, uint64_t pc, bool is_leaf);
+
+  RecordFile* file_;
+  SymbolCache symbols_;
+  // Modules of each pid, sorted by start.
+  std::map<int, std::vector<const RecordModule*>> modules_;
+  // Names of pcs already looked up, keyed by pid and the pc looked up, which
+  // is one byte back for callers.
+  std::unordered_map<int, std::unordered_map<uint64_t, const std::string*>> frame_names_;
+};
+
+// Write "stack count" lines of samples in [start_time, end_time] of thread
+// tid, or of all threads if tid is -1. Lines are written as each stack is
+// folded.
+bool WriteFoldedStacks(RecordFile* file, uint64_t start_time, uint64_t end_time, int tid,
+                       FILE* fp);
+
+// Write "stack before_count after_count" lines, the differential format read
+// by flame graph tools, for stacks in either file. Stack ids are local to a
+// file, and pcs change when a binary is rebuilt, so stacks are matched by the
+// folded names. Lines are sorted by the change of count, biggest first.
+bool WriteFoldedStackDiff(RecordFile* before, RecordFile* after, FILE* fp);
+
+#endif  // _UNWIND_FOLDED_STACK_H_
@@ -0,0 +1,93 @@
+#ifndef _UNWIND_GET_CURRENT_REGS_H_
+#define _UNWIND_GET_CURRENT_REGS_H_
+
+// GET_CURRENT_REGS(regs) saves the registers needed to start unwinding from
+// the current function: pc, sp, fp and the callee saved registers. regs is an
+// array of word sized values in dwarf register order, other slots are left
+// untouched. It expands to a few stores at the call site, so there is no call
+// frame to skip and no full register spill.
+//
+// The saved pc is an address inside the capture code, so the unwinder maps it
+// to the right function after subtracting its pc adjustment.
+//
+// CURRENT_REGS_SP is the slot of sp in regs.
+
+#if defined(__x86_64__)
+
+#define CURRENT_REGS_SP 7
+
+#define GET_CURRENT_REGS(regs)                  \
+  __asm__ __volatile__(                         \
+      "movq %%rbx, 0x18(%0)\n"                  \
+      "movq %%rbp, 0x30(%0)\n"                  \
+      "movq %%rsp, 0x38(%0)\n"                  \
+      "movq %%r12, 0x60(%0)\n"                  \
+      "movq %%r13, 0x68(%0)\n"                  \
+      "movq %%r14, 0x70(%0)\n"                  \
+      "movq %%r15, 0x78(%0)\n"                  \
+      "leaq 1f(%%rip), %%rax\n"                 \
+      "movq %%rax, 0x80(%0)\n"                  \
+      "1:\n"                                    \
+      : : "r"(regs) : "rax", "memory")
+
+#elif defined(__i386__)
+
+#define CURRENT_REGS_SP 4
+
+// call/pop is used to get eip, as there is no pc relative lea.
+#define GET_CURRENT_REGS(regs)                  \
+  __asm__ __volatile__(                         \
+      "movl %%ebx, 0x0c(%0)\n"                  \
+      "movl %%esp, 0x10(%0)\n"                  \
+      "movl %%ebp, 0x14(%0)\n"                  \
+      "movl %%esi, 0x18(%0)\n"                  \
+      "movl %%edi, 0x1c(%0)\n"                  \
+      "call 1f\n"                               \
+      "1:\n"                                    \
+      "popl %%eax\n"                            \
+      "movl %%eax, 0x20(%0)\n"                  \
+      : : "r"(regs) : "eax", "memory")
+
+#elif defined(__aarch64__)
+
+#define CURRENT_REGS_SP 31
+
+// Like the unwinder, slot 30 holds the pc.
+#define GET_CURRENT_REGS(regs)                  \
+  __asm__ __volatile__(                         \
+      "stp x19, x20, [%0, #0x98]\n"             \
+      "stp x21, x22, [%0, #0xa8]\n"             \
+      "stp x23, x24, [%0, #0xb8]\n"             \
+      "stp x25, x26, [%0, #0xc8]\n"             \
+      "stp x27, x28, [%0, #0xd8]\n"             \
+      "str x29, [%0, #0xe8]\n"                  \
+      "adr x16, 1f\n"                           \
+      "mov x17, sp\n"                           \
+      "stp x16, x17, [%0, #0xf0]\n"             \
+      "1:\n"                                    \
+      : : "r"(regs) : "x16", "x17", "memory")
+
+#elif defined(__arm__)
+
+#define CURRENT_REGS_SP 13
+
+// The unwinder takes the pc from lr minus 8, so lr is set to the address of
+// the last instruction plus 8.
+#define GET_CURRENT_REGS(regs)                  \
+  __asm__ __volatile__(                         \
+      "add r12, %0, #0x10\n"                    \
+      "stm r12, {r4-r11}\n"                     \
+      "mov r12, sp\n"                           \
+      "str r12, [%0, #0x34]\n"                  \
+      "adr r12, 1f\n"                           \
+      "add r12, r12, #4\n"                      \
+      "str r12, [%0, #0x38]\n"                  \
+      "str r12, [%0, #0x3c]\n"                  \
+      "1:\n"                                    \
+      : : "r"(regs) : "r12", "memory")
+
+#else
+#error "GET_CURRENT_REGS isn't supported on this arch"
+#endif
+
+#endif  // _UNWIND_GET_CURRENT_REGS_H_
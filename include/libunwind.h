@@ -0,0 +1,90 @@
+#ifndef _UNWIND_LIBUNWIND_H_
+#define _UNWIND_LIBUNWIND_H_
+
+// A subset of the libunwind local unwinding API, implemented on UnwindCursor.
+// Programs using the functions below can link with libunwind_compat instead
+// of libunwind without code changes.
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "get_current_regs.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef uintptr_t unw_word_t;
+typedef int unw_regnum_t;
+
+// Registers saved by GET_CURRENT_REGS(), in dwarf register order.
+typedef struct {
+  unw_word_t regs[33];
+} unw_context_t;
+
+typedef struct {
+  uint64_t opaque[64];
+} unw_cursor_t;
+
+typedef enum {
+  UNW_ESUCCESS = 0,
+  UNW_EUNSPEC,
+  UNW_ENOMEM,
+  UNW_EBADREG,
+  UNW_EREADONLYREG,
+  UNW_ESTOPUNWIND,
+  UNW_EINVALIDIP,
+  UNW_EBADFRAME,
+  UNW_EINVAL,
+  UNW_EBADVERSION,
+  UNW_ENOINFO,
+} unw_error_t;
+
+#if defined(__x86_64__)
+typedef enum {
+  UNW_X86_64_RAX,
+  UNW_X86_64_RDX,
+  UNW_X86_64_RCX,
+  UNW_X86_64_RBX,
+  UNW_X86_64_RSI,
+  UNW_X86_64_RDI,
+  UNW_X86_64_RBP,
+  UNW_X86_64_RSP,
+  UNW_X86_64_R8,
+  UNW_X86_64_R9,
+  UNW_X86_64_R10,
+  UNW_X86_64_R11,
+  UNW_X86_64_R12,
+  UNW_X86_64_R13,
+  UNW_X86_64_R14,
+  UNW_X86_64_R15,
+  UNW_X86_64_RIP,
+} x86_64_regnum_t;
+#define UNW_REG_IP UNW_X86_64_RIP
+#define UNW_REG_SP UNW_X86_64_RSP
+#elif defined(__i386__)
+#define UNW_REG_IP 8
+#define UNW_REG_SP 4
+#elif defined(__aarch64__)
+#define UNW_REG_IP 30
+#define UNW_REG_SP 31
+#elif defined(__arm__)
+#define UNW_REG_IP 14
+#define UNW_REG_SP 13
+#endif
+
+// Like libunwind, this is a macro, so the registers are those of the caller.
+#define unw_getcontext(uc) ({ GET_CURRENT_REGS((uc)->regs); 0; })
+
+int unw_init_local(unw_cursor_t* cursor, unw_context_t* uc);
+// Return a positive value after moving to the caller frame, 0 at the end of
+// the stack, and a negative unw_error_t on failure.
+int unw_step(unw_cursor_t* cursor);
+int unw_get_reg(unw_cursor_t* cursor, unw_regnum_t regnum, unw_word_t* value);
+int unw_get_proc_name(unw_cursor_t* cursor, char* buf, size_t buf_len, unw_word_t* offset);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif  // _UNWIND_LIBUNWIND_H_
@@ -0,0 +1,131 @@
+#include "insts_pool.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#include <atomic>
+
+static std::atomic<uint64_t> next_refs_id(1);
+
+InstsPool::Refs::Refs() : id_(next_refs_id++) {
+}
+
+InstsPool::Refs::Refs(Refs&& other) : Refs() {
+  *this = std::move(other);
+}
+
+InstsPool::Refs& InstsPool::Refs::operator=(Refs&& other) {
+  if (this != &other) {
+    InstsPool::GetInstance().Release(this);
+    id_ = other.id_;
+    for (size_t i = 0; i < SHARD_COUNT; ++i) {
+      entries_[i] = std::move(other.entries_[i]);
+      other.entries_[i].clear();
+    }
+    other.id_ = next_refs_id++;
+  }
+  return *this;
+}
+
+InstsPool::Refs::~Refs() {
+  InstsPool::GetInstance().Release(this);
+}
+
+InstsPool& InstsPool::GetInstance() {
+  static InstsPool& pool = *new InstsPool;
+  return pool;
+}
+
+// FNV-1a.
+size_t InstsPool::Hash(const char* begin, const char* end) {
+  uint64_t hash = 0xcbf29ce484222325ULL;
+  for (const char* p = begin; p < end; ++p) {
+    hash ^= static_cast<uint8_t>(*p);
+    hash *= 0x100000001b3ULL;
+  }
+  return static_cast<size_t>(hash);
+}
+
+bool InstsPool::KeyEqual::operator()(const Key& a, const Key& b) const {
+  return a.hash == b.hash && a.range.size() == b.range.size() &&
+         memcmp(a.range.begin, b.range.begin, a.range.size()) == 0;
+}
+
+ByteRange InstsPool::Intern(const char* begin, const char* end, Refs* refs) {
+  Key key;
+  key.range.begin = begin;
+  key.range.end = end;
+  key.hash = Hash(begin, end);
+  size_t shard_index = GetShardIndex(key.hash);
+  Shard& shard = shards_[shard_index];
+  std::lock_guard<std::mutex> lock(shard.mutex);
+  shard.stats.intern_count++;
+  shard.stats.requested_bytes += key.range.size();
+  Entry* entry;
+  auto it = shard.table.find(key);
+  if (it != shard.table.end()) {
+    shard.stats.hit_count++;
+    entry = it->second;
+  } else {
+    size_t size = key.range.size();
+    entry = static_cast<Entry*>(malloc(sizeof(Entry) + size));
+    char* data = reinterpret_cast<char*>(entry + 1);
+    memcpy(data, begin, size);
+    entry->range.begin = data;
+    entry->range.end = data + size;
+    entry->hash = key.hash;
+    entry->ref_count = 0;
+    entry->last_refs_id = 0;
+    key.range = entry->range;
+    shard.table.insert(std::make_pair(key, entry));
+    shard.stats.stored_bytes += size;
+    shard.stats.live_bytes += size;
+  }
+  if (entry->last_refs_id != refs->id_) {
+    entry->last_refs_id = refs->id_;
+    entry->ref_count++;
+    refs->entries_[shard_index].push_back(entry);
+  }
+  return entry->range;
+}
+
+const char* InstsPool::InternStr(const char* s, Refs* refs) {
+  return Intern(s, s + strlen(s) + 1, refs).begin;
+}
+
+void InstsPool::Release(Refs* refs) {
+  for (size_t i = 0; i < SHARD_COUNT; ++i) {
+    std::vector<Entry*>& entries = refs->entries_[i];
+    if (entries.empty()) {
+      continue;
+    }
+    Shard& shard = shards_[i];
+    std::lock_guard<std::mutex> lock(shard.mutex);
+    for (Entry* entry : entries) {
+      if (--entry->ref_count != 0) {
+        continue;
+      }
+      Key key;
+      key.range = entry->range;
+      key.hash = entry->hash;
+      shard.table.erase(key);
+      shard.stats.live_bytes -= entry->range.size();
+      free(entry);
+    }
+    entries.clear();
+  }
+}
+
+InstsPool::Stats InstsPool::GetStats() {
+  Stats stats;
+  memset(&stats, 0, sizeof(stats));
+  for (auto& shard : shards_) {
+    std::lock_guard<std::mutex> lock(shard.mutex);
+    stats.intern_count += shard.stats.intern_count;
+    stats.hit_count += shard.stats.hit_count;
+    stats.requested_bytes += shard.stats.requested_bytes;
+    stats.stored_bytes += shard.stats.stored_bytes;
+    stats.live_bytes += shard.stats.live_bytes;
+  }
+  return stats;
+}
@@ -0,0 +1,115 @@
+#ifndef _UNWIND_INSTS_POOL_H_
+#define _UNWIND_INSTS_POOL_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <mutex>
+#include <unordered_map>
+#include <vector>
+
+#include "arena.h"
+
+// Process wide storage for CFA instructions and augmentation strings, shared
+// by all ElfReaders. Many functions have byte-identical instructions (like the
+// standard frame pointer prologue), and identical CIEs repeat in every dso
+// built by the same compiler, so each distinct byte sequence is stored once.
+// Instructions in an Fde are relative to its func_start, so Fdes sharing
+// instructions also share the rules computed from them.
+//
+// Each ElfReader refers to the ranges it interned through its Refs, and a
+// range is freed when the last reader referring to it is destroyed. The table
+// is split into shards by hash, each with its own lock, so dsos parsed in
+// parallel rarely wait for each other.
+class InstsPool {
+  struct Entry;
+  static constexpr size_t SHARD_COUNT = 16;
+
+ public:
+  struct Stats {
+    size_t intern_count;
+    size_t hit_count;
+    size_t requested_bytes;
+    // Bytes copied into the pool, including those freed since.
+    size_t stored_bytes;
+    // Bytes of ranges still referred to.
+    size_t live_bytes;
+  };
+
+  // The ranges interned for one owner, released when it is destroyed.
+  class Refs {
+   public:
+    Refs();
+    Refs(Refs&& other);
+    Refs& operator=(Refs&& other);
+    ~Refs();
+
+   private:
+    friend class InstsPool;
+
+    // Never reused, so an entry remembering the last Refs it was added to
+    // is added to each Refs once.
+    uint64_t id_;
+    // Entries by shard, so each shard is locked once on release.
+    std::vector<Entry*> entries_[SHARD_COUNT];
+
+    Refs(const Refs&) = delete;
+    void operator=(const Refs&) = delete;
+  };
+
+  static InstsPool& GetInstance();
+
+  // Return a range holding the bytes of [begin, end), valid while refs is.
+  ByteRange Intern(const char* begin, const char* end, Refs* refs);
+  const char* InternStr(const char* s, Refs* refs);
+  Stats GetStats();
+
+ private:
+  // Followed by the bytes of range.
+  struct Entry {
+    ByteRange range;
+    size_t hash;
+    size_t ref_count;
+    uint64_t last_refs_id;
+  };
+
+  // Keys are hashed once, for both the shard and its table.
+  struct Key {
+    ByteRange range;
+    size_t hash;
+  };
+
+  struct KeyHash {
+    size_t operator()(const Key& key) const {
+      return key.hash;
+    }
+  };
+
+  struct KeyEqual {
+    bool operator()(const Key& a, const Key& b) const;
+  };
+
+  struct Shard {
+    Shard() : stats() {
+    }
+
+    std::mutex mutex;
+    std::unordered_map<Key, Entry*, KeyHash, KeyEqual> table;
+    Stats stats;
+  };
+
+  InstsPool() {
+  }
+
+  static size_t Hash(const char* begin, const char* end);
+
+  static size_t GetShardIndex(size_t hash) {
+    return (hash >> 32) % SHARD_COUNT;
+  }
+
+  void Release(Refs* refs);
+
+  Shard shards_[SHARD_COUNT];
+};
+
+#endif  // _UNWIND_INSTS_POOL_H_
@@ -0,0 +1,78 @@
+#include "libunwind.h"
+
+#include <dlfcn.h>
+#include <string.h>
+
+#include <new>
+
+#include "unwind.h"
+
+static_assert(sizeof(UnwindCursor) <= sizeof(unw_cursor_t), "unw_cursor_t is too small");
+static_assert(alignof(UnwindCursor) <= alignof(unw_cursor_t), "unw_cursor_t isn't aligned");
+static_assert(sizeof(unw_context_t) >= UNWIND_MAX_REGS * sizeof(unw_word_t),
+              "unw_context_t is too small");
+
+static UnwindCursor* GetCursor(unw_cursor_t* cursor) {
+  return reinterpret_cast<UnwindCursor*>(cursor->opaque);
+}
+
+int unw_init_local(unw_cursor_t* cursor, unw_context_t* uc) {
+  // Cursors are dropped without being destroyed, like in libunwind. That's
+  // fine as an UnwindCursor owns no memory and holds no lock or MapTree
+  // between calls, though it isn't trivially destructible (CheckedMemory has
+  // a virtual destructor).
+  UnwindCursor* c = new (cursor->opaque) UnwindCursor;
+  c->Init(uc->regs);
+  return UNW_ESUCCESS;
+}
+
+int unw_step(unw_cursor_t* cursor) {
+  UnwindCursor* c = GetCursor(cursor);
+  if (c->Step()) {
+    return 1;
+  }
+  if (c->Finished()) {
+    return 0;
+  }
+  return c->IsUnresolved() ? -UNW_ENOINFO : -UNW_EBADFRAME;
+}
+
+int unw_get_reg(unw_cursor_t* cursor, unw_regnum_t regnum, unw_word_t* value) {
+  UnwindCursor* c = GetCursor(cursor);
+  if (regnum == UNW_REG_IP) {
+    *value = c->GetPc();
+    return UNW_ESUCCESS;
+  }
+  uint64_t reg;
+  if (!c->GetReg(regnum, &reg)) {
+    return -UNW_EBADREG;
+  }
+  *value = reg;
+  return UNW_ESUCCESS;
+}
+
+// Only dynamic symbols are found, as dladdr() doesn't read .symtab. Caller
+// frames are looked up by the call, offset is still from the pc.
+int unw_get_proc_name(unw_cursor_t* cursor, char* buf, size_t buf_len, unw_word_t* offset) {
+  UnwindCursor* c = GetCursor(cursor);
+  uintptr_t pc = c->GetPc();
+  uintptr_t lookup_pc = c->IsCallerFrame() ? pc - 1 : pc;
+  Dl_info info;
+  if (dladdr(reinterpret_cast<void*>(lookup_pc), &info) == 0 || info.dli_sname == nullptr) {
+    return -UNW_ENOINFO;
+  }
+  if (offset != nullptr) {
+    *offset = pc - reinterpret_cast<uintptr_t>(info.dli_saddr);
+  }
+  size_t len = strlen(info.dli_sname);
+  if (buf_len == 0) {
+    return -UNW_ENOMEM;
+  }
+  if (len >= buf_len) {
+    memcpy(buf, info.dli_sname, buf_len - 1);
+    buf[buf_len - 1] = '\0';
+    return -UNW_ENOMEM;
+  }
+  memcpy(buf, info.dli_sname, len + 1);
+  return UNW_ESUCCESS;
+}
@@ -0,0 +1,307 @@
+#ifndef _LSDA_H_
+#define _LSDA_H_
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "dwarf.h"
+
+// The language specific data area of a function in .gcc_except_table, read
+// by __gxx_personality_v0() and by the lsda_cost tool. Fields are decoded in
+// the DW_EH_PE encodings the lsda header names. Readers are templates on the
+// call site and type table encodings: the combinations gcc and clang emit are
+// instantiated with constant encodings, others with LSDA_ANY_ENCODING read
+// the encodings at run time. See VisitLsdaEncodings().
+
+typedef unsigned long long uleb128_t;
+
+static inline uleb128_t ReadUleb128(const uint8_t*& p) {
+  uleb128_t result = 0;
+  int shift = 0;
+  while (*p & 0x80) {
+    result |= static_cast<uleb128_t>(*p & 0x7f) << shift;
+    shift += 7;
+    p++;
+  }
+  result |= static_cast<uleb128_t>(*p & 0x7f) << shift;
+  p++;
+  return result;
+}
+
+static inline long long ReadSleb128(const uint8_t*& p) {
+  long long result = 0;
+  int shift = 0;
+  uint8_t byte;
+  do {
+    byte = *p++;
+    result |= static_cast<long long>(byte & 0x7f) << shift;
+    shift += 7;
+  } while (byte & 0x80);
+  if (shift < 64 && (byte & 0x40)) {
+    result |= static_cast<long long>(~0ULL << shift);
+  }
+  return result;
+}
+
+// Template argument for encodings only known at run time.
+static constexpr int LSDA_ANY_ENCODING = 0x100;
+
+// The type table encoding of gcc and clang for pic code: a pc relative
+// pointer to a GOT slot holding the std::type_info pointer.
+static constexpr int LSDA_INDIRECT_PCREL_SDATA4 = DW_EH_PE_indirect | DW_EH_PE_pcrel |
+                                                  DW_EH_PE_sdata4;
+
+// What encoded pointers in an lsda are relative to.
+struct LsdaBase {
+  // Added to the address of a value to get its vaddr, which pcrel values are
+  // relative to. 0 in process, lsdas read from files aren't at their vaddr.
+  uint64_t vaddr_bias;
+  uint64_t func_start;
+  uint64_t text_base;
+  uint64_t data_base;
+  int address_size;
+  // Read DW_EH_PE_indirect pointers, only possible in process.
+  bool dereference;
+
+  LsdaBase()
+      : vaddr_bias(0), func_start(0), text_base(0), data_base(0),
+        address_size(sizeof(uintptr_t)), dereference(true) {
+  }
+};
+
+template <int ENCODING>
+static inline uint8_t GetEncoding(uint8_t encoding) {
+  return (ENCODING == LSDA_ANY_ENCODING) ? encoding : static_cast<uint8_t>(ENCODING);
+}
+
+// Size of values in encoding, 0 for leb128 and unknown formats.
+static inline size_t GetEncodedSize(uint8_t encoding, int address_size) {
+  switch (encoding & 0x0f) {
+    case DW_EH_PE_absptr:
+      return address_size;
+    case DW_EH_PE_udata2:
+    case DW_EH_PE_sdata2:
+      return 2;
+    case DW_EH_PE_udata4:
+    case DW_EH_PE_sdata4:
+      return 4;
+    case DW_EH_PE_udata8:
+    case DW_EH_PE_sdata8:
+      return 8;
+  }
+  return 0;
+}
+
+template <typename T>
+static inline uint64_t ReadFixed(const uint8_t*& p) {
+  T value;
+  memcpy(&value, p, sizeof(T));
+  p += sizeof(T);
+  return static_cast<uint64_t>(static_cast<int64_t>(value));
+}
+
+// Read a value in the format of encoding (its low 4 bits). Return false if
+// the format is unknown.
+template <int ENCODING>
+static inline bool ReadEncodedValue(const uint8_t*& p, uint8_t encoding, int address_size,
+                                    uint64_t* value) {
+  switch (GetEncoding<ENCODING>(encoding) & 0x0f) {
+    case DW_EH_PE_absptr:
+      *value = (address_size == 4) ? ReadFixed<uint32_t>(p) : ReadFixed<uint64_t>(p);
+      return true;
+    case DW_EH_PE_uleb128:
+      *value = ReadUleb128(p);
+      return true;
+    case DW_EH_PE_udata2:
+      *value = ReadFixed<uint16_t>(p);
+      return true;
+    case DW_EH_PE_udata4:
+      *value = ReadFixed<uint32_t>(p);
+      return true;
+    case DW_EH_PE_udata8:
+      *value = ReadFixed<uint64_t>(p);
+      return true;
+    case DW_EH_PE_sleb128:
+      *value = ReadSleb128(p);
+      return true;
+    case DW_EH_PE_sdata2:
+      *value = ReadFixed<int16_t>(p);
+      return true;
+    case DW_EH_PE_sdata4:
+      *value = ReadFixed<int32_t>(p);
+      return true;
+    case DW_EH_PE_sdata8:
+      *value = ReadFixed<int64_t>(p);
+      return true;
+  }
+  return false;
+}
+
+// Read a pointer in encoding, applying its base. 0 stays 0, like in libgcc.
+// Return false if the encoding is unknown, or needs a base not given.
+template <int ENCODING>
+static inline bool ReadEncodedPointer(const uint8_t*& p, uint8_t encoding, const LsdaBase& base,
+                                      uint64_t* pointer) {
+  encoding = GetEncoding<ENCODING>(encoding);
+  if (encoding == DW_EH_PE_omit) {
+    return false;
+  }
+  if ((encoding & 0x70) == DW_EH_PE_aligned) {
+    uint64_t vaddr = reinterpret_cast<uintptr_t>(p) + base.vaddr_bias;
+    p += (base.address_size - vaddr % base.address_size) % base.address_size;
+  }
+  const uint8_t* start = p;
+  uint64_t value;
+  if (!ReadEncodedValue<ENCODING>(p, encoding, base.address_size, &value)) {
+    return false;
+  }
+  if (value != 0) {
+    switch (encoding & 0x70) {
+      case DW_EH_PE_absptr:
+      case DW_EH_PE_aligned:
+        break;
+      case DW_EH_PE_pcrel:
+        value += reinterpret_cast<uintptr_t>(start) + base.vaddr_bias;
+        break;
+      case DW_EH_PE_funcrel:
+        value += base.func_start;
+        break;
+      case DW_EH_PE_textrel:
+        if (base.text_base == 0) {
+          return false;
+        }
+        value += base.text_base;
+        break;
+      case DW_EH_PE_datarel:
+        if (base.data_base == 0) {
+          return false;
+        }
+        value += base.data_base;
+        break;
+      default:
+        return false;
+    }
+    if (base.address_size == 4) {
+      value = static_cast<uint32_t>(value);
+    }
+    if ((encoding & DW_EH_PE_indirect) && base.dereference) {
+      value = *reinterpret_cast<const uintptr_t*>(static_cast<uintptr_t>(value));
+    }
+  }
+  *pointer = value;
+  return true;
+}
+
+// structure in .gcc_except_table
+struct LSDA_Header {
+  uint8_t lsda_start_encoding;
+  uint8_t lsda_type_encoding;
+  uleb128_t type_table_offset; // from next position
+  uint8_t call_site_encoding;
+  uleb128_t call_site_length;
+
+  // Landing pads are relative to it, the function start if LPStart is omitted.
+  uint64_t landing_pad_base;
+  const uint8_t* call_site_start;
+  const uint8_t* call_site_end;
+  const uint8_t* action_table;
+  // The end of the type table, entries are indexed backwards from it.
+  // nullptr if there is no type table.
+  const uint8_t* type_table;
+  // LPStart couldn't be decoded.
+  bool valid;
+
+  LSDA_Header(const uint8_t*& ptr, const LsdaBase& base) {
+    valid = true;
+    lsda_start_encoding = *ptr++;
+    landing_pad_base = base.func_start;
+    if (lsda_start_encoding != DW_EH_PE_omit) {
+      valid = ReadEncodedPointer<LSDA_ANY_ENCODING>(ptr, lsda_start_encoding, base,
+                                                    &landing_pad_base);
+    }
+    lsda_type_encoding = *ptr++;
+    if (lsda_type_encoding == DW_EH_PE_omit) {
+      type_table_offset = 0;
+      type_table = NULL;
+    } else {
+      type_table_offset = ReadUleb128(ptr);
+      type_table = ptr + type_table_offset;
+    }
+    call_site_encoding = *ptr++;
+    call_site_length = ReadUleb128(ptr);
+    call_site_start = ptr;
+    call_site_end = ptr + call_site_length;
+    action_table = ptr + call_site_length;
+  }
+};
+
+struct LSDA_Call_Site {
+  // Read a call site, whose offsets are in the call site encoding. Return
+  // false if the encoding is unknown.
+  template <int ENCODING>
+  bool Read(const uint8_t*& ptr, const LSDA_Header& header, int address_size) {
+    uint8_t encoding = header.call_site_encoding;
+    if (!ReadEncodedValue<ENCODING>(ptr, encoding, address_size, &cs_start) ||
+        !ReadEncodedValue<ENCODING>(ptr, encoding, address_size, &cs_len) ||
+        !ReadEncodedValue<ENCODING>(ptr, encoding, address_size, &cs_lp)) {
+      return false;
+    }
+    cs_action = ReadUleb128(ptr);
+    return true;
+  }
+
+  uint64_t cs_start;
+  uint64_t cs_len;
+  uint64_t cs_lp;  // landing pad position
+  uleb128_t cs_action;  // cs.action is the offset + 1; cs.action == 0 means
+    // there is no associated entry in the action table.
+};
+
+// Read the entry of type filter type_index (> 0) in the type table: the
+// address of a std::type_info, 0 for catch (...). Return false if the type
+// table encoding is unknown.
+template <int TYPE_ENCODING>
+static inline bool ReadTypeTableEntry(const LSDA_Header& header, int64_t type_index,
+                                      const LsdaBase& base, uint64_t* type_info) {
+  uint8_t encoding = GetEncoding<TYPE_ENCODING>(header.lsda_type_encoding);
+  size_t size = GetEncodedSize(encoding, base.address_size);
+  if (header.type_table == nullptr || size == 0) {
+    return false;
+  }
+  const uint8_t* p = header.type_table - type_index * size;
+  return ReadEncodedPointer<TYPE_ENCODING>(p, encoding, base, type_info);
+}
+
+// Call visitor.template Visit<CALL_SITE_ENCODING, TYPE_ENCODING>() with
+// the encodings of header as constants if gcc or clang emit them, or as
+// LSDA_ANY_ENCODING.
+template <typename Visitor>
+static inline bool VisitLsdaEncodings(const LSDA_Header& header, Visitor& visitor) {
+  if (header.call_site_encoding == DW_EH_PE_uleb128) {
+    switch (header.lsda_type_encoding) {
+      case DW_EH_PE_omit:
+        // Cleanups only.
+        return visitor.template Visit<DW_EH_PE_uleb128, DW_EH_PE_omit>();
+      case LSDA_INDIRECT_PCREL_SDATA4:
+        // pic code.
+        return visitor.template Visit<DW_EH_PE_uleb128, LSDA_INDIRECT_PCREL_SDATA4>();
+      case DW_EH_PE_udata4:
+        // Non-pic code.
+        return visitor.template Visit<DW_EH_PE_uleb128, DW_EH_PE_udata4>();
+    }
+  } else if (header.call_site_encoding == DW_EH_PE_udata4) {
+    // Older clang.
+    switch (header.lsda_type_encoding) {
+      case DW_EH_PE_omit:
+        return visitor.template Visit<DW_EH_PE_udata4, DW_EH_PE_omit>();
+      case LSDA_INDIRECT_PCREL_SDATA4:
+        return visitor.template Visit<DW_EH_PE_udata4, LSDA_INDIRECT_PCREL_SDATA4>();
+      case DW_EH_PE_udata4:
+        return visitor.template Visit<DW_EH_PE_udata4, DW_EH_PE_udata4>();
+    }
+  }
+  return visitor.template Visit<LSDA_ANY_ENCODING, LSDA_ANY_ENCODING>();
+}
+
+#endif  // _LSDA_H_
@@ -0,0 +1,278 @@
+// Rank functions of an elf file by the cost of their exception tables.
+//
+// For each function with an lsda in .gcc_except_table, count its call sites,
+// landing pads, catch clauses and cleanup-only call sites, and estimate what
+// a throw passing through it costs. The personality routine decodes the lsda
+// header, the call sites up to the one of the throw and its action chain, in
+// both the search and the cleanup phase, and the unwinder runs the CFI of the
+// function once per phase. The estimate is the bytes decoded, with throws
+// equally likely from each call site.
+
+#include <cxxabi.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <algorithm>
+#include <atomic>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "dwarf.h"
+#include "elf_reader.h"
+#include "lsda.h"
+
+struct LsdaCost {
+  uint64_t func_start;
+  const Fde* fde;
+  // The lsda isn't in .gcc_except_table, or uses unknown encodings or
+  // bases.
+  bool unsupported;
+  uint32_t call_sites;
+  uint32_t landing_pads;
+  // Distinct types caught, catch (...) included.
+  uint32_t catch_clauses;
+  // Call sites whose landing pad only runs cleanups.
+  uint32_t cleanup_sites;
+  uint32_t lsda_bytes;
+  uint32_t cfi_bytes;
+  // Lsda bytes decoded by a personality call, averaged over call sites.
+  uint32_t scan_bytes;
+  // Bytes decoded for a throw passing the function, in both phases.
+  uint64_t cost;
+};
+
+// Action chains are short, a longer one is a loop in a broken lsda.
+static constexpr int MAX_ACTION_CHAIN = 256;
+
+// Read the call sites of an lsda and their action chains.
+struct CallSiteScan {
+  const LSDA_Header* header;
+  const uint8_t* lsda;
+  const uint8_t* end;
+  int address_size;
+  LsdaCost* cost;
+
+  template <int CALL_SITE_ENCODING, int TYPE_ENCODING>
+  bool Visit();
+};
+
+template <int CALL_SITE_ENCODING, int TYPE_ENCODING>
+bool CallSiteScan::Visit() {
+  size_t type_size = GetEncodedSize(header->lsda_type_encoding, address_size);
+  size_t header_bytes = header->call_site_start - lsda;
+  const uint8_t* lsda_end = header->action_table;
+  std::vector<uint64_t> landing_pads;
+  std::vector<int64_t> catch_types;
+  uint64_t scan_bytes = 0;
+  for (const uint8_t* p = header->call_site_start; p < header->call_site_end;) {
+    LSDA_Call_Site cs;
+    if (!cs.Read<CALL_SITE_ENCODING>(p, *header, address_size)) {
+      return false;
+    }
+    cost->call_sites++;
+    // The personality routine decodes all call sites before the one matched.
+    uint64_t site_scan_bytes = header_bytes + (p - header->call_site_start);
+    if (cs.cs_lp != 0) {
+      landing_pads.push_back(cs.cs_lp);
+    }
+    bool has_catch = false;
+    if (cs.cs_action != 0) {
+      const uint8_t* action = header->action_table + (cs.cs_action - 1);
+      for (int i = 0; i < MAX_ACTION_CHAIN && action < end; ++i) {
+        const uint8_t* record = action;
+        int64_t type_filter = ReadSleb128(action);
+        const uint8_t* next_field = action;
+        int64_t next = ReadSleb128(action);
+        site_scan_bytes += action - record;
+        lsda_end = std::max(lsda_end, action);
+        if (type_filter > 0) {
+          has_catch = true;
+          catch_types.push_back(type_filter);
+          // Each catch clause tried reads its type from the type table.
+          site_scan_bytes += type_size;
+        }
+        if (next == 0) {
+          break;
+        }
+        action = next_field + next;
+      }
+    }
+    if (cs.cs_lp != 0 && !has_catch) {
+      cost->cleanup_sites++;
+    }
+    scan_bytes += site_scan_bytes;
+  }
+  if (header->type_table != nullptr) {
+    lsda_end = std::max(lsda_end, header->type_table);
+  }
+  std::sort(landing_pads.begin(), landing_pads.end());
+  cost->landing_pads = std::unique(landing_pads.begin(), landing_pads.end()) -
+                       landing_pads.begin();
+  std::sort(catch_types.begin(), catch_types.end());
+  cost->catch_clauses = std::unique(catch_types.begin(), catch_types.end()) -
+                        catch_types.begin();
+  cost->lsda_bytes = std::min(lsda_end, end) - lsda;
+  cost->scan_bytes = (cost->call_sites != 0) ? scan_bytes / cost->call_sites : header_bytes;
+  cost->cost = 2 * (static_cast<uint64_t>(cost->scan_bytes) + cost->cfi_bytes);
+  return true;
+}
+
+// section is followed by zero padding, so a value running over its end
+// stops in the padding.
+static constexpr size_t SECTION_PADDING = 64;
+
+static void AnalyzeLsda(const uint8_t* section, size_t section_size, uint64_t section_vaddr,
+                        LsdaCost* cost) {
+  const Fde* fde = cost->fde;
+  cost->cfi_bytes = fde->insts.size() + fde->cie->insts.size();
+  cost->unsupported = true;
+  const uint8_t* end = section + section_size;
+  if (fde->lsda < section_vaddr || fde->lsda - section_vaddr >= section_size) {
+    return;
+  }
+  const uint8_t* lsda = section + (fde->lsda - section_vaddr);
+  // Type table entries aren't dereferenced, only counted.
+  LsdaBase base;
+  base.vaddr_bias = section_vaddr - reinterpret_cast<uintptr_t>(section);
+  base.func_start = fde->func_start;
+  base.address_size = fde->cie->address_size;
+  base.dereference = false;
+  const uint8_t* p = lsda;
+  LSDA_Header header(p, base);
+  if (!header.valid || header.call_site_end > end) {
+    return;
+  }
+  CallSiteScan scan;
+  scan.header = &header;
+  scan.lsda = lsda;
+  scan.end = end;
+  scan.address_size = base.address_size;
+  scan.cost = cost;
+  cost->unsupported = !VisitLsdaEncodings(header, scan);
+}
+
+static bool AnalyzeLsdas(ElfReader* reader, int jobs, std::vector<LsdaCost>* costs) {
+  if (!reader->ReadEhFrame()) {
+    return false;
+  }
+  std::vector<char> section;
+  uint64_t section_vaddr;
+  if (!reader->ReadSectionData(".gcc_except_table", &section, &section_vaddr)) {
+    return false;
+  }
+  size_t section_size = section.size();
+  section.resize(section_size + SECTION_PADDING, 0);
+  for (auto& pair : reader->GetFdes()) {
+    const Fde* fde = pair.second;
+    if (fde->lsda != 0 && fde->cie->has_eh_info) {
+      LsdaCost cost;
+      memset(&cost, 0, sizeof(cost));
+      cost.func_start = fde->func_start;
+      cost.fde = fde;
+      costs->push_back(cost);
+    }
+  }
+  std::atomic<size_t> next(0);
+  static constexpr size_t BATCH = 1024;
+  auto work = [&]() {
+    size_t start;
+    while ((start = next.fetch_add(BATCH)) < costs->size()) {
+      size_t stop = std::min(start + BATCH, costs->size());
+      for (size_t i = start; i < stop; ++i) {
+        AnalyzeLsda(reinterpret_cast<const uint8_t*>(section.data()), section_size,
+                    section_vaddr, &(*costs)[i]);
+      }
+    }
+  };
+  std::vector<std::thread> workers;
+  for (int i = 1; i < jobs && static_cast<size_t>(i) * BATCH < costs->size(); ++i) {
+    workers.emplace_back(work);
+  }
+  work();
+  for (auto& worker : workers) {
+    worker.join();
+  }
+  return true;
+}
+
+static std::string GetFunctionName(const std::vector<ElfSymbol>& symbols, uint64_t vaddr) {
+  auto it = std::upper_bound(symbols.begin(), symbols.end(), vaddr,
+                             [](uint64_t vaddr, const ElfSymbol& symbol) {
+    return vaddr < symbol.vaddr;
+  });
+  if (it != symbols.begin() && (--it)->vaddr == vaddr) {
+    int status;
+    char* demangled = abi::__cxa_demangle(it->name.c_str(), nullptr, nullptr, &status);
+    std::string name = (demangled != nullptr) ? demangled : it->name;
+    free(demangled);
+    return name;
+  }
+  char buf[32];
+  snprintf(buf, sizeof(buf), "0x%" PRIx64, vaddr);
+  return buf;
+}
+
+static void PrintTop(const char* title, std::vector<const LsdaCost*>* costs, size_t count,
+                     bool (*compare)(const LsdaCost*, const LsdaCost*),
+                     const std::vector<ElfSymbol>& symbols) {
+  count = std::min(count, costs->size());
+  std::partial_sort(costs->begin(), costs->begin() + count, costs->end(), compare);
+  printf("\n%s:\n", title);
+  printf("%10s %6s %6s %7s %8s %6s %6s %8s  %s\n", "lsda_bytes", "sites", "pads", "catches",
+         "cleanups", "cfi", "scan", "cost", "function");
+  for (size_t i = 0; i < count; ++i) {
+    const LsdaCost* c = (*costs)[i];
+    printf("%10u %6u %6u %7u %8u %6u %6u %8" PRIu64 "  %s\n", c->lsda_bytes, c->call_sites,
+           c->landing_pads, c->catch_clauses, c->cleanup_sites, c->cfi_bytes, c->scan_bytes,
+           c->cost, GetFunctionName(symbols, c->func_start).c_str());
+  }
+}
+
+int main(int argc, char** argv) {
+  if (argc < 2) {
+    fprintf(stderr, "usage: lsda_cost <elf_file> [jobs [count]]\n");
+    exit(1);
+  }
+  int jobs = (argc > 2) ? atoi(argv[2]) : std::max(1u, std::thread::hardware_concurrency());
+  size_t count = (argc > 3) ? strtoul(argv[3], nullptr, 0) : 20;
+  std::unique_ptr<ElfReader> reader = ElfReader::OpenFile(argv[1], 0);
+  if (reader == nullptr) {
+    return 1;
+  }
+  std::vector<LsdaCost> costs;
+  if (!AnalyzeLsdas(reader.get(), jobs, &costs)) {
+    fprintf(stderr, "failed to read exception tables of %s\n", argv[1]);
+    return 1;
+  }
+  std::vector<ElfSymbol> symbols;
+  reader->ReadSymbols(&symbols);
+  uint64_t call_sites = 0;
+  uint64_t landing_pads = 0;
+  uint64_t lsda_bytes = 0;
+  size_t unsupported = 0;
+  std::vector<const LsdaCost*> ranked;
+  for (auto& cost : costs) {
+    if (cost.unsupported) {
+      unsupported++;
+      continue;
+    }
+    call_sites += cost.call_sites;
+    landing_pads += cost.landing_pads;
+    lsda_bytes += cost.lsda_bytes;
+    ranked.push_back(&cost);
+  }
+  printf("%s: %zu functions with lsdas, %" PRIu64 " call sites, %" PRIu64 " landing pads, %"
+         PRIu64 " lsda bytes, %zu lsdas not read\n", argv[1], costs.size(), call_sites,
+         landing_pads, lsda_bytes, unsupported);
+  PrintTop("largest lsdas", &ranked, count, [](const LsdaCost* a, const LsdaCost* b) {
+    return a->lsda_bytes > b->lsda_bytes;
+  }, symbols);
+  PrintTop("most expensive to throw through", &ranked, count,
+           [](const LsdaCost* a, const LsdaCost* b) {
+    return a->cost > b->cost;
+  }, symbols);
+  return 0;
+}
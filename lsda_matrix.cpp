@@ -0,0 +1,102 @@
+// LSDA decoding matrix, see test_lsda_matrix in the Makefile. Throws through
+// several lsdas print which catch clause runs, and which cleanups. The
+// runtime of cxxabi.cpp doesn't pass caught objects, so clauses don't bind.
+
+#include <stdio.h>
+#include <string.h>
+
+#include <unwind.h>
+
+struct Obj {
+  explicit Obj(const char* name) : name(name) {
+  }
+  ~Obj() {
+    printf("  ~%s\n", name);
+  }
+  const char* name;
+};
+
+struct Err {};
+
+__attribute__((noinline)) void ThrowInt() {
+  Obj o("thrower");
+  throw 1;
+}
+
+__attribute__((noinline)) void ThrowErr() {
+  throw Err();
+}
+
+__attribute__((noinline)) void ThrowChar() {
+  throw 'c';
+}
+
+// An exception of another runtime, only caught by catch (...).
+static _Unwind_Exception foreign_exception;
+
+static void DeleteForeign(_Unwind_Reason_Code, _Unwind_Exception*) {
+}
+
+__attribute__((noinline)) void ThrowForeign() {
+  memset(&foreign_exception, 0, sizeof(foreign_exception));
+  memcpy(&foreign_exception.exception_class, "FOREIGN", 8);
+  foreign_exception.exception_cleanup = DeleteForeign;
+  _Unwind_RaiseException(&foreign_exception);
+  printf("  foreign exception not caught\n");
+}
+
+__attribute__((noinline)) void Cleanup(void (*f)()) {
+  Obj o("cleanup");
+  f();
+}
+
+__attribute__((noinline)) int CatchOrder1(void (*f)()) {
+  try {
+    Obj o("order1");
+    Cleanup(f);
+  } catch (double) {
+    return 1;
+  } catch (Err&) {
+    return 2;
+  } catch (int) {
+    return 3;
+  } catch (...) {
+    return 4;
+  }
+  return 0;
+}
+
+__attribute__((noinline)) int CatchOrder2(void (*f)()) {
+  Obj o("order2");
+  try {
+    Cleanup(f);
+  } catch (int) {
+    return 5;
+  } catch (long) {
+    return 6;
+  }
+  return 0;
+}
+
+__attribute__((noinline)) int Outer(void (*f)()) {
+  try {
+    Obj o("outer");
+    return CatchOrder2(f);
+  } catch (Err&) {
+    return 7;
+  } catch (...) {
+    return 8;
+  }
+}
+
+int main() {
+  printf("%d\n", CatchOrder1(ThrowInt));
+  printf("%d\n", CatchOrder1(ThrowErr));
+  printf("%d\n", CatchOrder1(ThrowChar));
+  printf("%d\n", Outer(ThrowInt));
+  printf("%d\n", Outer(ThrowErr));
+  printf("%d\n", Outer(ThrowChar));
+  printf("%d\n", CatchOrder1(ThrowForeign));
+  printf("%d\n", Outer(ThrowForeign));
+  return 0;
+}
@@ -0,0 +1,77 @@
+; LSDA decoding matrix, see test_lsda_matrix in the Makefile. Landing pads
+; as clang emits them, compiled with llc.
+@_ZTIi = external constant i8*
+@_ZTId = external constant i8*
+@_ZTIc = external constant i8*
+@.cleanup = private constant [13 x i8] c"  ll cleanup\00"
+
+declare i8* @__cxa_allocate_exception(i64)
+declare void @__cxa_throw(i8*, i8*, i8*)
+declare i32 @__gxx_personality_v0(...)
+declare void @__cxa_begin_catch(i8*)
+declare void @__cxa_end_catch()
+declare i32 @llvm.eh.typeid.for(i8*)
+declare void @_Unwind_Resume(i8*)
+declare i32 @puts(i8*)
+
+define void @ll_throw_int() noinline {
+  %p = call i8* @__cxa_allocate_exception(i64 4)
+  %q = bitcast i8* %p to i32*
+  store i32 1, i32* %q
+  call void @__cxa_throw(i8* %p, i8* bitcast (i8** @_ZTIi to i8*), i8* null)
+  unreachable
+}
+
+define void @ll_throw_char() noinline {
+  %p = call i8* @__cxa_allocate_exception(i64 1)
+  store i8 99, i8* %p
+  call void @__cxa_throw(i8* %p, i8* bitcast (i8** @_ZTIc to i8*), i8* null)
+  unreachable
+}
+
+; Runs a cleanup, then resumes.
+define void @ll_cleanup(void ()* %f) noinline personality i32 (...)* @__gxx_personality_v0 {
+entry:
+  invoke void %f() to label %ok unwind label %lpad
+ok:
+  ret void
+lpad:
+  %lp = landingpad { i8*, i32 } cleanup
+  %s = getelementptr [13 x i8], [13 x i8]* @.cleanup, i64 0, i64 0
+  call i32 @puts(i8* %s)
+  resume { i8*, i32 } %lp
+}
+
+; catch (double) 1, catch (int) 2, catch (...) 3.
+define i32 @ll_catch(void ()* %f) noinline personality i32 (...)* @__gxx_personality_v0 {
+entry:
+  invoke void @ll_cleanup(void ()* %f) to label %ok unwind label %lpad
+ok:
+  ret i32 0
+lpad:
+  %lp = landingpad { i8*, i32 }
+          catch i8* bitcast (i8** @_ZTId to i8*)
+          catch i8* bitcast (i8** @_ZTIi to i8*)
+          catch i8* null
+  %e = extractvalue { i8*, i32 } %lp, 0
+  %sel = extractvalue { i8*, i32 } %lp, 1
+  %d = call i32 @llvm.eh.typeid.for(i8* bitcast (i8** @_ZTId to i8*))
+  %is_d = icmp eq i32 %sel, %d
+  br i1 %is_d, label %caught_d, label %next
+next:
+  %i = call i32 @llvm.eh.typeid.for(i8* bitcast (i8** @_ZTIi to i8*))
+  %is_i = icmp eq i32 %sel, %i
+  br i1 %is_i, label %caught_i, label %caught_all
+caught_d:
+  call void @__cxa_begin_catch(i8* %e)
+  call void @__cxa_end_catch()
+  ret i32 1
+caught_i:
+  call void @__cxa_begin_catch(i8* %e)
+  call void @__cxa_end_catch()
+  ret i32 2
+caught_all:
+  call void @__cxa_begin_catch(i8* %e)
+  call void @__cxa_end_catch()
+  ret i32 3
+}
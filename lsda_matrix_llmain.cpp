@@ -0,0 +1,37 @@
+// LSDA decoding matrix, see test_lsda_matrix in the Makefile. Throws through
+// landing pads of llc (lsda_matrix_ll.ll) and gcc frames.
+
+#include <stdio.h>
+
+extern "C" void ll_throw_int();
+extern "C" void ll_throw_char();
+extern "C" int ll_catch(void (*f)());
+
+struct Obj {
+  ~Obj() {
+    printf("  ~gcc\n");
+  }
+};
+
+__attribute__((noinline)) void GccThrowDouble() {
+  Obj o;
+  throw 1.0;
+}
+
+// A gcc frame catching a throw through llc frames.
+__attribute__((noinline)) int GccCatch() {
+  try {
+    ll_throw_char();
+  } catch (char) {
+    return 4;
+  }
+  return 0;
+}
+
+int main() {
+  printf("%d\n", ll_catch(ll_throw_int));
+  printf("%d\n", ll_catch(ll_throw_char));
+  printf("%d\n", ll_catch(GccThrowDouble));
+  printf("%d\n", GccCatch());
+  return 0;
+}
@@ -0,0 +1,38 @@
+# Rewrite the lsdas of gcc assembly to sdata4 call sites and a pcrel LPStart,
+# encodings neither gcc nor clang emit, to exercise the generic decoding of
+# lsda.h. See test_lsda_matrix in the Makefile.
+# Usage: lsda_recode.py <in.s> <out.s>
+import re, sys
+lines = open(sys.argv[1]).read().split('\n')
+out = []
+i = 0
+while i < len(lines):
+    l = lines[i]
+    m = re.match(r'^\.LLSDA(\d+):$', l)
+    if m:
+        n = m.group(1)
+        out.append(l)
+        assert lines[i + 1].strip() == '.byte\t0xff'
+        out.append('\t.byte\t0x1b')
+        out.append('\t.long\t.LFB%s-.' % n)
+        i += 2
+        continue
+    m = re.match(r'^\.LLSDACSB(C?\d+):$', l)
+    if m:
+        # The call site format byte precedes the call site table length.
+        assert out[-2].strip() == '.byte\t0x1', out[-2]
+        out[-2] = '\t.byte\t0xb'
+        out.append(l)
+        i += 1
+        k = 0
+        while not lines[i].startswith('.LLSDACSE'):
+            f = lines[i]
+            if k % 4 != 3:
+                f = f.replace('.uleb128', '.long')
+            out.append(f)
+            k += 1
+            i += 1
+        continue
+    out.append(l)
+    i += 1
+open(sys.argv[2], 'w').write('\n'.join(out))
@@ -2,11 +2,12 @@
 
 #include <inttypes.h>
 #include <string.h>
+#include <time.h>
 
+#include <algorithm>
+#include <mutex>
 #include <vector>
 
-#define DEBUG_MAP
-
 #if defined(DEBUG_MAP)
 #define D(format, ...) \
     printf(format, ##__VA_ARGS__)
@@ -41,10 +42,12 @@ class LineReader {
   size_t bufsize_;
 };
 
-bool GetThreadMmapsInProcess(std::map<uint64_t, Map>* maps) {
-  FILE* fp = fopen("/proc/self/maps", "re");
+bool GetThreadMmapsInProcess(pid_t pid, std::map<uint64_t, Map>* maps,
+                             std::vector<std::pair<uint64_t, uint64_t>>* readable_ranges) {
+  std::string path = (pid == 0) ? "/proc/self/maps" : "/proc/" + std::to_string(pid) + "/maps";
+  FILE* fp = fopen(path.c_str(), "re");
   if (fp == nullptr) {
-    fprintf(stderr, "can't open /proc/self/maps");
+    fprintf(stderr, "can't open %s\n", path.c_str());
     return false;
   }
   LineReader reader(fp);
@@ -59,6 +62,13 @@ bool GetThreadMmapsInProcess(std::map<uint64_t, Map>* maps) {
                &end_addr, type, &pgoff, execname) < 4) {
       continue;
     }
+    if (type[0] == 'r') {
+      if (!readable_ranges->empty() && readable_ranges->back().second == start_addr) {
+        readable_ranges->back().second = end_addr;
+      } else {
+        readable_ranges->emplace_back(start_addr, end_addr);
+      }
+    }
     if (type[2] != 'x') {
       continue;
     }
@@ -76,12 +86,234 @@ bool GetThreadMmapsInProcess(std::map<uint64_t, Map>* maps) {
   return true;
 }
 
-// Read /proc/self/maps to update maps.
-bool MapTree::UpdateMaps() {
+static uint64_t GetMonotonicTimeInNs() {
+  timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static std::atomic<uint64_t> next_map_tree_id(1);
+
+MapTree::MapTree() : id_(next_map_tree_id++), read_time_ns_(0) {
+}
+
+// Read /proc/<pid>/maps to update maps.
+bool MapTree::UpdateMaps(pid_t pid) {
   std::map<uint64_t, Map> maps;
-  if (!GetThreadMmapsInProcess(&maps)) {
+  std::vector<std::pair<uint64_t, uint64_t>> readable_ranges;
+  read_time_ns_ = GetMonotonicTimeInNs();
+  if (!GetThreadMmapsInProcess(pid, &maps, &readable_ranges)) {
     return false;
   }
   map_table_ = std::move(maps);
+  readable_ranges_ = std::move(readable_ranges);
+  return true;
+}
+
+void MapTree::AddMap(uint64_t start, uint64_t end, const std::string& dso) {
+  Map& map = map_table_[start];
+  map.start = start;
+  map.end = end;
+  map.dso = dso;
+  map.dso_reader = nullptr;
+}
+
+bool MapTree::GetReadableRange(uint64_t addr, uint64_t* start, uint64_t* end) const {
+  auto it = std::upper_bound(readable_ranges_.begin(), readable_ranges_.end(),
+                             std::make_pair(addr, UINT64_MAX));
+  if (it == readable_ranges_.begin() || (--it)->second <= addr) {
+    return false;
+  }
+  *start = it->first;
+  *end = it->second;
+  return true;
+}
+
+void MapTree::LoadUnwindSections() {
+  for (auto& pair : map_table_) {
+    Map& map = pair.second;
+    if (map.dso_reader != nullptr || map.dso[0] == '[') {
+      continue;
+    }
+    ElfReader* reader = ElfReaderManager::OpenElf(map.dso);
+    if (reader != nullptr && reader->ReadUnwindSection()) {
+      map.dso_reader = reader;
+    }
+  }
+}
+
+// Process MapTrees are freed by epochs. A ProcessMapsGuard counts itself in
+// the epoch it starts in. A MapTree replaced in epoch e may be used by guards
+// of epochs up to e, and the epoch only moves from e + 1 to e + 2 once no
+// guard of epoch e is left, so the MapTree is freed in epoch e + 2. Counts
+// are kept by epoch parity, as guards of two epochs at most are alive. Each
+// parity count is split into stripes picked by the stack address, so
+// threads stepping at once rarely write the same cache line.
+static std::atomic<MapTree*> process_maps(nullptr);
+static std::mutex& process_maps_mutex = *new std::mutex;
+static std::atomic<uint64_t> process_maps_epoch(0);
+
+static constexpr size_t MAPS_GUARD_STRIPES = 32;
+
+struct alignas(64) MapsGuardStripe {
+  std::atomic<uint32_t> counts[2];
+};
+
+static MapsGuardStripe maps_guard_stripes[MAPS_GUARD_STRIPES];
+
+static uint32_t GetMapsGuardCount(uint64_t epoch) {
+  uint32_t count = 0;
+  for (auto& stripe : maps_guard_stripes) {
+    count += stripe.counts[epoch & 1].load();
+  }
+  return count;
+}
+
+struct RetiredMapTree {
+  MapTree* maps;
+  uint64_t epoch;
+};
+
+// Replaced MapTrees not freed yet, guarded by process_maps_mutex.
+static std::vector<RetiredMapTree>& retired_map_trees = *new std::vector<RetiredMapTree>;
+
+ProcessMapsGuard::ProcessMapsGuard() {
+  // Thread stacks are far more than 1M apart.
+  uintptr_t sp = reinterpret_cast<uintptr_t>(&epoch_);
+  std::atomic<uint32_t>* counts = maps_guard_stripes[(sp >> 20) % MAPS_GUARD_STRIPES].counts;
+  while (true) {
+    epoch_ = process_maps_epoch.load();
+    count_ = &counts[epoch_ & 1];
+    ++*count_;
+    // If the epoch moved on, the count may have been checked already.
+    if (process_maps_epoch.load() == epoch_) {
+      break;
+    }
+    --*count_;
+  }
+}
+
+ProcessMapsGuard::~ProcessMapsGuard() {
+  --*count_;
+}
+
+MapTree* MapTree::GetProcessMaps() {
+  MapTree* maps = process_maps.load(std::memory_order_acquire);
+  if (maps == nullptr) {
+    maps = RefreshProcessMaps(nullptr);
+  }
+  return maps;
+}
+
+// Called with process_maps_mutex held.
+void MapTree::PublishProcessMaps(MapTree* maps) {
+  MapTree* old_maps = process_maps.load();
+  if (old_maps != nullptr) {
+    for (auto& pair : maps->map_table_) {
+      Map& map = pair.second;
+      Map* old_map = old_maps->GetMapForIp(map.start);
+      if (old_map != nullptr && old_map->start == map.start && old_map->end == map.end &&
+          old_map->dso == map.dso) {
+        map.dso_reader = old_map->dso_reader.load();
+      }
+    }
+  }
+  process_maps.store(maps);
+  if (old_maps != nullptr) {
+    retired_map_trees.push_back(RetiredMapTree{old_maps, process_maps_epoch.load()});
+  }
+  // Move on by up to two epochs, which frees everything retired when no
+  // guard is alive.
+  for (int i = 0; i < 2; ++i) {
+    uint64_t epoch = process_maps_epoch.load();
+    if (GetMapsGuardCount(epoch + 1) != 0) {
+      break;
+    }
+    process_maps_epoch.store(epoch + 1);
+  }
+  uint64_t epoch = process_maps_epoch.load();
+  size_t kept = 0;
+  for (auto& retired : retired_map_trees) {
+    if (retired.epoch + 2 <= epoch) {
+      delete retired.maps;
+    } else {
+      retired_map_trees[kept++] = retired;
+    }
+  }
+  retired_map_trees.resize(kept);
+}
+
+MapTree* MapTree::RefreshProcessMaps(MapTree* old_maps) {
+  std::lock_guard<std::mutex> lock(process_maps_mutex);
+  MapTree* maps = process_maps.load(std::memory_order_acquire);
+  if (maps != old_maps) {
+    return maps;
+  }
+  std::unique_ptr<MapTree> new_maps(new MapTree);
+  new_maps->UpdateMaps();
+  if (maps != nullptr && maps->HasSameMaps(*new_maps)) {
+    // Nothing changed, keep the current maps and their cached lookups.
+    maps->read_time_ns_ = new_maps->read_time_ns_;
+    return maps;
+  }
+  maps = new_maps.release();
+  PublishProcessMaps(maps);
+  return maps;
+}
+
+MapTree* MapTree::RefreshProcessMapsForIp(MapTree* old_maps, uint64_t ip) {
+  return RefreshProcessMapsForAddr(old_maps, ip, false);
+}
+
+MapTree* MapTree::RefreshProcessMapsForStack(MapTree* old_maps, uint64_t sp) {
+  return RefreshProcessMapsForAddr(old_maps, sp, true);
+}
+
+bool MapTree::HasAddr(uint64_t addr, bool readable) {
+  uint64_t start;
+  uint64_t end;
+  return readable ? GetReadableRange(addr, &start, &end) : GetMapForIp(addr) != nullptr;
+}
+
+MapTree* MapTree::RefreshProcessMapsForAddr(MapTree* old_maps, uint64_t addr, bool readable) {
+  std::lock_guard<std::mutex> lock(process_maps_mutex);
+  MapTree* maps = process_maps.load(std::memory_order_acquire);
+  if (maps != old_maps && maps->HasAddr(addr, readable)) {
+    return maps;
+  }
+  uint64_t page = addr & ~static_cast<uint64_t>(4095);
+  auto& unmapped = maps->unmapped_pages_;
+  if (std::find(unmapped.begin(), unmapped.end(), page) != unmapped.end() ||
+      GetMonotonicTimeInNs() - maps->read_time_ns_ < MISS_REFRESH_INTERVAL_NS) {
+    return maps;
+  }
+  std::unique_ptr<MapTree> new_maps(new MapTree);
+  new_maps->UpdateMaps();
+  if (!new_maps->HasAddr(addr, readable) && maps->HasSameMaps(*new_maps)) {
+    // Nothing changed, keep the current maps and their cached lookups.
+    maps->read_time_ns_ = new_maps->read_time_ns_;
+    if (unmapped.size() == MAX_UNMAPPED_PAGES) {
+      unmapped.erase(unmapped.begin());
+    }
+    unmapped.push_back(page);
+    return maps;
+  }
+  maps = new_maps.release();
+  PublishProcessMaps(maps);
+  return maps;
+}
+
+bool MapTree::HasSameMaps(const MapTree& other) const {
+  if (map_table_.size() != other.map_table_.size() ||
+      readable_ranges_ != other.readable_ranges_) {
+    return false;
+  }
+  for (auto it = map_table_.begin(), other_it = other.map_table_.begin();
+       it != map_table_.end(); ++it, ++other_it) {
+    if (it->second.start != other_it->second.start || it->second.end != other_it->second.end ||
+        it->second.dso != other_it->second.dso) {
+      return false;
+    }
+  }
   return true;
 }
@@ -3,9 +3,12 @@
 
 #include <sys/types.h>
 
+#include <atomic>
 #include <map>
 #include <memory>
 #include <string>
+#include <utility>
+#include <vector>
 
 #include "elf_reader.h"
 
@@ -13,14 +16,62 @@ struct Map {
   uint64_t start;
   uint64_t end;
   std::string dso;
-  ElfReader* dso_reader;
+  // Set on first use, maybe by several threads at once.
+  std::atomic<ElfReader*> dso_reader;
+};
+
+// Keeps the MapTrees returned by GetProcessMaps() and RefreshProcessMaps()
+// from being freed while it lives. It only counts itself in the current epoch,
+// without locks or memory allocation, so it can be used in signal handlers.
+// Guards may be nested.
+class ProcessMapsGuard {
+ public:
+  ProcessMapsGuard();
+  ~ProcessMapsGuard();
+
+ private:
+  uint64_t epoch_;
+  std::atomic<uint32_t>* count_;
+
+  ProcessMapsGuard(const ProcessMapsGuard&) = delete;
+  void operator=(const ProcessMapsGuard&) = delete;
 };
 
 // Maps of current process, the maps are update regularly, like 0.3HZ.
 class MapTree {
  public:
+  MapTree();
+
+  // Return the maps of the current process shared by all threads. Reading
+  // them doesn't take a lock. The caller must hold a ProcessMapsGuard.
+  static MapTree* GetProcessMaps();
+  // Read the maps of the current process again (like after dlopen()), unless
+  // another thread has done it since old_maps was got. Dsos opened for the
+  // old maps are kept for the same maps in the new ones. If the maps haven't
+  // changed, old_maps is kept and returned. Old MapTrees are freed once no
+  // ProcessMapsGuard from before their replacement is alive.
+  static MapTree* RefreshProcessMaps(MapTree* old_maps);
+  // Like RefreshProcessMaps(), for an ip not mapped in old_maps. Unmapped ips
+  // (like jitted code or a corrupt stack) would otherwise read the maps at
+  // each lookup, so maps are read for misses at most once per
+  // MISS_REFRESH_INTERVAL_NS, and pages still unmapped after a read aren't
+  // tried again until the next one.
+  static MapTree* RefreshProcessMapsForIp(MapTree* old_maps, uint64_t ip);
+  // Like RefreshProcessMapsForIp(), for a stack address not in the readable
+  // ranges of old_maps, like the stack of a thread created after the maps
+  // were read.
+  static MapTree* RefreshProcessMapsForStack(MapTree* old_maps, uint64_t sp);
+
+  // Read maps of process pid, or of the current process if pid is 0.
+  bool UpdateMaps(pid_t pid = 0);
+
+  // Add an executable map, used to build maps of another process.
+  void AddMap(uint64_t start, uint64_t end, const std::string& dso);
+
+  // Open the dsos of all maps and read their unwind sections now, so
+  // unwinding in signal safe mode can go through them.
+  void LoadUnwindSections();
 
-  bool UpdateMaps();
   Map* GetMapForIp(uint64_t ip) {
     auto it = map_table_.upper_bound(ip);
     if (it != map_table_.begin()) {
@@ -32,8 +83,38 @@ class MapTree {
     return nullptr;
   }
 
+  const std::map<uint64_t, Map>& GetMaps() const {
+    return map_table_;
+  }
+
+  // Get the readable memory range holding addr, adjacent readable maps are
+  // merged. Only maps read by UpdateMaps() are known.
+  bool GetReadableRange(uint64_t addr, uint64_t* start, uint64_t* end) const;
+
+  // Unique for each MapTree, unlike its address, which may be reused after
+  // it is freed.
+  uint64_t GetId() const {
+    return id_;
+  }
+
  private:
+  static constexpr uint64_t MISS_REFRESH_INTERVAL_NS = 1000000;
+  static constexpr size_t MAX_UNMAPPED_PAGES = 64;
+
+  static MapTree* RefreshProcessMapsForAddr(MapTree* old_maps, uint64_t addr, bool readable);
+  static void PublishProcessMaps(MapTree* maps);
+  bool HasAddr(uint64_t addr, bool readable);
+  bool HasSameMaps(const MapTree& other) const;
+
+  uint64_t id_;
+  // When UpdateMaps() read the maps.
+  uint64_t read_time_ns_;
+  // Pages looked up by RefreshProcessMapsForAddr() and found unmapped when
+  // the maps were last read, guarded by the process maps lock.
+  std::vector<uint64_t> unmapped_pages_;
   std::map<uint64_t, Map> map_table_;
+  // Sorted [start, end) of readable maps.
+  std::vector<std::pair<uint64_t, uint64_t>> readable_ranges_;
 };
 
 #endif  // _UNWIND_MAP_H_
@@ -0,0 +1,14 @@
+#include "nonlocal_return.h"
+
+__thread ScopedCleanup* scoped_cleanup_head;
+
+void nonlocal_return(NonlocalTarget* target, int value) {
+  ScopedCleanup* cleanup;
+  while ((cleanup = scoped_cleanup_head) != target->cleanup_) {
+    // Unlinked before running, so a cleanup jumping to an outer target
+    // isn't run again.
+    scoped_cleanup_head = cleanup->outer_;
+    cleanup->fn_(cleanup->arg_);
+  }
+  longjmp(target->env, (value != 0) ? value : 1);
+}
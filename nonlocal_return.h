@@ -0,0 +1,87 @@
+#ifndef _NONLOCAL_RETURN_H_
+#define _NONLOCAL_RETURN_H_
+
+#include <setjmp.h>
+
+// Non-local exits that run destructors, without throwing. longjmp() skips
+// the destructors of the frames it jumps over (see t1_longjmp.cc), and a
+// throw walks the stack twice. Instead, objects needing cleanup register it
+// with a ScopedCleanup on a thread local list, and nonlocal_return() runs the
+// cleanups registered since its target was set, innermost first, then
+// longjmp()s to the target.
+//
+//   NonlocalTarget target;
+//   if (setjmp(target.env) == 0) {
+//     Parse(&target);  // may call nonlocal_return(&target, ERROR)
+//   } else {
+//     // objects registered in Parse() are destroyed.
+//   }
+//
+//   void Parse(NonlocalTarget* target) {
+//     std::string token;
+//     ScopedCleanup cleanup(RunDestructor<std::string>, &token);
+//     ...
+//   }
+//
+// Objects not registered are skipped like with longjmp(). A target is only
+// valid until the function calling setjmp() on it returns.
+
+class NonlocalTarget;
+
+// Call fn(arg) if the scope is left by nonlocal_return(). Returning from it
+// only unregisters fn, as destructors run then.
+class ScopedCleanup {
+ public:
+  ScopedCleanup(void (*fn)(void* arg), void* arg);
+  ~ScopedCleanup();
+
+ private:
+  friend void nonlocal_return(NonlocalTarget* target, int value);
+
+  // The cleanup registered before this one in the same thread.
+  ScopedCleanup* outer_;
+  void (*fn_)(void* arg);
+  void* arg_;
+
+  ScopedCleanup(const ScopedCleanup&) = delete;
+  void operator=(const ScopedCleanup&) = delete;
+};
+
+// Innermost cleanup of the thread, nullptr if there is none.
+extern __thread ScopedCleanup* scoped_cleanup_head;
+
+inline ScopedCleanup::ScopedCleanup(void (*fn)(void* arg), void* arg)
+    : outer_(scoped_cleanup_head), fn_(fn), arg_(arg) {
+  scoped_cleanup_head = this;
+}
+
+inline ScopedCleanup::~ScopedCleanup() {
+  scoped_cleanup_head = outer_;
+}
+
+template <typename T>
+void RunDestructor(void* object) {
+  static_cast<T*>(object)->~T();
+}
+
+class NonlocalTarget {
+ public:
+  // Cleanups registered after the target is constructed are run when
+  // jumping to it, so setjmp() on env should follow without registering.
+  NonlocalTarget() : cleanup_(scoped_cleanup_head) {
+  }
+
+  jmp_buf env;
+
+ private:
+  friend void nonlocal_return(NonlocalTarget* target, int value);
+
+  ScopedCleanup* cleanup_;
+};
+
+// Run cleanups registered since target was constructed, innermost first,
+// and return from its setjmp() with value (1 if value is 0). A cleanup may
+// itself call nonlocal_return() to an outer target.
+void nonlocal_return(NonlocalTarget* target, int value) __attribute__((noreturn));
+
+#endif  // _NONLOCAL_RETURN_H_
@@ -0,0 +1,127 @@
+#include "prewarm.h"
+
+#include <stdio.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <map>
+#include <thread>
+#include <unordered_map>
+
+#include "elf_reader.h"
+#include "map.h"
+
+BackgroundLoader& BackgroundLoader::GetInstance() {
+  static BackgroundLoader& loader = *new BackgroundLoader;
+  return loader;
+}
+
+void BackgroundLoader::Queue(const std::string& dso, const std::vector<uint64_t>& hot_vaddrs) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  if (!queued_dsos_.insert(dso).second) {
+    return;
+  }
+  Task task;
+  task.dso = dso;
+  task.hot_vaddrs = hot_vaddrs;
+  queue_.push_back(std::move(task));
+  if (!thread_started_) {
+    thread_started_ = true;
+    std::thread(&BackgroundLoader::ThreadMain, this).detach();
+  }
+  cond_.notify_all();
+}
+
+void BackgroundLoader::Wait() {
+  std::unique_lock<std::mutex> lock(mutex_);
+  cond_.wait(lock, [this]() { return queue_.empty() && !busy_; });
+}
+
+void BackgroundLoader::ThreadMain() {
+  setpriority(PRIO_PROCESS, syscall(SYS_gettid), 19);
+  std::unique_lock<std::mutex> lock(mutex_);
+  while (true) {
+    cond_.wait(lock, [this]() { return !queue_.empty(); });
+    Task task = std::move(queue_.front());
+    queue_.pop_front();
+    busy_ = true;
+    lock.unlock();
+    ElfReader* reader = ElfReaderManager::OpenElf(task.dso);
+    if (reader != nullptr && reader->ReadUnwindSection()) {
+      for (auto vaddr : task.hot_vaddrs) {
+        reader->GetFdeForVaddrInFile(vaddr);
+      }
+    }
+    lock.lock();
+    busy_ = false;
+    cond_.notify_all();
+  }
+}
+
+struct ProfileEntry {
+  uint64_t count;
+  std::vector<uint64_t> hot_vaddrs;
+};
+
+static bool ReadProfile(const char* profile_file,
+                        std::unordered_map<std::string, ProfileEntry>* profile) {
+  FILE* fp = fopen(profile_file, "re");
+  if (fp == nullptr) {
+    fprintf(stderr, "can't open %s\n", profile_file);
+    return false;
+  }
+  char* line = nullptr;
+  size_t size = 0;
+  while (getline(&line, &size, fp) != -1) {
+    char dso[size];
+    uint64_t vaddr;
+    uint64_t count;
+    if (sscanf(line, "%s %" SCNx64 " %" SCNu64, dso, &vaddr, &count) != 3) {
+      continue;
+    }
+    ProfileEntry& entry = (*profile)[dso];
+    entry.count += count;
+    entry.hot_vaddrs.push_back(vaddr);
+  }
+  free(line);
+  fclose(fp);
+  return true;
+}
+
+bool Prewarm(const char* profile_file) {
+  std::unordered_map<std::string, ProfileEntry> profile;
+  if (profile_file != nullptr && !ReadProfile(profile_file, &profile)) {
+    return false;
+  }
+  MapTree map_tree;
+  if (!map_tree.UpdateMaps()) {
+    return false;
+  }
+  std::vector<std::string> dsos;
+  for (auto& pair : map_tree.GetMaps()) {
+    // Skip special maps like [vdso], which aren't files.
+    if (pair.second.dso[0] != '[') {
+      dsos.push_back(pair.second.dso);
+    }
+  }
+  // Hot dsos first, the others keep the order in the address space.
+  std::stable_sort(dsos.begin(), dsos.end(), [&](const std::string& a, const std::string& b) {
+    auto it_a = profile.find(a);
+    auto it_b = profile.find(b);
+    uint64_t count_a = (it_a == profile.end()) ? 0 : it_a->second.count;
+    uint64_t count_b = (it_b == profile.end()) ? 0 : it_b->second.count;
+    return count_a > count_b;
+  });
+  BackgroundLoader& loader = BackgroundLoader::GetInstance();
+  for (auto& dso : dsos) {
+    auto it = profile.find(dso);
+    if (it != profile.end()) {
+      loader.Queue(dso, it->second.hot_vaddrs);
+    } else {
+      loader.Queue(dso, std::vector<uint64_t>());
+    }
+  }
+  return true;
+}
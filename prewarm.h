@@ -0,0 +1,52 @@
+#ifndef _UNWIND_PREWARM_H_
+#define _UNWIND_PREWARM_H_
+
+#include <inttypes.h>
+
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <string>
+#include <unordered_set>
+#include <vector>
+
+// Reads unwind sections of dsos on a low priority background thread, so
+// unwinding through them later doesn't pay for parsing.
+class BackgroundLoader {
+ public:
+  static BackgroundLoader& GetInstance();
+
+  // Queue a dso to load. hot_vaddrs are vaddrs in file of functions whose
+  // Fdes should be looked up right after loading. A dso is only loaded once.
+  void Queue(const std::string& dso, const std::vector<uint64_t>& hot_vaddrs);
+
+  // Wait until all queued dsos are loaded.
+  void Wait();
+
+ private:
+  struct Task {
+    std::string dso;
+    std::vector<uint64_t> hot_vaddrs;
+  };
+
+  BackgroundLoader() : busy_(false), thread_started_(false) {
+  }
+
+  void ThreadMain();
+
+  std::mutex mutex_;
+  std::condition_variable cond_;
+  std::deque<Task> queue_;
+  std::unordered_set<std::string> queued_dsos_;
+  bool busy_;
+  bool thread_started_;
+};
+
+// Queue the unwind sections of all executable maps in the current process to
+// be loaded by the BackgroundLoader. If profile_file isn't null, it is a hot
+// pc profile from a previous run, with lines like "<dso> <hex vaddr_in_file>
+// <count>". Dsos are then loaded in order of their total count, and the Fdes
+// of the listed functions are looked up first.
+bool Prewarm(const char* profile_file);
+
+#endif  // _UNWIND_PREWARM_H_
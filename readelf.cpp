@@ -2,6 +2,7 @@
 #include <stdlib.h>
 
 #include "elf_reader.h"
+#include "insts_pool.h"
 
 bool ReadElf(const char* filename) {
   std::unique_ptr<ElfReader> reader = ElfReader::OpenFile(filename, -1);
@@ -12,14 +13,20 @@ bool ReadElf(const char* filename) {
 }
 
 int main(int argc, char** argv) {
-  if (argc != 2) {
+  if (argc < 2) {
     fprintf(stderr, "no filename\n");
     exit(1);
   }
-  const char* filename = argv[1];
-  if (!ReadElf(filename)) {
-    fprintf(stderr, "failed to read %s\n", filename);
-    return 1;
+  for (int i = 1; i < argc; ++i) {
+    const char* filename = argv[i];
+    if (!ReadElf(filename)) {
+      fprintf(stderr, "failed to read %s\n", filename);
+      return 1;
+    }
   }
+  InstsPool::Stats stats = InstsPool::GetInstance().GetStats();
+  printf("insts pool: interned %zu, shared %zu, requested %zu bytes, stored %zu bytes, "
+         "%zu bytes live\n", stats.intern_count, stats.hit_count, stats.requested_bytes,
+         stats.stored_bytes, stats.live_bytes);
   return 0;
 }
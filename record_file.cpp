@@ -0,0 +1,508 @@
+#include "record_file.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+
+// A stack block is written when its data reaches this size.
+static constexpr size_t STACK_BLOCK_SIZE = 64 * 1024;
+
+static void WriteULEB128(std::string* out, uint64_t value) {
+  do {
+    uint8_t byte = value & 0x7f;
+    value >>= 7;
+    if (value != 0) {
+      byte |= 0x80;
+    }
+    out->push_back(byte);
+  } while (value != 0);
+}
+
+static void WriteSLEB128(std::string* out, int64_t value) {
+  while (true) {
+    uint8_t byte = value & 0x7f;
+    value >>= 7;
+    if ((value == 0 && !(byte & 0x40)) || (value == -1 && (byte & 0x40))) {
+      out->push_back(byte);
+      break;
+    }
+    out->push_back(byte | 0x80);
+  }
+}
+
+// Reads numbers from a block, failing instead of reading past the end.
+class BlockDecoder {
+ public:
+  BlockDecoder(const char* data, size_t size) : p_(data), end_(data + size), failed_(false) {
+  }
+
+  uint64_t ReadULEB128() {
+    uint64_t value = 0;
+    for (int shift = 0; p_ < end_; shift += 7) {
+      uint8_t byte = *p_++;
+      if (shift < 64) {
+        value |= static_cast<uint64_t>(byte & 0x7f) << shift;
+      }
+      if (!(byte & 0x80)) {
+        return value;
+      }
+    }
+    failed_ = true;
+    return 0;
+  }
+
+  int64_t ReadSLEB128() {
+    uint64_t value = 0;
+    for (int shift = 0; p_ < end_; shift += 7) {
+      uint8_t byte = *p_++;
+      if (shift < 64) {
+        value |= static_cast<uint64_t>(byte & 0x7f) << shift;
+      }
+      if (!(byte & 0x80)) {
+        if ((byte & 0x40) && shift + 7 < 64) {
+          value |= ~static_cast<uint64_t>(0) << (shift + 7);
+        }
+        return static_cast<int64_t>(value);
+      }
+    }
+    failed_ = true;
+    return 0;
+  }
+
+  std::string ReadString() {
+    uint64_t size = ReadULEB128();
+    if (failed_ || size > static_cast<uint64_t>(end_ - p_)) {
+      failed_ = true;
+      return std::string();
+    }
+    std::string s(p_, size);
+    p_ += size;
+    return s;
+  }
+
+  bool Failed() const {
+    return failed_;
+  }
+
+ private:
+  const char* p_;
+  const char* end_;
+  bool failed_;
+};
+
+std::unique_ptr<RecordWriter> RecordWriter::Create(const char* filename,
+                                                   uint32_t samples_per_block) {
+  FILE* fp = fopen(filename, "wbe");
+  if (fp == nullptr) {
+    fprintf(stderr, "failed to open %s: %s\n", filename, strerror(errno));
+    return nullptr;
+  }
+  std::unique_ptr<RecordWriter> writer(new RecordWriter(fp, std::max(1u, samples_per_block)));
+  RecordFileHeader header;
+  memset(&header, 0, sizeof(header));
+  header.magic = RECORD_FILE_MAGIC;
+  header.version = RECORD_FILE_VERSION;
+  writer->Write(&header, sizeof(header));
+  return writer;
+}
+
+RecordWriter::~RecordWriter() {
+  if (fp_ != nullptr) {
+    Finish();
+  }
+}
+
+void RecordWriter::Write(const void* data, size_t size) {
+  if (!failed_ && fwrite(data, size, 1, fp_) != 1) {
+    failed_ = true;
+  }
+  offset_ += size;
+}
+
+void RecordWriter::WriteBlock(uint32_t type, uint32_t count, const std::string& data,
+                              RecordIndexEntry* entry) {
+  RecordBlockHeader header;
+  header.type = type;
+  header.codec = RECORD_CODEC_DELTA;
+  header.count = count;
+  header.size = data.size();
+  entry->offset = offset_;
+  entry->type = type;
+  entry->count = count;
+  Write(&header, sizeof(header));
+  Write(data.data(), data.size());
+  index_.push_back(*entry);
+}
+
+void RecordWriter::AddModule(const RecordModule& module) {
+  pending_modules_.push_back(module);
+}
+
+uint32_t RecordWriter::InternStack(const uint64_t* pcs, size_t count) {
+  std::string key(reinterpret_cast<const char*>(pcs), count * sizeof(uint64_t));
+  auto it = stack_ids_.emplace(std::move(key), stack_count_).first;
+  if (it->second != stack_count_) {
+    return it->second;
+  }
+  WriteULEB128(&pending_stacks_, count);
+  uint64_t prev = 0;
+  for (size_t i = 0; i < count; ++i) {
+    WriteSLEB128(&pending_stacks_, static_cast<int64_t>(pcs[i] - prev));
+    prev = pcs[i];
+  }
+  ++pending_stack_count_;
+  uint32_t id = stack_count_++;
+  if (pending_stacks_.size() >= STACK_BLOCK_SIZE) {
+    FlushStacks();
+  }
+  return id;
+}
+
+bool RecordWriter::AddSample(uint64_t time_ns, int pid, int tid, const uint64_t* pcs,
+                             size_t count) {
+  if (fp_ == nullptr) {
+    return false;
+  }
+  RecordSample sample;
+  sample.time_ns = time_ns;
+  sample.pid = pid;
+  sample.tid = tid;
+  sample.stack_id = InternStack(pcs, count);
+  pending_samples_.push_back(sample);
+  if (pending_samples_.size() >= samples_per_block_) {
+    FlushSamples();
+  }
+  return !failed_;
+}
+
+void RecordWriter::FlushModules() {
+  if (pending_modules_.empty()) {
+    return;
+  }
+  std::string data;
+  for (auto& module : pending_modules_) {
+    WriteSLEB128(&data, module.pid);
+    WriteULEB128(&data, module.start);
+    WriteULEB128(&data, module.end - module.start);
+    WriteULEB128(&data, module.min_vaddr);
+    WriteULEB128(&data, module.build_id.size());
+    data.append(module.build_id);
+    WriteULEB128(&data, module.name.size());
+    data.append(module.name);
+  }
+  RecordIndexEntry entry;
+  memset(&entry, 0, sizeof(entry));
+  WriteBlock(RECORD_MODULES, pending_modules_.size(), data, &entry);
+  pending_modules_.clear();
+}
+
+void RecordWriter::FlushStacks() {
+  if (pending_stack_count_ == 0) {
+    return;
+  }
+  RecordIndexEntry entry;
+  memset(&entry, 0, sizeof(entry));
+  entry.first = stack_count_ - pending_stack_count_;
+  WriteBlock(RECORD_STACKS, pending_stack_count_, pending_stacks_, &entry);
+  pending_stacks_.clear();
+  pending_stack_count_ = 0;
+}
+
+void RecordWriter::FlushSamples() {
+  // Samples can only refer to stacks written before them.
+  FlushModules();
+  FlushStacks();
+  if (pending_samples_.empty()) {
+    return;
+  }
+  // Samples are stored by columns, so each column is a run of small deltas.
+  std::string data;
+  RecordIndexEntry entry;
+  memset(&entry, 0, sizeof(entry));
+  entry.start_time = UINT64_MAX;
+  RecordSample prev;
+  memset(&prev, 0, sizeof(prev));
+  for (auto& sample : pending_samples_) {
+    WriteSLEB128(&data, static_cast<int64_t>(sample.time_ns - prev.time_ns));
+    prev.time_ns = sample.time_ns;
+    entry.start_time = std::min(entry.start_time, sample.time_ns);
+    entry.end_time = std::max(entry.end_time, sample.time_ns);
+  }
+  for (auto& sample : pending_samples_) {
+    WriteSLEB128(&data, static_cast<int64_t>(sample.pid) - prev.pid);
+    prev.pid = sample.pid;
+  }
+  for (auto& sample : pending_samples_) {
+    WriteSLEB128(&data, static_cast<int64_t>(sample.tid) - prev.tid);
+    prev.tid = sample.tid;
+  }
+  for (auto& sample : pending_samples_) {
+    WriteSLEB128(&data, static_cast<int64_t>(sample.stack_id) - prev.stack_id);
+    prev.stack_id = sample.stack_id;
+  }
+  std::vector<int32_t> tids;
+  for (auto& sample : pending_samples_) {
+    tids.push_back(sample.tid);
+  }
+  std::sort(tids.begin(), tids.end());
+  tids.erase(std::unique(tids.begin(), tids.end()), tids.end());
+  entry.first = tids_.size();
+  entry.tid_count = tids.size();
+  tids_.insert(tids_.end(), tids.begin(), tids.end());
+  WriteBlock(RECORD_SAMPLES, pending_samples_.size(), data, &entry);
+  sample_count_ += pending_samples_.size();
+  pending_samples_.clear();
+}
+
+bool RecordWriter::Finish() {
+  if (fp_ == nullptr) {
+    return false;
+  }
+  FlushSamples();
+  // Align the index, so the reader can use it in place.
+  static const char padding[8] = {};
+  Write(padding, (8 - offset_ % 8) % 8);
+  RecordFileFooter footer;
+  memset(&footer, 0, sizeof(footer));
+  footer.index_offset = offset_;
+  footer.block_count = index_.size();
+  footer.tid_count = tids_.size();
+  footer.sample_count = sample_count_;
+  footer.stack_count = stack_count_;
+  footer.magic = RECORD_FILE_MAGIC;
+  footer.version = RECORD_FILE_VERSION;
+  Write(index_.data(), index_.size() * sizeof(RecordIndexEntry));
+  Write(tids_.data(), tids_.size() * sizeof(int32_t));
+  Write(&footer, sizeof(footer));
+  bool result = !failed_;
+  if (fclose(fp_) != 0) {
+    result = false;
+  }
+  fp_ = nullptr;
+  if (!result) {
+    fprintf(stderr, "failed to write record file: %s\n", strerror(errno));
+  }
+  return result;
+}
+
+std::unique_ptr<RecordFile> RecordFile::Open(const char* filename) {
+  int fd = open(filename, O_RDONLY | O_CLOEXEC);
+  if (fd == -1) {
+    fprintf(stderr, "failed to open %s: %s\n", filename, strerror(errno));
+    return nullptr;
+  }
+  struct stat st;
+  if (fstat(fd, &st) != 0 ||
+      static_cast<size_t>(st.st_size) < sizeof(RecordFileHeader) + sizeof(RecordFileFooter)) {
+    fprintf(stderr, "%s isn't a record file\n", filename);
+    close(fd);
+    return nullptr;
+  }
+  void* addr = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (addr == MAP_FAILED) {
+    fprintf(stderr, "failed to map %s: %s\n", filename, strerror(errno));
+    return nullptr;
+  }
+  std::unique_ptr<RecordFile> file(new RecordFile);
+  file->addr_ = static_cast<const char*>(addr);
+  file->size_ = st.st_size;
+  if (!file->ReadIndex()) {
+    fprintf(stderr, "%s is an invalid record file\n", filename);
+    return nullptr;
+  }
+  return file;
+}
+
+RecordFile::~RecordFile() {
+  if (addr_ != nullptr) {
+    munmap(const_cast<char*>(addr_), size_);
+  }
+}
+
+bool RecordFile::ReadIndex() {
+  RecordFileHeader header;
+  memcpy(&header, addr_, sizeof(header));
+  memcpy(&footer_, addr_ + size_ - sizeof(footer_), sizeof(footer_));
+  if (header.magic != RECORD_FILE_MAGIC || header.version != RECORD_FILE_VERSION ||
+      footer_.magic != RECORD_FILE_MAGIC || footer_.version != RECORD_FILE_VERSION) {
+    return false;
+  }
+  uint64_t index_size = static_cast<uint64_t>(footer_.block_count) * sizeof(RecordIndexEntry) +
+      static_cast<uint64_t>(footer_.tid_count) * sizeof(int32_t);
+  // Compared by subtraction, as offsets and counts from the file can make
+  // sums wrap.
+  uint64_t index_end = size_ - sizeof(footer_);
+  if (footer_.index_offset % 8 != 0 || footer_.index_offset < sizeof(header) ||
+      footer_.index_offset > index_end || index_size != index_end - footer_.index_offset) {
+    return false;
+  }
+  index_ = reinterpret_cast<const RecordIndexEntry*>(addr_ + footer_.index_offset);
+  tids_ = reinterpret_cast<const int32_t*>(index_ + footer_.block_count);
+  uint64_t stack_count = 0;
+  for (uint32_t i = 0; i < footer_.block_count; ++i) {
+    const RecordIndexEntry& entry = index_[i];
+    if (entry.type == RECORD_MODULES) {
+      if (!ReadModules(entry)) {
+        return false;
+      }
+    } else if (entry.type == RECORD_STACKS) {
+      if (entry.first != stack_count) {
+        return false;
+      }
+      stack_count += entry.count;
+      stack_blocks_.push_back(i);
+    } else if (entry.type == RECORD_SAMPLES) {
+      if (entry.first > footer_.tid_count || entry.tid_count > footer_.tid_count - entry.first) {
+        return false;
+      }
+    }
+  }
+  return stack_count == footer_.stack_count;
+}
+
+const char* RecordFile::GetBlockData(const RecordIndexEntry& entry, uint32_t type) {
+  RecordBlockHeader header;
+  if (entry.offset < sizeof(RecordFileHeader) ||
+      entry.offset > footer_.index_offset - sizeof(header)) {
+    return nullptr;
+  }
+  memcpy(&header, addr_ + entry.offset, sizeof(header));
+  if (header.type != type || header.codec != RECORD_CODEC_DELTA || header.count != entry.count ||
+      header.size > footer_.index_offset - entry.offset - sizeof(header)) {
+    return nullptr;
+  }
+  ++decoded_blocks_;
+  return addr_ + entry.offset + sizeof(header);
+}
+
+static uint32_t GetBlockSize(const char* data) {
+  RecordBlockHeader header;
+  memcpy(&header, data - sizeof(header), sizeof(header));
+  return header.size;
+}
+
+bool RecordFile::ReadModules(const RecordIndexEntry& entry) {
+  const char* data = GetBlockData(entry, RECORD_MODULES);
+  if (data == nullptr) {
+    return false;
+  }
+  BlockDecoder decoder(data, GetBlockSize(data));
+  for (uint32_t i = 0; i < entry.count; ++i) {
+    RecordModule module;
+    module.pid = decoder.ReadSLEB128();
+    module.start = decoder.ReadULEB128();
+    module.end = module.start + decoder.ReadULEB128();
+    module.min_vaddr = decoder.ReadULEB128();
+    module.build_id = decoder.ReadString();
+    module.name = decoder.ReadString();
+    if (decoder.Failed()) {
+      return false;
+    }
+    modules_.push_back(std::move(module));
+  }
+  return true;
+}
+
+bool RecordFile::ReadSamples(uint64_t start_time, uint64_t end_time, int tid,
+                             const std::function<void(const RecordSample&)>& callback) {
+  std::vector<RecordSample> samples;
+  for (uint32_t i = 0; i < footer_.block_count; ++i) {
+    const RecordIndexEntry& entry = index_[i];
+    if (entry.type != RECORD_SAMPLES || entry.start_time > end_time ||
+        entry.end_time < start_time) {
+      continue;
+    }
+    if (tid != -1) {
+      const int32_t* tids = tids_ + entry.first;
+      if (!std::binary_search(tids, tids + entry.tid_count, tid)) {
+        continue;
+      }
+    }
+    const char* data = GetBlockData(entry, RECORD_SAMPLES);
+    if (data == nullptr) {
+      return false;
+    }
+    BlockDecoder decoder(data, GetBlockSize(data));
+    samples.resize(entry.count);
+    RecordSample prev;
+    memset(&prev, 0, sizeof(prev));
+    for (auto& sample : samples) {
+      sample.time_ns = prev.time_ns += decoder.ReadSLEB128();
+    }
+    for (auto& sample : samples) {
+      sample.pid = prev.pid += decoder.ReadSLEB128();
+    }
+    for (auto& sample : samples) {
+      sample.tid = prev.tid += decoder.ReadSLEB128();
+    }
+    for (auto& sample : samples) {
+      sample.stack_id = prev.stack_id += decoder.ReadSLEB128();
+    }
+    if (decoder.Failed()) {
+      return false;
+    }
+    for (auto& sample : samples) {
+      if (sample.time_ns >= start_time && sample.time_ns <= end_time &&
+          (tid == -1 || sample.tid == tid)) {
+        callback(sample);
+      }
+    }
+  }
+  return true;
+}
+
+bool RecordFile::DecodeStacks(const RecordIndexEntry& entry) {
+  const char* data = GetBlockData(entry, RECORD_STACKS);
+  if (data == nullptr) {
+    return false;
+  }
+  BlockDecoder decoder(data, GetBlockSize(data));
+  std::vector<uint32_t>& offsets = stack_offsets_[entry.first];
+  std::vector<uint64_t>& pcs = stack_pcs_[entry.first];
+  for (uint32_t i = 0; i < entry.count; ++i) {
+    uint64_t count = decoder.ReadULEB128();
+    if (count > GetBlockSize(data)) {
+      // Each pc takes at least one byte.
+      return false;
+    }
+    offsets.push_back(pcs.size());
+    uint64_t pc = 0;
+    for (uint64_t j = 0; j < count; ++j) {
+      pc += decoder.ReadSLEB128();
+      pcs.push_back(pc);
+    }
+  }
+  offsets.push_back(pcs.size());
+  return !decoder.Failed();
+}
+
+bool RecordFile::GetStack(uint32_t stack_id, std::vector<uint64_t>* pcs) {
+  if (stack_id >= footer_.stack_count) {
+    return false;
+  }
+  auto it = std::upper_bound(stack_blocks_.begin(), stack_blocks_.end(), stack_id,
+                             [this](uint32_t id, uint32_t block) {
+                               return id < index_[block].first;
+                             });
+  const RecordIndexEntry& entry = index_[*(it - 1)];
+  auto offsets_it = stack_offsets_.find(entry.first);
+  if (offsets_it == stack_offsets_.end()) {
+    if (!DecodeStacks(entry)) {
+      stack_offsets_.erase(entry.first);
+      stack_pcs_.erase(entry.first);
+      return false;
+    }
+    offsets_it = stack_offsets_.find(entry.first);
+  }
+  const std::vector<uint64_t>& block_pcs = stack_pcs_[entry.first];
+  uint32_t i = stack_id - entry.first;
+  pcs->assign(block_pcs.begin() + offsets_it->second[i],
+              block_pcs.begin() + offsets_it->second[i + 1]);
+  return true;
+}
@@ -0,0 +1,197 @@
+#ifndef _UNWIND_RECORD_FILE_H_
+#define _UNWIND_RECORD_FILE_H_
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#include <functional>
+#include <memory>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+// A record file stores a stream of samples: module tables, interned stacks,
+// and samples with timestamps and thread ids. Layout:
+//
+//   RecordFileHeader
+//   blocks: RecordBlockHeader followed by size bytes of encoded data
+//   index: RecordIndexEntry for each block, then int32_t tids of all
+//          sample blocks
+//   RecordFileFooter
+//
+// Blocks are encoded with RECORD_CODEC_DELTA: numbers are LEB128, and
+// columns of pcs, times and ids are stored as deltas of the previous value,
+// which shrinks samples to a few bytes each. A stack is written before the
+// first sample block using it, and stack ids are numbered from 0 in the
+// order stacks are written.
+//
+// The index tells the time range and the tids of each sample block, and the
+// first stack id of each stack block. Readers map the file and only decode
+// the blocks a query needs.
+static constexpr uint32_t RECORD_FILE_MAGIC = 0x46525755;  // "UWRF"
+static constexpr uint32_t RECORD_FILE_VERSION = 1;
+
+enum RecordBlockType : uint32_t {
+  RECORD_MODULES = 1,
+  RECORD_STACKS = 2,
+  RECORD_SAMPLES = 3,
+};
+
+enum RecordCodec : uint32_t {
+  RECORD_CODEC_DELTA = 0,
+};
+
+struct RecordFileHeader {
+  uint32_t magic;
+  uint32_t version;
+  uint64_t reserved;
+};
+
+struct RecordBlockHeader {
+  uint32_t type;
+  uint32_t codec;
+  uint32_t count;
+  uint32_t size;
+};
+
+struct RecordIndexEntry {
+  // Offset of the RecordBlockHeader.
+  uint64_t offset;
+  uint32_t type;
+  uint32_t count;
+  // Time range of samples, [start_time, end_time].
+  uint64_t start_time;
+  uint64_t end_time;
+  // For RECORD_STACKS, the id of the first stack. For RECORD_SAMPLES, the
+  // index of the first tid of the block in the tid table.
+  uint64_t first;
+  // For RECORD_SAMPLES, the count of sorted unique tids in the tid table.
+  uint32_t tid_count;
+  uint32_t reserved;
+};
+
+struct RecordFileFooter {
+  uint64_t index_offset;
+  uint32_t block_count;
+  uint32_t tid_count;
+  uint64_t sample_count;
+  uint64_t stack_count;
+  uint32_t magic;
+  uint32_t version;
+};
+
+struct RecordModule {
+  int pid;
+  uint64_t start;
+  uint64_t end;
+  uint64_t min_vaddr;
+  std::string build_id;
+  std::string name;
+};
+
+struct RecordSample {
+  uint64_t time_ns;
+  int pid;
+  int tid;
+  uint32_t stack_id;
+};
+
+class RecordWriter {
+ public:
+  static std::unique_ptr<RecordWriter> Create(const char* filename,
+                                              uint32_t samples_per_block = 4096);
+
+  ~RecordWriter();
+
+  void AddModule(const RecordModule& module);
+  bool AddSample(uint64_t time_ns, int pid, int tid, const uint64_t* pcs, size_t count);
+  // Write the pending blocks, the index and the footer.
+  bool Finish();
+
+ private:
+  RecordWriter(FILE* fp, uint32_t samples_per_block)
+      : fp_(fp), samples_per_block_(samples_per_block), offset_(0), stack_count_(0),
+        pending_stack_count_(0), sample_count_(0), failed_(false) {
+  }
+
+  uint32_t InternStack(const uint64_t* pcs, size_t count);
+  void FlushModules();
+  void FlushStacks();
+  void FlushSamples();
+  void WriteBlock(uint32_t type, uint32_t count, const std::string& data,
+                  RecordIndexEntry* entry);
+  void Write(const void* data, size_t size);
+
+  FILE* fp_;
+  uint32_t samples_per_block_;
+  uint64_t offset_;
+  std::vector<RecordModule> pending_modules_;
+  // Keyed by the bytes of pcs.
+  std::unordered_map<std::string, uint32_t> stack_ids_;
+  uint32_t stack_count_;
+  std::string pending_stacks_;
+  uint32_t pending_stack_count_;
+  std::vector<RecordSample> pending_samples_;
+  uint64_t sample_count_;
+  std::vector<RecordIndexEntry> index_;
+  std::vector<int32_t> tids_;
+  bool failed_;
+};
+
+class RecordFile {
+ public:
+  static std::unique_ptr<RecordFile> Open(const char* filename);
+
+  ~RecordFile();
+
+  const std::vector<RecordModule>& GetModules() const {
+    return modules_;
+  }
+
+  uint64_t GetSampleCount() const {
+    return footer_.sample_count;
+  }
+
+  uint64_t GetStackCount() const {
+    return footer_.stack_count;
+  }
+
+  // Call callback for samples with time in [start_time, end_time] of thread
+  // tid, or of all threads if tid is -1. Only sample blocks overlapping the
+  // query are decoded.
+  bool ReadSamples(uint64_t start_time, uint64_t end_time, int tid,
+                   const std::function<void(const RecordSample&)>& callback);
+
+  // Get pcs of a stack, decoding its stack block on first use.
+  bool GetStack(uint32_t stack_id, std::vector<uint64_t>* pcs);
+
+  // Blocks decoded so far, for measuring queries.
+  size_t GetDecodedBlockCount() const {
+    return decoded_blocks_;
+  }
+
+ private:
+  RecordFile() : addr_(nullptr), size_(0), index_(nullptr), tids_(nullptr), decoded_blocks_(0) {
+  }
+
+  bool ReadIndex();
+  bool ReadModules(const RecordIndexEntry& entry);
+  const char* GetBlockData(const RecordIndexEntry& entry, uint32_t type);
+  bool DecodeStacks(const RecordIndexEntry& entry);
+
+  const char* addr_;
+  size_t size_;
+  RecordFileFooter footer_;
+  const RecordIndexEntry* index_;
+  const int32_t* tids_;
+  std::vector<RecordModule> modules_;
+  // Indexes of stack blocks in index_, in stack id order.
+  std::vector<uint32_t> stack_blocks_;
+  // Decoded stack blocks: offsets of each stack in stack_pcs_.
+  std::unordered_map<uint32_t, std::vector<uint32_t>> stack_offsets_;
+  std::unordered_map<uint32_t, std::vector<uint64_t>> stack_pcs_;
+  size_t decoded_blocks_;
+};
+
+#endif  // _UNWIND_RECORD_FILE_H_
@@ -0,0 +1,32 @@
+// Write samples of a record file as folded stacks for flame graph tools, or
+// with --diff, compare two record files by folded stack.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "folded_stack.h"
+
+int main(int argc, char** argv) {
+  if (argc == 4 && strcmp(argv[1], "--diff") == 0) {
+    std::unique_ptr<RecordFile> before = RecordFile::Open(argv[2]);
+    std::unique_ptr<RecordFile> after = RecordFile::Open(argv[3]);
+    if (before == nullptr || after == nullptr) {
+      return 1;
+    }
+    return WriteFoldedStackDiff(before.get(), after.get(), stdout) ? 0 : 1;
+  }
+  if (argc != 2 && argc != 4 && argc != 5) {
+    fprintf(stderr, "usage: record_fold <record_file> [start_ns end_ns [tid]]\n"
+            "       record_fold --diff <before_record_file> <after_record_file>\n");
+    exit(1);
+  }
+  std::unique_ptr<RecordFile> file = RecordFile::Open(argv[1]);
+  if (file == nullptr) {
+    return 1;
+  }
+  uint64_t start_time = (argc > 2) ? strtoull(argv[2], nullptr, 0) : 0;
+  uint64_t end_time = (argc > 3) ? strtoull(argv[3], nullptr, 0) : UINT64_MAX;
+  int tid = (argc > 4) ? atoi(argv[4]) : -1;
+  return WriteFoldedStacks(file.get(), start_time, end_time, tid, stdout) ? 0 : 1;
+}
@@ -0,0 +1,45 @@
+// Print samples of a record file in a time range, optionally of one thread,
+// as time, pid, tid and pcs of the stack.
+
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "record_file.h"
+
+int main(int argc, char** argv) {
+  if (argc != 2 && argc != 4 && argc != 5) {
+    fprintf(stderr, "usage: record_query <record_file> [start_ns end_ns [tid]]\n");
+    exit(1);
+  }
+  std::unique_ptr<RecordFile> file = RecordFile::Open(argv[1]);
+  if (file == nullptr) {
+    return 1;
+  }
+  uint64_t start_time = (argc > 2) ? strtoull(argv[2], nullptr, 0) : 0;
+  uint64_t end_time = (argc > 3) ? strtoull(argv[3], nullptr, 0) : UINT64_MAX;
+  int tid = (argc > 4) ? atoi(argv[4]) : -1;
+  for (auto& module : file->GetModules()) {
+    printf("module pid %d [0x%" PRIx64 "-0x%" PRIx64 "] %s\n", module.pid, module.start,
+           module.end, module.name.c_str());
+  }
+  std::vector<uint64_t> pcs;
+  size_t count = 0;
+  bool result = file->ReadSamples(start_time, end_time, tid, [&](const RecordSample& sample) {
+    printf("%" PRIu64 " %d/%d", sample.time_ns, sample.pid, sample.tid);
+    if (file->GetStack(sample.stack_id, &pcs)) {
+      for (auto pc : pcs) {
+        printf(" 0x%" PRIx64, pc);
+      }
+    }
+    printf("\n");
+    ++count;
+  });
+  if (!result) {
+    fprintf(stderr, "%s is corrupted\n", argv[1]);
+    return 1;
+  }
+  fprintf(stderr, "%zu of %" PRIu64 " samples, %zu blocks decoded\n", count,
+          file->GetSampleCount(), file->GetDecodedBlockCount());
+  return 0;
+}
@@ -0,0 +1,258 @@
+#include "sample_ring.h"
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "get_current_regs.h"
+
+static_assert(sizeof(SampleSlot) % 8 == 0, "stack bytes should be aligned");
+
+std::unique_ptr<SampleRing> SampleRing::Create(uint32_t slot_count, uint32_t stack_bytes) {
+  uint32_t count = 1;
+  while (count < slot_count) {
+    count <<= 1;
+  }
+  uint32_t slot_size = (sizeof(SampleSlot) + stack_bytes + 63) & ~63u;
+  size_t size = sizeof(SampleRingHeader) + static_cast<size_t>(count) * slot_size;
+  int fd = memfd_create("sample_ring", MFD_CLOEXEC);
+  if (fd == -1) {
+    fprintf(stderr, "memfd_create failed: %s\n", strerror(errno));
+    return nullptr;
+  }
+  if (ftruncate(fd, size) != 0) {
+    fprintf(stderr, "failed to resize sample ring: %s\n", strerror(errno));
+    close(fd);
+    return nullptr;
+  }
+  void* addr = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  if (addr == MAP_FAILED) {
+    fprintf(stderr, "failed to map sample ring: %s\n", strerror(errno));
+    close(fd);
+    return nullptr;
+  }
+  // The memfd is zero filled, only non-zero fields are set.
+  SampleRingHeader* header = static_cast<SampleRingHeader*>(addr);
+  header->word_size = sizeof(uintptr_t);
+  header->slot_count = count;
+  header->slot_size = slot_size;
+  header->stack_bytes = stack_bytes;
+  std::unique_ptr<SampleRing> ring(new SampleRing(fd, addr, size));
+  for (uint32_t i = 0; i < count; ++i) {
+    ring->SlotAt(i)->seq.store(i, std::memory_order_relaxed);
+  }
+  header->version = SAMPLE_RING_VERSION;
+  std::atomic_thread_fence(std::memory_order_release);
+  header->magic = SAMPLE_RING_MAGIC;
+  return ring;
+}
+
+std::unique_ptr<SampleRing> SampleRing::Attach(int fd) {
+  struct stat st;
+  if (fstat(fd, &st) != 0 || static_cast<size_t>(st.st_size) < sizeof(SampleRingHeader)) {
+    fprintf(stderr, "invalid sample ring fd\n");
+    close(fd);
+    return nullptr;
+  }
+  size_t size = st.st_size;
+  void* addr = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  if (addr == MAP_FAILED) {
+    fprintf(stderr, "failed to map sample ring: %s\n", strerror(errno));
+    close(fd);
+    return nullptr;
+  }
+  std::unique_ptr<SampleRing> ring(new SampleRing(fd, addr, size));
+  const SampleRingHeader* header = ring->header_;
+  uint32_t count = header->slot_count;
+  if (header->magic != SAMPLE_RING_MAGIC || header->version != SAMPLE_RING_VERSION ||
+      header->word_size != sizeof(uintptr_t) || count == 0 || (count & (count - 1)) != 0 ||
+      ring->slot_size_ < sizeof(SampleSlot) + ring->stack_bytes_ ||
+      (size - sizeof(SampleRingHeader)) / ring->slot_size_ < count) {
+    fprintf(stderr, "invalid sample ring\n");
+    return nullptr;
+  }
+  ring->mask_ = count - 1;
+  return ring;
+}
+
+SampleRing::SampleRing(int fd, void* addr, size_t size)
+    : fd_(fd), size_(size), header_(static_cast<SampleRingHeader*>(addr)),
+      slots_(static_cast<char*>(addr) + sizeof(SampleRingHeader)),
+      mask_(header_->slot_count - 1), slot_size_(header_->slot_size),
+      stack_bytes_(header_->stack_bytes) {
+}
+
+SampleRing::~SampleRing() {
+  munmap(header_, size_);
+  close(fd_);
+}
+
+SampleSlot* SampleRing::Reserve(uint64_t* pos) {
+  uint64_t p = header_->write_pos.load(std::memory_order_relaxed);
+  while (true) {
+    SampleSlot* slot = SlotAt(p);
+    uint64_t seq = slot->seq.load(std::memory_order_acquire);
+    if (seq == p) {
+      if (header_->write_pos.compare_exchange_weak(p, p + 1, std::memory_order_relaxed)) {
+        *pos = p;
+        return slot;
+      }
+    } else if (seq < p) {
+      // The consumer hasn't freed the slot of the last round.
+      header_->dropped.fetch_add(1, std::memory_order_relaxed);
+      return nullptr;
+    } else {
+      p = header_->write_pos.load(std::memory_order_relaxed);
+    }
+  }
+}
+
+void SampleRing::Commit(SampleSlot* slot, uint64_t pos) {
+  slot->seq.store(pos + 1, std::memory_order_release);
+}
+
+SampleSlot* SampleRing::Peek() {
+  uint64_t pos = header_->read_pos.load(std::memory_order_relaxed);
+  SampleSlot* slot = SlotAt(pos);
+  if (slot->seq.load(std::memory_order_acquire) != pos + 1) {
+    return nullptr;
+  }
+  return slot;
+}
+
+void SampleRing::Pop() {
+  uint64_t pos = header_->read_pos.load(std::memory_order_relaxed);
+  SlotAt(pos)->seq.store(pos + mask_ + 1, std::memory_order_release);
+  header_->read_pos.store(pos + 1, std::memory_order_relaxed);
+}
+
+std::unique_ptr<SampleClient> SampleClient::Connect(const char* socket_path, uint32_t slot_count,
+                                                    uint32_t stack_bytes) {
+  sockaddr_un addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  if (strlen(socket_path) >= sizeof(addr.sun_path)) {
+    fprintf(stderr, "socket path %s is too long\n", socket_path);
+    return nullptr;
+  }
+  strcpy(addr.sun_path, socket_path);
+  std::unique_ptr<SampleRing> ring = SampleRing::Create(slot_count, stack_bytes);
+  if (ring == nullptr) {
+    return nullptr;
+  }
+  int sock = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  if (sock == -1) {
+    fprintf(stderr, "failed to create socket: %s\n", strerror(errno));
+    return nullptr;
+  }
+  if (connect(sock, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) != 0) {
+    fprintf(stderr, "failed to connect to %s: %s\n", socket_path, strerror(errno));
+    close(sock);
+    return nullptr;
+  }
+  // Send the memfd with SCM_RIGHTS, the daemon gets our pid from SO_PEERCRED.
+  char data = 0;
+  iovec iov;
+  iov.iov_base = &data;
+  iov.iov_len = 1;
+  char control[CMSG_SPACE(sizeof(int))];
+  memset(control, 0, sizeof(control));
+  msghdr msg;
+  memset(&msg, 0, sizeof(msg));
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  msg.msg_control = control;
+  msg.msg_controllen = sizeof(control);
+  cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+  cmsg->cmsg_level = SOL_SOCKET;
+  cmsg->cmsg_type = SCM_RIGHTS;
+  cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+  int fd = ring->Fd();
+  memcpy(CMSG_DATA(cmsg), &fd, sizeof(int));
+  if (TEMP_FAILURE_RETRY(sendmsg(sock, &msg, MSG_NOSIGNAL)) != 1) {
+    fprintf(stderr, "failed to send sample ring: %s\n", strerror(errno));
+    close(sock);
+    return nullptr;
+  }
+  return std::unique_ptr<SampleClient>(new SampleClient(sock, std::move(ring)));
+}
+
+SampleClient::~SampleClient() {
+  close(sock_);
+}
+
+// initial-exec, so reading them in signal handlers never allocates.
+static __thread uintptr_t thread_stack_start __attribute__((tls_model("initial-exec")));
+static __thread uintptr_t thread_stack_end __attribute__((tls_model("initial-exec")));
+
+bool SampleClient::InitThread() {
+  pthread_attr_t attr;
+  if (pthread_getattr_np(pthread_self(), &attr) != 0) {
+    return false;
+  }
+  void* stack_addr;
+  size_t stack_size;
+  int ret = pthread_attr_getstack(&attr, &stack_addr, &stack_size);
+  pthread_attr_destroy(&attr);
+  if (ret != 0) {
+    return false;
+  }
+  thread_stack_start = reinterpret_cast<uintptr_t>(stack_addr);
+  thread_stack_end = thread_stack_start + stack_size;
+  return true;
+}
+
+bool SampleClient::CopyStack(SampleSlot* slot) {
+  uintptr_t sp = slot->regs[CURRENT_REGS_SP];
+  size_t size = ring_->StackBytes();
+  // On an alternate signal stack, sp is out of the thread stack.
+  if (sp < thread_stack_start || sp >= thread_stack_end) {
+    size = 0;
+  } else if (size > thread_stack_end - sp) {
+    size = thread_stack_end - sp;
+  }
+  memcpy(slot->stack, reinterpret_cast<const void*>(sp), size);
+  slot->stack_size = size;
+  return size != 0;
+}
+
+bool SampleClient::Sample(const uintptr_t* regs) {
+  if (thread_stack_end == 0) {
+    return false;
+  }
+  uint64_t pos;
+  SampleSlot* slot = ring_->Reserve(&pos);
+  if (slot == nullptr) {
+    return false;
+  }
+  slot->tid = syscall(SYS_gettid);
+  slot->flags = SAMPLE_FROM_SIGNAL_CONTEXT;
+  memcpy(slot->regs, regs, sizeof(slot->regs));
+  CopyStack(slot);
+  ring_->Commit(slot, pos);
+  return true;
+}
+
+bool SampleClient::SampleCurrentThread() {
+  if (thread_stack_end == 0) {
+    return false;
+  }
+  uint64_t pos;
+  SampleSlot* slot = ring_->Reserve(&pos);
+  if (slot == nullptr) {
+    return false;
+  }
+  slot->tid = syscall(SYS_gettid);
+  slot->flags = 0;
+  GET_CURRENT_REGS(slot->regs);
+  CopyStack(slot);
+  ring_->Commit(slot, pos);
+  return true;
+}
@@ -0,0 +1,145 @@
+#ifndef _UNWIND_SAMPLE_RING_H_
+#define _UNWIND_SAMPLE_RING_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <atomic>
+#include <memory>
+
+// A ring of stack samples in a memfd shared by a target process and the
+// unwind daemon. Target threads only copy registers and stack bytes into the
+// ring, the daemon does all the dwarf work.
+//
+// It is a bounded MPSC queue with a sequence number per slot: slot i of
+// position pos is free when seq == pos, and filled when seq == pos + 1.
+// Producers claim positions with a CAS on write_pos, the consumer frees a
+// slot by setting seq to pos + slot_count. A full ring drops samples instead
+// of waiting, so producers never block.
+static constexpr uint32_t SAMPLE_RING_MAGIC = 0x52535755;  // "UWSR"
+static constexpr uint32_t SAMPLE_RING_VERSION = 3;
+static constexpr int SAMPLE_MAX_REGS = 33;
+
+// regs of the slot are from a signal context, see
+// UnwindCursor::InitFromSignalContext().
+static constexpr uint32_t SAMPLE_FROM_SIGNAL_CONTEXT = 1;
+
+struct SampleRingHeader {
+  uint32_t magic;
+  uint32_t version;
+  uint32_t word_size;
+  // A power of 2.
+  uint32_t slot_count;
+  uint32_t slot_size;
+  uint32_t stack_bytes;
+  alignas(64) std::atomic<uint64_t> write_pos;
+  alignas(64) std::atomic<uint64_t> read_pos;
+  std::atomic<uint64_t> dropped;
+};
+
+struct SampleSlot {
+  std::atomic<uint64_t> seq;
+  int32_t tid;
+  uint32_t stack_size;
+  uint32_t flags;
+  // Registers in the layout of GET_CURRENT_REGS(), or of
+  // GetRegsFromUcontext() with SAMPLE_FROM_SIGNAL_CONTEXT.
+  uintptr_t regs[SAMPLE_MAX_REGS];
+  // stack_size bytes from regs[CURRENT_REGS_SP].
+  char stack[];
+};
+
+class SampleRing {
+ public:
+  // Create a ring in a new memfd, with slot_count rounded up to a power of 2.
+  static std::unique_ptr<SampleRing> Create(uint32_t slot_count, uint32_t stack_bytes);
+  // Map a ring created by another process.
+  static std::unique_ptr<SampleRing> Attach(int fd);
+
+  ~SampleRing();
+
+  int Fd() const {
+    return fd_;
+  }
+
+  const SampleRingHeader* Header() const {
+    return header_;
+  }
+
+  // stack_bytes of the header as validated when mapping, the target can
+  // change the header after.
+  uint32_t StackBytes() const {
+    return stack_bytes_;
+  }
+
+  // slot_count of the header as validated when mapping.
+  uint64_t SlotCount() const {
+    return mask_ + 1;
+  }
+
+  // Claim a free slot, or return nullptr if the ring is full. The caller
+  // fills it and calls Commit(). Async signal safe.
+  SampleSlot* Reserve(uint64_t* pos);
+  void Commit(SampleSlot* slot, uint64_t pos);
+
+  // Return the oldest filled slot, or nullptr if there is none. Only one
+  // consumer can use Peek() and Pop(). The target can still write the slot,
+  // so the consumer reads each field once, and checks stack_size against
+  // StackBytes().
+  SampleSlot* Peek();
+  void Pop();
+
+ private:
+  SampleRing(int fd, void* addr, size_t size);
+
+  SampleSlot* SlotAt(uint64_t pos) {
+    return reinterpret_cast<SampleSlot*>(slots_ + (pos & mask_) * slot_size_);
+  }
+
+  int fd_;
+  size_t size_;
+  SampleRingHeader* header_;
+  char* slots_;
+  uint64_t mask_;
+  uint32_t slot_size_;
+  uint32_t stack_bytes_;
+};
+
+// The target side of the unwind daemon. It creates a ring and sends its fd
+// to the daemon over a unix socket.
+class SampleClient {
+ public:
+  static std::unique_ptr<SampleClient> Connect(const char* socket_path, uint32_t slot_count = 256,
+                                               uint32_t stack_bytes = 16 * 1024);
+
+  ~SampleClient();
+
+  // Record the stack end of the calling thread. Samples of a thread are only
+  // taken after it is called in the thread, so stack copies never run past
+  // the stack.
+  static bool InitThread();
+
+  // Add a sample of the calling thread from regs converted from a signal
+  // context by GetRegsFromUcontext(). It copies the stack with one memcpy.
+  // Async signal safe.
+  bool Sample(const uintptr_t* regs);
+
+  // Add a sample of the calling thread at the call site, capturing registers
+  // into the slot in place.
+  bool SampleCurrentThread();
+
+  uint64_t GetDropped() const {
+    return ring_->Header()->dropped.load(std::memory_order_relaxed);
+  }
+
+ private:
+  SampleClient(int sock, std::unique_ptr<SampleRing> ring) : sock_(sock), ring_(std::move(ring)) {
+  }
+
+  bool CopyStack(SampleSlot* slot);
+
+  int sock_;
+  std::unique_ptr<SampleRing> ring_;
+};
+
+#endif  // _UNWIND_SAMPLE_RING_H_
@@ -0,0 +1,303 @@
+#include "shared_index.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+
+#include "elf_reader.h"
+
+static std::string& shared_index_dir = *new std::string;
+
+void SharedIndex::SetDir(const std::string& dir) {
+  shared_index_dir = dir;
+}
+
+bool SharedIndex::IsEnabled() {
+  return !shared_index_dir.empty();
+}
+
+static std::string GetIndexPath(const std::string& build_id) {
+  std::string path = shared_index_dir + "/unwind_index_";
+  for (unsigned char c : build_id) {
+    char buf[3];
+    snprintf(buf, sizeof(buf), "%02x", c);
+    path += buf;
+  }
+  return path;
+}
+
+std::unique_ptr<SharedIndex> SharedIndex::Open(const std::string& build_id) {
+  if (!IsEnabled() || build_id.empty() || build_id.size() > SHARED_INDEX_MAX_BUILD_ID) {
+    return nullptr;
+  }
+  std::string path = GetIndexPath(build_id);
+  int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC | O_NOFOLLOW);
+  if (fd == -1) {
+    return nullptr;
+  }
+  struct stat st;
+  if (fstat(fd, &st) != 0 || static_cast<size_t>(st.st_size) < sizeof(SharedIndexHeader)) {
+    close(fd);
+    return nullptr;
+  }
+  // The index directory may be shared, so only trust files nobody else could
+  // have written.
+  if (!S_ISREG(st.st_mode) || st.st_uid != geteuid() || (st.st_mode & (S_IWGRP | S_IWOTH))) {
+    fprintf(stderr, "ignore shared index %s not owned by us or writable by others\n",
+            path.c_str());
+    close(fd);
+    return nullptr;
+  }
+  void* addr = mmap(nullptr, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);
+  if (addr == MAP_FAILED) {
+    fprintf(stderr, "failed to map %s: %s\n", path.c_str(), strerror(errno));
+    return nullptr;
+  }
+  std::unique_ptr<SharedIndex> index(new SharedIndex(addr, st.st_size));
+  if (!index->Validate(build_id)) {
+    fprintf(stderr, "shared index %s is invalid\n", path.c_str());
+    return nullptr;
+  }
+  return index;
+}
+
+bool SharedIndex::Publish(const std::string& build_id, const FdeTable& fde_table) {
+  if (!IsEnabled() || build_id.empty() || build_id.size() > SHARED_INDEX_MAX_BUILD_ID) {
+    return false;
+  }
+  std::string path = GetIndexPath(build_id);
+  if (access(path.c_str(), F_OK) == 0) {
+    return true;
+  }
+  std::vector<SharedIndexCie> cies;
+  std::vector<SharedIndexFde> fdes;
+  std::vector<char> bytes;
+  std::unordered_map<const Cie*, uint32_t> cie_map;
+  // Instructions are interned in InstsPool, so equal pointers mean equal bytes.
+  std::unordered_map<const char*, uint64_t> bytes_map;
+  auto add_bytes = [&](const char* begin, size_t size) {
+    auto it = bytes_map.find(begin);
+    if (it != bytes_map.end()) {
+      return it->second;
+    }
+    uint64_t offset = bytes.size();
+    bytes.insert(bytes.end(), begin, begin + size);
+    bytes_map[begin] = offset;
+    return offset;
+  };
+  for (auto& pair : fde_table.GetFdes()) {
+    const Fde* fde = pair.second;
+    auto it = cie_map.find(fde->cie);
+    if (it == cie_map.end()) {
+      const Cie* cie = fde->cie;
+      SharedIndexCie c;
+      c.section64 = cie->section64;
+      c.fde_pointer_encoding = cie->fde_pointer_encoding;
+      c.lsda_encoding = cie->lsda_encoding;
+      c.address_size = cie->address_size;
+      c.augmentation_offset = add_bytes(cie->augmentation, strlen(cie->augmentation) + 1);
+      c.data_alignment_factor = cie->data_alignment_factor;
+      c.insts_offset = add_bytes(cie->insts.begin, cie->insts.size());
+      c.insts_size = cie->insts.size();
+      c.has_eh_info = cie->has_eh_info;
+      c.personality_indirect = cie->personality_indirect;
+      memset(c.reserved, 0, sizeof(c.reserved));
+      c.personality = cie->personality;
+      it = cie_map.insert(std::make_pair(cie, cies.size())).first;
+      cies.push_back(c);
+    }
+    SharedIndexFde f;
+    f.func_start = fde->func_start;
+    f.func_end = fde->func_end;
+    f.cie_index = it->second;
+    f.section64 = fde->section64;
+    f.insts_offset = add_bytes(fde->insts.begin, fde->insts.size());
+    f.insts_size = fde->insts.size();
+    f.lsda = fde->lsda;
+    fdes.push_back(f);
+  }
+  SharedIndexHeader header;
+  memset(&header, 0, sizeof(header));
+  header.magic = SHARED_INDEX_MAGIC;
+  header.version = SHARED_INDEX_VERSION;
+  header.build_id_size = build_id.size();
+  memcpy(header.build_id, build_id.data(), build_id.size());
+  header.cie_count = cies.size();
+  header.fde_count = fdes.size();
+  header.bytes_size = bytes.size();
+  header.total_size = sizeof(header) + cies.size() * sizeof(SharedIndexCie) +
+      fdes.size() * sizeof(SharedIndexFde) + bytes.size();
+
+  // Write to a private file and rename it, so readers never see a partial index.
+  // The name is unique, so publishers never collide, even in one process.
+  std::string tmp_path = path + ".tmp.XXXXXX";
+  int fd = mkostemp(&tmp_path[0], O_CLOEXEC);
+  if (fd == -1) {
+    fprintf(stderr, "failed to create %s: %s\n", tmp_path.c_str(), strerror(errno));
+    return false;
+  }
+  // It is created 0600, which is enough, as Open() only trusts files of its
+  // own user.
+  struct Part {
+    const void* data;
+    size_t size;
+  } parts[] = {
+    {&header, sizeof(header)},
+    {cies.data(), cies.size() * sizeof(SharedIndexCie)},
+    {fdes.data(), fdes.size() * sizeof(SharedIndexFde)},
+    {bytes.data(), bytes.size()},
+  };
+  bool result = true;
+  for (auto& part : parts) {
+    const char* p = static_cast<const char*>(part.data);
+    size_t left = part.size;
+    while (left > 0) {
+      ssize_t n = TEMP_FAILURE_RETRY(write(fd, p, left));
+      if (n <= 0) {
+        fprintf(stderr, "failed to write %s: %s\n", tmp_path.c_str(), strerror(errno));
+        result = false;
+        break;
+      }
+      p += n;
+      left -= n;
+    }
+    if (!result) {
+      break;
+    }
+  }
+  close(fd);
+  if (result && rename(tmp_path.c_str(), path.c_str()) != 0) {
+    fprintf(stderr, "failed to rename %s: %s\n", tmp_path.c_str(), strerror(errno));
+    result = false;
+  }
+  if (!result) {
+    unlink(tmp_path.c_str());
+  }
+  return result;
+}
+
+SharedIndex::SharedIndex(const void* addr, size_t size)
+    : addr_(addr), size_(size), header_(static_cast<const SharedIndexHeader*>(addr)),
+      cies_(nullptr), fdes_(nullptr), bytes_(nullptr) {
+}
+
+SharedIndex::~SharedIndex() {
+  munmap(const_cast<void*>(addr_), size_);
+}
+
+bool SharedIndex::Validate(const std::string& build_id) {
+  if (header_->magic != SHARED_INDEX_MAGIC || header_->version != SHARED_INDEX_VERSION ||
+      header_->total_size != size_ || header_->build_id_size != build_id.size() ||
+      memcmp(header_->build_id, build_id.data(), build_id.size()) != 0) {
+    return false;
+  }
+  // Subtract from the remaining size instead of adding, so a crafted count
+  // can't wrap the sum.
+  uint64_t left = size_ - sizeof(*header_);
+  if (header_->cie_count > left / sizeof(SharedIndexCie)) {
+    return false;
+  }
+  uint64_t cie_size = static_cast<uint64_t>(header_->cie_count) * sizeof(SharedIndexCie);
+  left -= cie_size;
+  if (header_->fde_count > left / sizeof(SharedIndexFde)) {
+    return false;
+  }
+  uint64_t fde_size = header_->fde_count * sizeof(SharedIndexFde);
+  left -= fde_size;
+  if (header_->bytes_size != left) {
+    return false;
+  }
+  const char* p = static_cast<const char*>(addr_) + sizeof(*header_);
+  cies_ = reinterpret_cast<const SharedIndexCie*>(p);
+  fdes_ = reinterpret_cast<const SharedIndexFde*>(p + cie_size);
+  bytes_ = p + cie_size + fde_size;
+  uint64_t bytes_size = header_->bytes_size;
+  for (uint32_t i = 0; i < header_->cie_count; ++i) {
+    const SharedIndexCie& cie = cies_[i];
+    if (cie.augmentation_offset >= bytes_size ||
+        memchr(bytes_ + cie.augmentation_offset, '\0',
+               bytes_size - cie.augmentation_offset) == nullptr ||
+        cie.insts_offset > bytes_size || cie.insts_size > bytes_size - cie.insts_offset) {
+      return false;
+    }
+  }
+  for (uint64_t i = 0; i < header_->fde_count; ++i) {
+    const SharedIndexFde& fde = fdes_[i];
+    if (fde.cie_index >= header_->cie_count || fde.insts_offset > bytes_size ||
+        fde.insts_size > bytes_size - fde.insts_offset ||
+        (i > 0 && fdes_[i - 1].func_start >= fde.func_start)) {
+      return false;
+    }
+  }
+  cie_objects_.resize(header_->cie_count);
+  for (uint32_t i = 0; i < header_->cie_count; ++i) {
+    const SharedIndexCie& c = cies_[i];
+    Cie* cie = arena_.New<Cie>();
+    cie->section64 = c.section64;
+    cie->fde_pointer_encoding = c.fde_pointer_encoding;
+    cie->lsda_encoding = c.lsda_encoding;
+    cie->address_size = c.address_size;
+    cie->augmentation = bytes_ + c.augmentation_offset;
+    cie->data_alignment_factor = c.data_alignment_factor;
+    cie->insts.begin = bytes_ + c.insts_offset;
+    cie->insts.end = cie->insts.begin + c.insts_size;
+    cie->has_eh_info = c.has_eh_info != 0;
+    cie->personality = c.personality;
+    cie->personality_indirect = c.personality_indirect != 0;
+    cie_objects_[i] = cie;
+  }
+  return true;
+}
+
+const SharedIndexFde* SharedIndex::FindIndexFde(uint64_t vaddr_in_file) const {
+  const SharedIndexFde* end = fdes_ + header_->fde_count;
+  const SharedIndexFde* it = std::upper_bound(fdes_, end, vaddr_in_file,
+      [](uint64_t vaddr, const SharedIndexFde& fde) {
+        return vaddr < fde.func_start;
+      });
+  return (it == fdes_) ? nullptr : it - 1;
+}
+
+void SharedIndex::BuildFde(const SharedIndexFde& index_fde, Fde* fde) const {
+  fde->cie = cie_objects_[index_fde.cie_index];
+  fde->section64 = index_fde.section64;
+  fde->func_start = index_fde.func_start;
+  fde->func_end = index_fde.func_end;
+  fde->insts.begin = bytes_ + index_fde.insts_offset;
+  fde->insts.end = fde->insts.begin + index_fde.insts_size;
+  fde->lsda = index_fde.lsda;
+}
+
+Fde* SharedIndex::FindFde(uint64_t vaddr_in_file) {
+  const SharedIndexFde* index_fde = FindIndexFde(vaddr_in_file);
+  if (index_fde == nullptr) {
+    return nullptr;
+  }
+  uint64_t id = index_fde - fdes_;
+  std::lock_guard<std::mutex> lock(mutex_);
+  auto it = fde_objects_.find(id);
+  if (it != fde_objects_.end()) {
+    return it->second;
+  }
+  Fde* fde = arena_.New<Fde>();
+  BuildFde(*index_fde, fde);
+  fde_objects_[id] = fde;
+  return fde;
+}
+
+bool SharedIndex::FindFde(uint64_t vaddr_in_file, Fde* fde) const {
+  const SharedIndexFde* index_fde = FindIndexFde(vaddr_in_file);
+  if (index_fde == nullptr) {
+    return false;
+  }
+  BuildFde(*index_fde, fde);
+  return true;
+}
@@ -0,0 +1,112 @@
+#ifndef _UNWIND_SHARED_INDEX_H_
+#define _UNWIND_SHARED_INDEX_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "arena.h"
+
+struct Cie;
+struct Fde;
+class CieTable;
+class FdeTable;
+
+// Layout of a shared index file. The file is named by the build id of the
+// dso, and contains a header, a Cie array, an Fde array sorted by func_start,
+// and a byte area holding augmentation strings and instructions. Offsets are
+// relative to the start of the byte area. Version 2 adds the personality
+// routines and lsdas read from .eh_frame.
+static constexpr uint32_t SHARED_INDEX_MAGIC = 0x58495755;  // "UWIX"
+static constexpr uint32_t SHARED_INDEX_VERSION = 2;
+static constexpr size_t SHARED_INDEX_MAX_BUILD_ID = 64;
+
+struct SharedIndexHeader {
+  uint32_t magic;
+  uint32_t version;
+  uint64_t total_size;
+  uint32_t build_id_size;
+  uint8_t build_id[SHARED_INDEX_MAX_BUILD_ID];
+  uint32_t cie_count;
+  uint64_t fde_count;
+  uint64_t bytes_size;
+};
+
+struct SharedIndexCie {
+  uint8_t section64;
+  uint8_t fde_pointer_encoding;
+  uint8_t lsda_encoding;
+  uint8_t address_size;
+  uint32_t augmentation_offset;
+  uint64_t data_alignment_factor;
+  uint64_t insts_offset;
+  uint64_t insts_size;
+  uint8_t has_eh_info;
+  uint8_t personality_indirect;
+  uint8_t reserved[6];
+  uint64_t personality;
+};
+
+struct SharedIndexFde {
+  uint64_t func_start;
+  uint64_t func_end;
+  uint32_t cie_index;
+  uint32_t section64;
+  uint64_t insts_offset;
+  uint64_t insts_size;
+  uint64_t lsda;
+};
+
+// Unwind index of a dso shared between processes. The first process reading
+// the unwind section of a dso publishes its index in a file under the shared
+// index directory (normally on tmpfs, like /dev/shm), other processes map the
+// file read-only instead of parsing the dso again. Disabled unless
+// SharedIndex::SetDir() is called.
+class SharedIndex {
+ public:
+  static void SetDir(const std::string& dir);
+  static bool IsEnabled();
+
+  // Map and validate the index for build_id, return nullptr if there is none.
+  static std::unique_ptr<SharedIndex> Open(const std::string& build_id);
+  static bool Publish(const std::string& build_id, const FdeTable& fde_table);
+
+  ~SharedIndex();
+
+  // Fdes are built from the mapped file on first lookup, and kept.
+  Fde* FindFde(uint64_t vaddr_in_file);
+  // Build the Fde in *fde without keeping it. It takes no lock and allocates
+  // nothing, so it can be used in signal handlers.
+  bool FindFde(uint64_t vaddr_in_file, Fde* fde) const;
+
+  size_t GetFdeCount() const {
+    return header_->fde_count;
+  }
+
+ private:
+  SharedIndex(const void* addr, size_t size);
+  bool Validate(const std::string& build_id);
+  const SharedIndexFde* FindIndexFde(uint64_t vaddr_in_file) const;
+  void BuildFde(const SharedIndexFde& index_fde, Fde* fde) const;
+
+  const void* addr_;
+  size_t size_;
+  const SharedIndexHeader* header_;
+  const SharedIndexCie* cies_;
+  const SharedIndexFde* fdes_;
+  const char* bytes_;
+
+  Arena arena_;
+  // Built by Validate(), not changed after.
+  std::vector<Cie*> cie_objects_;
+  // Guards fde_objects_, and arena_ after Validate().
+  std::mutex mutex_;
+  std::unordered_map<uint64_t, Fde*> fde_objects_;
+};
+
+#endif  // _UNWIND_SHARED_INDEX_H_
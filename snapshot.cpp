@@ -0,0 +1,321 @@
+#include "snapshot.h"
+
+#include <elf.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#include <algorithm>
+
+#include "elf_reader.h"
+#include "get_current_regs.h"
+
+#if defined(__x86_64__)
+static constexpr uint16_t CURRENT_MACHINE = EM_X86_64;
+#elif defined(__i386__)
+static constexpr uint16_t CURRENT_MACHINE = EM_386;
+#elif defined(__aarch64__)
+static constexpr uint16_t CURRENT_MACHINE = EM_AARCH64;
+#elif defined(__arm__)
+static constexpr uint16_t CURRENT_MACHINE = EM_ARM;
+#endif
+
+static size_t Align8(size_t size) {
+  return (size + 7) & ~static_cast<size_t>(7);
+}
+
+bool SnapshotWriter::Write(const void* data, size_t size) {
+  const char* p = static_cast<const char*>(data);
+  while (size > 0 && !failed_) {
+    ssize_t n = TEMP_FAILURE_RETRY(write(fd_, p, size));
+    if (n <= 0) {
+      failed_ = true;
+      break;
+    }
+    p += n;
+    size -= n;
+  }
+  return !failed_;
+}
+
+bool SnapshotWriter::WriteRecord(uint32_t type, const void* head, size_t head_size,
+                                 const void* data1, size_t size1, const void* data2,
+                                 size_t size2) {
+  static const char zeros[8] = {};
+  SnapshotRecord record;
+  record.type = type;
+  record.reserved = 0;
+  record.size = head_size + size1 + size2;
+  Write(&record, sizeof(record));
+  Write(head, head_size);
+  Write(data1, size1);
+  Write(data2, size2);
+  return Write(zeros, Align8(record.size) - record.size);
+}
+
+// Copy memory of this process to buf_, stopping at the first unreadable page.
+size_t SnapshotWriter::CopyMemory(uint64_t start, size_t size) {
+  if (size > buf_size_) {
+    size = buf_size_;
+  }
+  iovec local;
+  local.iov_base = buf_;
+  local.iov_len = size;
+  iovec remote;
+  remote.iov_base = reinterpret_cast<void*>(static_cast<uintptr_t>(start));
+  remote.iov_len = size;
+  ssize_t n = process_vm_readv(getpid(), &local, 1, &remote, 1, 0);
+  return n > 0 ? n : 0;
+}
+
+bool SnapshotWriter::WriteHeader() {
+  SnapshotHeader header;
+  memset(&header, 0, sizeof(header));
+  header.magic = SNAPSHOT_MAGIC;
+  header.version = SNAPSHOT_VERSION;
+  header.machine = CURRENT_MACHINE;
+  header.word_size = sizeof(uintptr_t);
+  header.pid = getpid();
+  return Write(&header, sizeof(header));
+}
+
+bool SnapshotWriter::WriteThread(int tid, int signo, const uintptr_t* regs, size_t stack_bytes) {
+  SnapshotThread thread;
+  memset(&thread, 0, sizeof(thread));
+  thread.tid = tid;
+  thread.signo = signo;
+  for (int i = 0; i < UNWIND_MAX_REGS; ++i) {
+    thread.regs[i] = regs[i];
+  }
+  thread.stack_start = regs[CURRENT_REGS_SP];
+  size_t size = CopyMemory(thread.stack_start, stack_bytes);
+  return WriteRecord(SNAPSHOT_THREAD, &thread, sizeof(thread), buf_, size, nullptr, 0);
+}
+
+bool SnapshotWriter::WriteModules(MapTree* maps) {
+  for (auto& pair : maps->GetMaps()) {
+    const Map& map = pair.second;
+    ElfReader* reader = map.dso_reader;
+    SnapshotModule module;
+    memset(&module, 0, sizeof(module));
+    module.start = map.start;
+    module.end = map.end;
+    module.min_vaddr = (reader != nullptr) ? reader->GetMinVaddr() : 0;
+    module.build_id_size = (reader != nullptr) ? reader->GetBuildId().size() : 0;
+    module.name_size = map.dso.size();
+    const char* build_id = (reader != nullptr) ? reader->GetBuildId().data() : nullptr;
+    if (!WriteRecord(SNAPSHOT_MODULE, &module, sizeof(module), build_id, module.build_id_size,
+                     map.dso.data(), module.name_size)) {
+      return false;
+    }
+  }
+  return true;
+}
+
+bool SnapshotWriter::WriteRegion(uint64_t start, size_t size) {
+  SnapshotRegion region;
+  region.start = start;
+  size = CopyMemory(start, size);
+  return WriteRecord(SNAPSHOT_REGION, &region, sizeof(region), buf_, size, nullptr, 0);
+}
+
+bool SnapshotWriter::Finish() {
+  return WriteRecord(SNAPSHOT_END, nullptr, 0, nullptr, 0, nullptr, 0);
+}
+
+// Serves memory from the stacks and regions in the snapshot.
+class Snapshot::Memory : public UnwindMemory {
+ public:
+  struct Range {
+    uint64_t start;
+    uint64_t size;
+    const char* data;
+  };
+
+  explicit Memory(std::vector<Range> ranges) : ranges_(std::move(ranges)) {
+    std::sort(ranges_.begin(), ranges_.end(), [](const Range& a, const Range& b) {
+      return a.start < b.start;
+    });
+  }
+
+  bool Read(uint64_t addr, void* buf, size_t size) override {
+    auto it = std::upper_bound(ranges_.begin(), ranges_.end(), addr,
+                               [](uint64_t addr, const Range& range) {
+                                 return addr < range.start;
+                               });
+    if (it == ranges_.begin()) {
+      return false;
+    }
+    --it;
+    uint64_t offset = addr - it->start;
+    if (offset >= it->size || size > it->size - offset) {
+      return false;
+    }
+    memcpy(buf, it->data + offset, size);
+    return true;
+  }
+
+ private:
+  std::vector<Range> ranges_;
+};
+
+std::unique_ptr<Snapshot> Snapshot::Open(const char* filename, const std::string& symbol_dir) {
+  int fd = open(filename, O_RDONLY | O_CLOEXEC);
+  if (fd == -1) {
+    fprintf(stderr, "failed to open %s: %s\n", filename, strerror(errno));
+    return nullptr;
+  }
+  struct stat st;
+  if (fstat(fd, &st) != 0 || static_cast<size_t>(st.st_size) < sizeof(SnapshotHeader)) {
+    fprintf(stderr, "%s isn't a snapshot\n", filename);
+    close(fd);
+    return nullptr;
+  }
+  void* addr = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (addr == MAP_FAILED) {
+    fprintf(stderr, "failed to map %s: %s\n", filename, strerror(errno));
+    return nullptr;
+  }
+  std::unique_ptr<Snapshot> snapshot(new Snapshot);
+  snapshot->addr_ = static_cast<const char*>(addr);
+  snapshot->size_ = st.st_size;
+  if (!snapshot->Parse()) {
+    fprintf(stderr, "%s is an invalid snapshot\n", filename);
+    return nullptr;
+  }
+  for (auto& module : snapshot->modules_) {
+    module.local_path = snapshot->FindModule(module, symbol_dir);
+    if (!module.local_path.empty()) {
+      snapshot->maps_.AddMap(module.module.start, module.module.end, module.local_path);
+    }
+  }
+  return snapshot;
+}
+
+Snapshot::Snapshot() : addr_(nullptr), size_(0) {
+}
+
+Snapshot::~Snapshot() {
+  if (addr_ != nullptr) {
+    munmap(const_cast<char*>(addr_), size_);
+  }
+}
+
+bool Snapshot::Parse() {
+  SnapshotHeader header;
+  memcpy(&header, addr_, sizeof(header));
+  if (header.magic != SNAPSHOT_MAGIC || header.version != SNAPSHOT_VERSION) {
+    return false;
+  }
+  if (header.machine != CURRENT_MACHINE || header.word_size != sizeof(uintptr_t)) {
+    fprintf(stderr, "snapshot is for machine %u, can't be unwound on this arch\n",
+            header.machine);
+    return false;
+  }
+  std::vector<Memory::Range> ranges;
+  size_t pos = sizeof(header);
+  while (true) {
+    SnapshotRecord record;
+    if (size_ - pos < sizeof(record)) {
+      return false;
+    }
+    memcpy(&record, addr_ + pos, sizeof(record));
+    pos += sizeof(record);
+    if (record.size > size_ - pos) {
+      return false;
+    }
+    const char* p = addr_ + pos;
+    pos += std::min<uint64_t>(Align8(record.size), size_ - pos);
+    if (record.type == SNAPSHOT_END) {
+      break;
+    } else if (record.type == SNAPSHOT_THREAD) {
+      SnapshotThread t;
+      if (record.size < sizeof(t)) {
+        return false;
+      }
+      memcpy(&t, p, sizeof(t));
+      Thread thread;
+      thread.tid = t.tid;
+      thread.signo = t.signo;
+      for (int i = 0; i < UNWIND_MAX_REGS; ++i) {
+        thread.regs[i] = t.regs[i];
+      }
+      threads_.push_back(thread);
+      Memory::Range range;
+      range.start = t.stack_start;
+      range.size = record.size - sizeof(t);
+      range.data = p + sizeof(t);
+      ranges.push_back(range);
+    } else if (record.type == SNAPSHOT_MODULE) {
+      Module module;
+      if (record.size < sizeof(module.module)) {
+        return false;
+      }
+      memcpy(&module.module, p, sizeof(module.module));
+      if (sizeof(module.module) + module.module.build_id_size + module.module.name_size >
+          record.size) {
+        return false;
+      }
+      p += sizeof(module.module);
+      module.build_id.assign(p, module.module.build_id_size);
+      p += module.module.build_id_size;
+      module.name.assign(p, module.module.name_size);
+      modules_.push_back(std::move(module));
+    } else if (record.type == SNAPSHOT_REGION) {
+      SnapshotRegion region;
+      if (record.size < sizeof(region)) {
+        return false;
+      }
+      memcpy(&region, p, sizeof(region));
+      Memory::Range range;
+      range.start = region.start;
+      range.size = record.size - sizeof(region);
+      range.data = p + sizeof(region);
+      ranges.push_back(range);
+    }
+  }
+  memory_.reset(new Memory(std::move(ranges)));
+  return true;
+}
+
+std::string Snapshot::FindModule(const Module& module, const std::string& symbol_dir) {
+  std::vector<std::string> candidates;
+  if (!symbol_dir.empty()) {
+    if (!module.build_id.empty()) {
+      std::string hex;
+      for (unsigned char c : module.build_id) {
+        char buf[3];
+        snprintf(buf, sizeof(buf), "%02x", c);
+        hex += buf;
+      }
+      candidates.push_back(symbol_dir + "/.build-id/" + hex.substr(0, 2) + "/" + hex.substr(2));
+    }
+    size_t slash = module.name.rfind('/');
+    candidates.push_back(symbol_dir + "/" +
+                         (slash == std::string::npos ? module.name : module.name.substr(slash + 1)));
+  }
+  candidates.push_back(module.name);
+  for (auto& path : candidates) {
+    if (access(path.c_str(), R_OK) != 0) {
+      continue;
+    }
+    ElfReader* reader = ElfReaderManager::OpenElf(path);
+    if (reader != nullptr && reader->GetBuildId() == module.build_id) {
+      return path;
+    }
+  }
+  return std::string();
+}
+
+bool Snapshot::UnwindThread(const Thread& thread, std::vector<UnwindFrame>* frames) {
+  UnwindOptions options;
+  options.maps = &maps_;
+  options.memory = memory_.get();
+  return UnwindFromSignalContext(thread.regs, options, frames);
+}
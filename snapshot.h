@@ -0,0 +1,154 @@
+#ifndef _UNWIND_SNAPSHOT_H_
+#define _UNWIND_SNAPSHOT_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "map.h"
+#include "unwind.h"
+
+// A snapshot is a small alternative to a core file: registers and the top of
+// the stack of each thread, the executable maps with build ids, and optional
+// memory ranges. It is a SnapshotHeader followed by records, each a
+// SnapshotRecord and size bytes of payload padded to 8 bytes, ended by a
+// SNAPSHOT_END record:
+//   SNAPSHOT_THREAD: SnapshotThread, then the stack bytes from sp.
+//   SNAPSHOT_MODULE: SnapshotModule, then the build id and the dso path.
+//   SNAPSHOT_REGION: SnapshotRegion, then the bytes.
+static constexpr uint32_t SNAPSHOT_MAGIC = 0x53535755;  // "UWSS"
+static constexpr uint32_t SNAPSHOT_VERSION = 2;
+
+enum SnapshotRecordType : uint32_t {
+  SNAPSHOT_END = 0,
+  SNAPSHOT_THREAD = 1,
+  SNAPSHOT_MODULE = 2,
+  SNAPSHOT_REGION = 3,
+};
+
+struct SnapshotHeader {
+  uint32_t magic;
+  uint32_t version;
+  // e_machine of the process.
+  uint16_t machine;
+  uint16_t word_size;
+  int32_t pid;
+};
+
+struct SnapshotRecord {
+  uint32_t type;
+  uint32_t reserved;
+  uint64_t size;
+};
+
+struct SnapshotThread {
+  int32_t tid;
+  int32_t signo;
+  // In the layout of GetRegsFromUcontext(), extended to 64 bits.
+  uint64_t regs[UNWIND_MAX_REGS];
+  uint64_t stack_start;
+};
+
+struct SnapshotModule {
+  uint64_t start;
+  uint64_t end;
+  // The load bias is start - min_vaddr.
+  uint64_t min_vaddr;
+  uint16_t build_id_size;
+  uint16_t name_size;
+  uint32_t reserved;
+};
+
+struct SnapshotRegion {
+  uint64_t start;
+};
+
+// Writes a snapshot in one pass, using only write() and process_vm_readv(),
+// so it can be used in signal handlers. Memory is copied through buf, whose
+// size limits each stack or region. Unreadable memory ends the copy instead of
+// faulting.
+class SnapshotWriter {
+ public:
+  SnapshotWriter(int fd, char* buf, size_t buf_size)
+      : fd_(fd), buf_(buf), buf_size_(buf_size), failed_(false) {
+  }
+
+  bool WriteHeader();
+  // Copy stack_bytes of stack from the sp in regs, converted from a signal
+  // context by GetRegsFromUcontext().
+  bool WriteThread(int tid, int signo, const uintptr_t* regs, size_t stack_bytes);
+  // Write the maps with loaded dso readers, so build ids are known.
+  bool WriteModules(MapTree* maps);
+  bool WriteRegion(uint64_t start, size_t size);
+  bool Finish();
+
+ private:
+  bool WriteRecord(uint32_t type, const void* head, size_t head_size, const void* data1,
+                   size_t size1, const void* data2, size_t size2);
+  bool Write(const void* data, size_t size);
+  size_t CopyMemory(uint64_t start, size_t size);
+
+  int fd_;
+  char* buf_;
+  size_t buf_size_;
+  bool failed_;
+};
+
+// Reads a mapped snapshot for offline unwinding. Dsos are looked up in the
+// symbol store by build id first (<dir>/.build-id/xx/yyyy), then by file name
+// (<dir>/<basename>), then by the original path, and only used if their build
+// ids match.
+class Snapshot {
+ public:
+  struct Thread {
+    int tid;
+    int signo;
+    uintptr_t regs[UNWIND_MAX_REGS];
+  };
+
+  struct Module {
+    SnapshotModule module;
+    std::string build_id;
+    std::string name;
+    // The file found for the module, empty if none is found.
+    std::string local_path;
+  };
+
+  static std::unique_ptr<Snapshot> Open(const char* filename, const std::string& symbol_dir);
+
+  ~Snapshot();
+
+  const std::vector<Thread>& GetThreads() const {
+    return threads_;
+  }
+
+  const std::vector<Module>& GetModules() const {
+    return modules_;
+  }
+
+  MapTree* GetMaps() {
+    return &maps_;
+  }
+
+  bool UnwindThread(const Thread& thread, std::vector<UnwindFrame>* frames);
+
+ private:
+  class Memory;
+
+  Snapshot();
+
+  bool Parse();
+  std::string FindModule(const Module& module, const std::string& symbol_dir);
+
+  const char* addr_;
+  size_t size_;
+  std::vector<Thread> threads_;
+  std::vector<Module> modules_;
+  MapTree maps_;
+  std::unique_ptr<Memory> memory_;
+};
+
+#endif  // _UNWIND_SNAPSHOT_H_
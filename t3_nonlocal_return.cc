@@ -0,0 +1,42 @@
+// Test if nonlocal_return() runs the cleanups longjmp skips in t1_longjmp.cc.
+
+#include <stdio.h>
+
+#include "nonlocal_return.h"
+
+NonlocalTarget* target;
+
+class D {
+  public:
+    D() {
+      printf("D()\n");
+    }
+    ~D() {
+      printf("~D()\n");
+    }
+};
+
+void second() {
+  printf("second\n");
+  D d;
+  ScopedCleanup cleanup(RunDestructor<D>, &d);
+  nonlocal_return(target, 1);
+}
+
+void first() {
+  printf("first\n");
+  D d;
+  ScopedCleanup cleanup(RunDestructor<D>, &d);
+  second();
+}
+
+int main() {
+  NonlocalTarget t;
+  target = &t;
+  if (!setjmp(t.env)) {
+    first();
+  } else {
+    printf("main\n");
+  }
+  return 0;
+}
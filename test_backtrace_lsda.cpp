@@ -0,0 +1,60 @@
+// Test _Unwind_GetLanguageSpecificData() of libbacktrace_interposer.so
+// returns the lsda of a frame with a cleanup, like libgcc's does.
+// `test_backtrace_lsda <dir>` takes unwind tables from shared indexes in dir
+// (see shared_index.h), published by the first run with dir.
+
+#include <stdint.h>
+#include <stdio.h>
+
+#include <unwind.h>
+
+#include "shared_index.h"
+
+static volatile int destroyed;
+
+struct D {
+  ~D() {
+    destroyed++;
+  }
+};
+
+struct TraceState {
+  uintptr_t func_start;
+  bool found;
+  void* lsda;
+};
+
+static _Unwind_Reason_Code Trace(struct _Unwind_Context* context, void* arg) {
+  TraceState* state = static_cast<TraceState*>(arg);
+  if (_Unwind_GetRegionStart(context) != state->func_start) {
+    return _URC_NO_REASON;
+  }
+  state->found = true;
+  state->lsda = _Unwind_GetLanguageSpecificData(context);
+  return _URC_END_OF_STACK;
+}
+
+__attribute__((noinline)) static void* GetOwnLsda(bool* found) {
+  D d;
+  TraceState state;
+  state.func_start = reinterpret_cast<uintptr_t>(GetOwnLsda);
+  state.found = false;
+  state.lsda = nullptr;
+  _Unwind_Backtrace(Trace, &state);
+  *found = state.found;
+  return state.lsda;
+}
+
+int main(int argc, char** argv) {
+  if (argc > 1) {
+    SharedIndex::SetDir(argv[1]);
+  }
+  bool found;
+  void* lsda = GetOwnLsda(&found);
+  if (!found || lsda == nullptr) {
+    fprintf(stderr, "FAIL: frame %s, lsda %p\n", found ? "found" : "missing", lsda);
+    return 1;
+  }
+  printf("PASS: lsda of a frame with a cleanup is %p\n", lsda);
+  return 0;
+}
@@ -0,0 +1,153 @@
+// Test the crash handler reports the pc a thread crashed at as its top frame.
+// The child crashes at the first instruction of CrashAtEntry(), so a pc
+// adjusted like a return address would fall in the function before it. The
+// parent reads the report and checks the top frames. A second child has a
+// SIGSEGV handler installed before, which the crash handler chains to.
+
+#include <inttypes.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include <vector>
+
+#include "crash_handler.h"
+
+extern "C" void CrashAtEntry(int* p);
+
+#if defined(__x86_64__) || defined(__i386__)
+__asm__(
+    ".text\n"
+    ".globl CrashAtEntry\n"
+    ".type CrashAtEntry, @function\n"
+    "CrashAtEntry:\n"
+    ".cfi_startproc\n"
+#if defined(__x86_64__)
+    "movl $1, (%rdi)\n"
+#else
+    "movl 4(%esp), %eax\n"
+    "movl $1, (%eax)\n"
+#endif
+    "ret\n"
+    ".cfi_endproc\n"
+    ".size CrashAtEntry, .-CrashAtEntry\n");
+#elif defined(__aarch64__)
+__asm__(
+    ".text\n"
+    ".globl CrashAtEntry\n"
+    ".type CrashAtEntry, %function\n"
+    "CrashAtEntry:\n"
+    ".cfi_startproc\n"
+    "str wzr, [x0]\n"
+    "ret\n"
+    ".cfi_endproc\n"
+    ".size CrashAtEntry, .-CrashAtEntry\n");
+#elif defined(__arm__)
+__asm__(
+    ".text\n"
+    ".globl CrashAtEntry\n"
+    ".type CrashAtEntry, %function\n"
+    "CrashAtEntry:\n"
+    ".fnstart\n"
+    "str r0, [r0]\n"
+    "bx lr\n"
+    ".fnend\n"
+    ".size CrashAtEntry, .-CrashAtEntry\n");
+#endif
+
+static constexpr int OLD_HANDLER_EXIT_CODE = 42;
+
+static void OldSegvHandler(int) {
+  _exit(OLD_HANDLER_EXIT_CODE);
+}
+
+__attribute__((noinline)) void CallCrash(int* p) {
+  CrashAtEntry(p);
+  __asm__ __volatile__("");
+}
+
+static bool ReadReport(const char* path, CrashReportHeader* header, std::vector<uint64_t>* pcs) {
+  FILE* fp = fopen(path, "rb");
+  if (fp == nullptr) {
+    fprintf(stderr, "no crash report %s\n", path);
+    return false;
+  }
+  bool found = false;
+  if (fread(header, sizeof(*header), 1, fp) == 1 && header->magic == CRASH_REPORT_MAGIC) {
+    for (uint32_t i = 0; i < header->thread_count && !found; ++i) {
+      CrashReportThread thread;
+      if (fread(&thread, sizeof(thread), 1, fp) != 1) {
+        break;
+      }
+      pcs->resize(thread.frame_count);
+      if (fread(pcs->data(), sizeof(uint64_t), thread.frame_count, fp) != thread.frame_count) {
+        break;
+      }
+      found = thread.tid == header->crash_tid;
+    }
+  }
+  fclose(fp);
+  return found;
+}
+
+// Crash a child and read its report. Return false if the child didn't end as
+// expected.
+static bool RunChild(const char* path, bool chain, CrashReportHeader* header,
+                     std::vector<uint64_t>* pcs) {
+  pid_t pid = fork();
+  if (pid == 0) {
+    if (chain) {
+      signal(SIGSEGV, OldSegvHandler);
+    }
+    if (!InstallCrashHandler(path)) {
+      _exit(2);
+    }
+    CallCrash(nullptr);
+    _exit(3);
+  }
+  int status;
+  waitpid(pid, &status, 0);
+  bool read = ReadReport(path, header, pcs);
+  bool ended = chain ? (WIFEXITED(status) && WEXITSTATUS(status) == OLD_HANDLER_EXIT_CODE)
+                     : (WIFSIGNALED(status) && WTERMSIG(status) == SIGSEGV);
+  if (!ended || !read) {
+    fprintf(stderr, "FAIL: child status 0x%x, report %s\n", status, read ? "read" : "missing");
+    return false;
+  }
+  return true;
+}
+
+int main() {
+  char path[] = "/tmp/test_crash_handler_XXXXXX";
+  int fd = mkstemp(path);
+  if (fd == -1) {
+    perror("mkstemp");
+    return 1;
+  }
+  close(fd);
+  CrashReportHeader header;
+  std::vector<uint64_t> pcs;
+  std::vector<uint64_t> chained_pcs;
+  bool ok = RunChild(path, false, &header, &pcs) && RunChild(path, true, &header, &chained_pcs);
+  unlink(path);
+  if (!ok) {
+    return 1;
+  }
+  uint64_t entry = reinterpret_cast<uintptr_t>(CrashAtEntry);
+  uint64_t caller = reinterpret_cast<uintptr_t>(CallCrash);
+  // The caller frame holds a return address inside CallCrash().
+  if (pcs.size() < 2 || pcs[0] != entry || pcs[1] <= caller || pcs[1] > caller + 64) {
+    fprintf(stderr, "FAIL: top frames 0x%" PRIx64 " 0x%" PRIx64 ", CrashAtEntry 0x%" PRIx64
+            ", CallCrash 0x%" PRIx64 "\n", pcs.empty() ? 0 : pcs[0],
+            pcs.size() < 2 ? 0 : pcs[1], entry, caller);
+    return 1;
+  }
+  if (chained_pcs.empty() || chained_pcs[0] != entry) {
+    fprintf(stderr, "FAIL: no report before chaining to the old handler\n");
+    return 1;
+  }
+  printf("PASS: top frame is CrashAtEntry, %zu frames, old handler called\n", pcs.size());
+  return 0;
+}
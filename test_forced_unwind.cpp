@@ -0,0 +1,108 @@
+// Test cleanups of a forced unwind run in stack order when eh_unwind.cpp
+// runs them: pthread_exit() passes a C++ frame, a C frame with a
+// pthread_cleanup_push() handler, and another C++ frame. The C handler is run
+// by the stop function of the unwind, not by a landing pad, so the plan of
+// the project's unwinder must not pass its frame.
+//
+// `test_forced_unwind <dir>` takes unwind tables from shared indexes in dir
+// (see shared_index.h), published by the first run with dir. Either way,
+// EhUnwind() has to report the lsda and personality routine of a frame with
+// a cleanup, or the unwind would be left to libgcc unnoticed.
+
+#include <pthread.h>
+#include <stdio.h>
+#include <string.h>
+
+#include <atomic>
+
+#include "eh_unwind.h"
+#include "prewarm.h"
+#include "shared_index.h"
+
+static constexpr int MAX_EVENTS = 8;
+static const char* events[MAX_EVENTS];
+static std::atomic<int> event_count(0);
+
+extern "C" void RecordEvent(const char* event) {
+  int i = event_count++;
+  if (i < MAX_EVENTS) {
+    events[i] = event;
+  }
+}
+
+extern "C" void CallWithCleanup();
+
+struct D {
+  explicit D(const char* name) : name(name) {
+  }
+  ~D() {
+    RecordEvent(name);
+  }
+  const char* name;
+};
+
+extern "C" __attribute__((noinline)) void CallInner() {
+  D d("~D inner");
+  pthread_exit(nullptr);
+}
+
+__attribute__((noinline)) static void CallOuter() {
+  D d("~D outer");
+  CallWithCleanup();
+  __asm__ __volatile__("");
+}
+
+static void* ThreadMain(void*) {
+  CallOuter();
+  return nullptr;
+}
+
+static bool CheckFirstFrame(const EhFrame* frame, void* arg) {
+  *static_cast<bool*>(arg) = frame->lsda != 0 && frame->personality != 0;
+  return false;
+}
+
+__attribute__((noinline)) static bool HasEhInfo() {
+  D d("~D eh info");
+  bool result = false;
+  EhUnwind(CheckFirstFrame, &result);
+  return result;
+}
+
+int main(int argc, char** argv) {
+  if (argc > 1) {
+    SharedIndex::SetDir(argv[1]);
+  }
+  // Load unwind tables first, so the unwind isn't left to libgcc for want of
+  // them.
+  Prewarm(nullptr);
+  BackgroundLoader::GetInstance().Wait();
+  if (!HasEhInfo()) {
+    fprintf(stderr, "FAIL: EhUnwind() reports no lsda for a frame with a cleanup\n");
+    return 1;
+  }
+  static const char* expected[] = {"~D inner", "C cleanup handler", "~D outer", "joined"};
+  int expected_count = sizeof(expected) / sizeof(expected[0]);
+  // The second run has the frame rules cached.
+  for (int run = 0; run < 2; ++run) {
+    event_count = 0;
+    pthread_t thread;
+    pthread_create(&thread, nullptr, ThreadMain, nullptr);
+    pthread_join(thread, nullptr);
+    RecordEvent("joined");
+    bool ok = event_count == expected_count;
+    for (int i = 0; ok && i < expected_count; ++i) {
+      ok = strcmp(events[i], expected[i]) == 0;
+    }
+    if (!ok) {
+      fprintf(stderr, "FAIL: run %d:", run);
+      for (int i = 0; i < event_count && i < MAX_EVENTS; ++i) {
+        fprintf(stderr, " %s,", events[i]);
+      }
+      fprintf(stderr, "\n");
+      return 1;
+    }
+  }
+  printf("PASS: cleanups ran in stack order\n");
+  return 0;
+}
@@ -0,0 +1,17 @@
+// A C frame between C++ frames, with a cleanup handler run by the stop
+// function of a forced unwind rather than by a landing pad.
+
+#include <pthread.h>
+
+void RecordEvent(const char* event);
+void CallInner(void);
+
+static void CleanupHandler(void* arg) {
+  RecordEvent((const char*)arg);
+}
+
+void CallWithCleanup(void) {
+  pthread_cleanup_push(CleanupHandler, (void*)"C cleanup handler");
+  CallInner();
+  pthread_cleanup_pop(0);
+}
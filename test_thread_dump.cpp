@@ -0,0 +1,99 @@
+// Test DumpAllThreads() reports the pc a stopped thread was interrupted at as
+// its top frame. The other thread spins on the first instruction of
+// SpinAtEntry(), so a pc adjusted like a return address would fall in the
+// function before it. The dumping thread's own stack starts in this file.
+
+#include <inttypes.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include <atomic>
+#include <vector>
+
+#include "thread_dump.h"
+
+extern "C" void SpinAtEntry();
+
+#if defined(__x86_64__) || defined(__i386__)
+__asm__(
+    ".text\n"
+    ".globl SpinAtEntry\n"
+    ".type SpinAtEntry, @function\n"
+    "SpinAtEntry:\n"
+    ".cfi_startproc\n"
+    "jmp SpinAtEntry\n"
+    ".cfi_endproc\n"
+    ".size SpinAtEntry, .-SpinAtEntry\n");
+#elif defined(__aarch64__) || defined(__arm__)
+__asm__(
+    ".text\n"
+    ".globl SpinAtEntry\n"
+    ".type SpinAtEntry, %function\n"
+    "SpinAtEntry:\n"
+    ".cfi_startproc\n"
+    "b SpinAtEntry\n"
+    ".cfi_endproc\n"
+    ".size SpinAtEntry, .-SpinAtEntry\n");
+#endif
+
+static std::atomic<int> spin_tid(0);
+
+static void* SpinThread(void*) {
+  spin_tid = syscall(SYS_gettid);
+  SpinAtEntry();
+  return nullptr;
+}
+
+int main() {
+  pthread_t thread;
+  pthread_create(&thread, nullptr, SpinThread, nullptr);
+  while (spin_tid == 0) {
+    usleep(1000);
+  }
+  // Let the thread get into SpinAtEntry().
+  usleep(10000);
+  int self = syscall(SYS_gettid);
+  std::vector<ThreadStackGroup> groups;
+  if (!DumpAllThreads(ThreadDumpOptions(), &groups)) {
+    fprintf(stderr, "FAIL: DumpAllThreads failed\n");
+    return 1;
+  }
+  uint64_t entry = reinterpret_cast<uintptr_t>(SpinAtEntry);
+  uint64_t main_start = reinterpret_cast<uintptr_t>(main);
+  bool spin_found = false;
+  bool self_found = false;
+  for (auto& group : groups) {
+    for (int tid : group.tids) {
+      uint64_t pc = group.pcs.empty() ? 0 : group.pcs[0];
+      if (tid == spin_tid) {
+        spin_found = true;
+        if (pc != entry) {
+          fprintf(stderr, "FAIL: top frame 0x%" PRIx64 ", SpinAtEntry 0x%" PRIx64 "\n", pc,
+                  entry);
+          return 1;
+        }
+      } else if (tid == self) {
+        self_found = true;
+        // The dumping thread has DumpAllThreads() or its callees on top, and
+        // main() below it.
+        bool main_found = false;
+        for (uint64_t caller_pc : group.pcs) {
+          main_found |= caller_pc > main_start && caller_pc < main_start + 4096;
+        }
+        if (!main_found) {
+          fprintf(stderr, "FAIL: main() isn't in the stack of the dumping thread\n");
+          return 1;
+        }
+      }
+    }
+  }
+  if (!spin_found || !self_found) {
+    fprintf(stderr, "FAIL: spinning thread %s, dumping thread %s\n",
+            spin_found ? "found" : "missing", self_found ? "found" : "missing");
+    return 1;
+  }
+  printf("PASS: top frame of the stopped thread is SpinAtEntry, %zu groups\n", groups.size());
+  return 0;
+}
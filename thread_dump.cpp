@@ -0,0 +1,306 @@
+#include "thread_dump.h"
+
+#include <dirent.h>
+#include <errno.h>
+#include <linux/futex.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+#include <map>
+#include <mutex>
+#include <thread>
+
+#include "get_current_regs.h"
+#include "map.h"
+#include "unwind.h"
+
+enum SlotState : int {
+  // The thread is sent the signal.
+  SLOT_SIGNALED,
+  // The handler has saved registers, and waits to be released.
+  SLOT_CAPTURED,
+  SLOT_RELEASED,
+  // The thread didn't answer in time, a late handler returns at once.
+  SLOT_TIMEOUT,
+};
+
+struct DumpSlot {
+  std::atomic<int> state;
+  // A worker waits for the state to change, so it needs a wakeup.
+  std::atomic<bool> waited;
+  int tid;
+  uintptr_t regs[UNWIND_MAX_REGS];
+};
+
+// Slots are reached from handlers through the signal value, and may be read
+// by handlers running late, so they are never freed, only grown.
+static DumpSlot* dump_slots;
+static size_t dump_slot_count;
+static std::mutex& dump_mutex = *new std::mutex;
+static int dump_signo;
+
+static uint64_t GetTimeInNs() {
+  timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return static_cast<uint64_t>(ts.tv_sec) * 1000000000 + ts.tv_nsec;
+}
+
+static void FutexWait(std::atomic<int>* addr, int value, uint64_t timeout_ns) {
+  timespec ts;
+  ts.tv_sec = timeout_ns / 1000000000;
+  ts.tv_nsec = timeout_ns % 1000000000;
+  syscall(SYS_futex, reinterpret_cast<int*>(addr), FUTEX_WAIT_PRIVATE, value,
+          (timeout_ns != 0) ? &ts : nullptr, nullptr, 0);
+}
+
+static void FutexWake(std::atomic<int>* addr) {
+  syscall(SYS_futex, reinterpret_cast<int*>(addr), FUTEX_WAKE_PRIVATE, INT32_MAX, nullptr,
+          nullptr, 0);
+}
+
+// A counter only making the futex call when someone waits, as it changes for
+// every thread dumped.
+class WaitableCounter {
+ public:
+  WaitableCounter() : value_(0), waiters_(0) {
+  }
+
+  int Get() const {
+    return value_;
+  }
+
+  void Increase() {
+    ++value_;
+    if (waiters_ != 0) {
+      FutexWake(&value_);
+    }
+  }
+
+  // Wait until pred(value) is false.
+  template <typename Pred>
+  void WaitWhile(Pred pred) {
+    int n;
+    if (!pred(n = value_)) {
+      return;
+    }
+    ++waiters_;
+    while (pred(n = value_)) {
+      FutexWait(&value_, n, 0);
+    }
+    --waiters_;
+  }
+
+ private:
+  std::atomic<int> value_;
+  std::atomic<int> waiters_;
+};
+
+static void DumpSignalHandler(int, siginfo_t* info, void* ucontext) {
+  if (info->si_code != SI_QUEUE) {
+    return;
+  }
+  DumpSlot* slot = static_cast<DumpSlot*>(info->si_value.sival_ptr);
+  int saved_errno = errno;
+  if (slot->tid == static_cast<int>(syscall(SYS_gettid))) {
+    GetRegsFromUcontext(ucontext, slot->regs);
+    int expected = SLOT_SIGNALED;
+    if (slot->state.compare_exchange_strong(expected, SLOT_CAPTURED)) {
+      if (slot->waited) {
+        FutexWake(&slot->state);
+      }
+      while (slot->state == SLOT_CAPTURED) {
+        FutexWait(&slot->state, SLOT_CAPTURED, 0);
+      }
+    }
+  }
+  errno = saved_errno;
+}
+
+static bool InstallDumpHandler(int signo) {
+  if (dump_signo == signo) {
+    return true;
+  }
+  struct sigaction sa;
+  memset(&sa, 0, sizeof(sa));
+  sigemptyset(&sa.sa_mask);
+  sa.sa_sigaction = DumpSignalHandler;
+  sa.sa_flags = SA_SIGINFO | SA_RESTART;
+  if (sigaction(signo, &sa, nullptr) != 0) {
+    fprintf(stderr, "failed to set handler of signal %d: %s\n", signo, strerror(errno));
+    return false;
+  }
+  dump_signo = signo;
+  return true;
+}
+
+static bool GetOtherThreads(std::vector<int>* tids) {
+  DIR* dir = opendir("/proc/self/task");
+  if (dir == nullptr) {
+    fprintf(stderr, "can't open /proc/self/task: %s\n", strerror(errno));
+    return false;
+  }
+  int self = syscall(SYS_gettid);
+  dirent* entry;
+  while ((entry = readdir(dir)) != nullptr) {
+    int tid = atoi(entry->d_name);
+    if (tid > 0 && tid != self) {
+      tids->push_back(tid);
+    }
+  }
+  closedir(dir);
+  return true;
+}
+
+// Unwind from regs into pcs without locks or memory allocation, as stopped
+// threads may hold them. Return the frame count. Regs are from a signal
+// context if from_signal is true, otherwise from GET_CURRENT_REGS().
+static int UnwindToPcs(const void* regs, bool from_signal, int max_frames, uint64_t* pcs,
+                       uint16_t* flags) {
+  UnwindOptions options;
+  options.signal_safe = true;
+  UnwindCursor cursor(options);
+  if (from_signal) {
+    cursor.InitFromSignalContext(regs);
+  } else {
+    cursor.Init(regs);
+  }
+  int count = 0;
+  while (count < max_frames) {
+    pcs[count++] = cursor.GetPc();
+    if (!cursor.Step()) {
+      break;
+    }
+  }
+  *flags = (cursor.Finished() ? THREAD_DUMP_FINISHED : 0) |
+      (cursor.IsUnresolved() ? THREAD_DUMP_UNRESOLVED : 0);
+  return count;
+}
+
+bool DumpAllThreads(const ThreadDumpOptions& options, std::vector<ThreadStackGroup>* groups) {
+  std::lock_guard<std::mutex> lock(dump_mutex);
+  groups->clear();
+  if (!InstallDumpHandler(options.signo)) {
+    return false;
+  }
+  std::vector<int> tids;
+  if (!GetOtherThreads(&tids)) {
+    return false;
+  }
+  // Everything needing locks or memory allocation is done before stopping
+  // threads. The maps are read again for dsos loaded since, but kept if
+  // nothing changed.
+  ProcessMapsGuard maps_guard;
+  MapTree* maps = MapTree::RefreshProcessMaps(MapTree::GetProcessMaps());
+  maps->LoadUnwindSections();
+  size_t thread_count = tids.size() + 1;
+  int max_frames = options.max_frames;
+  std::vector<uint64_t> pcs(thread_count * max_frames);
+  std::vector<int> frame_counts(thread_count, 0);
+  std::vector<uint16_t> flags(thread_count, 0);
+  if (dump_slot_count < tids.size()) {
+    dump_slots = new DumpSlot[tids.size()];
+    dump_slot_count = tids.size();
+  }
+  int worker_count = options.workers;
+  if (worker_count <= 0) {
+    worker_count = std::max(1u, std::thread::hardware_concurrency());
+  }
+  int wave_size = std::max(1, options.wave_size);
+
+  // The current thread is the last one.
+  uintptr_t regs[UNWIND_MAX_REGS];
+  GET_CURRENT_REGS(regs);
+  frame_counts[tids.size()] =
+      UnwindToPcs(regs, false, max_frames, &pcs[tids.size() * max_frames], &flags[tids.size()]);
+
+  // Threads are signaled in order, with at most wave_size of them signaled
+  // but not yet released. Workers take them in the same order.
+  pid_t pid = getpid();
+  uid_t uid = getuid();
+  int total = tids.size();
+  std::atomic<int> next(0);
+  WaitableCounter signaled;
+  WaitableCounter done;
+  auto work = [&]() {
+    int i;
+    while ((i = next++) < total) {
+      signaled.WaitWhile([i](int n) { return n <= i; });
+      DumpSlot& slot = dump_slots[i];
+      uint64_t deadline = GetTimeInNs() + options.timeout_ns;
+      int state;
+      while ((state = slot.state) == SLOT_SIGNALED) {
+        uint64_t now = GetTimeInNs();
+        if (now >= deadline) {
+          if (slot.state.compare_exchange_strong(state, SLOT_TIMEOUT)) {
+            flags[i] = THREAD_DUMP_TIMEOUT;
+          }
+          break;
+        }
+        slot.waited = true;
+        FutexWait(&slot.state, SLOT_SIGNALED, deadline - now);
+      }
+      if (slot.state == SLOT_CAPTURED) {
+        frame_counts[i] =
+            UnwindToPcs(slot.regs, true, max_frames, &pcs[i * max_frames], &flags[i]);
+        slot.state = SLOT_RELEASED;
+        FutexWake(&slot.state);
+      }
+      done.Increase();
+    }
+  };
+  std::vector<std::thread> workers;
+  for (int i = 0; i < worker_count && i < total; ++i) {
+    workers.emplace_back(work);
+  }
+  for (int i = 0; i < total; ++i) {
+    done.WaitWhile([i, wave_size](int n) { return i - n >= wave_size; });
+    DumpSlot& slot = dump_slots[i];
+    slot.tid = tids[i];
+    slot.waited = false;
+    slot.state = SLOT_SIGNALED;
+    siginfo_t info;
+    memset(&info, 0, sizeof(info));
+    info.si_signo = options.signo;
+    info.si_code = SI_QUEUE;
+    info.si_pid = pid;
+    info.si_uid = uid;
+    info.si_value.sival_ptr = &slot;
+    if (syscall(SYS_rt_tgsigqueueinfo, pid, tids[i], options.signo, &info) != 0) {
+      // The thread has exited.
+      slot.state = SLOT_RELEASED;
+    }
+    signaled.Increase();
+  }
+  for (auto& worker : workers) {
+    worker.join();
+  }
+
+  // Threads exited before being signaled have no frames and no flags.
+  tids.push_back(syscall(SYS_gettid));
+  std::map<std::pair<std::vector<uint64_t>, uint16_t>, size_t> group_map;
+  for (size_t i = 0; i < thread_count; ++i) {
+    if (frame_counts[i] == 0 && flags[i] == 0) {
+      continue;
+    }
+    std::vector<uint64_t> stack(&pcs[i * max_frames], &pcs[i * max_frames] + frame_counts[i]);
+    auto it = group_map.emplace(std::make_pair(std::move(stack), flags[i]), groups->size()).first;
+    if (it->second == groups->size()) {
+      ThreadStackGroup group;
+      group.pcs = it->first.first;
+      group.flags = flags[i];
+      groups->push_back(std::move(group));
+    }
+    (*groups)[it->second].tids.push_back(tids[i]);
+  }
+  std::stable_sort(groups->begin(), groups->end(),
+                   [](const ThreadStackGroup& a, const ThreadStackGroup& b) {
+                     return a.tids.size() > b.tids.size();
+                   });
+  return true;
+}
@@ -0,0 +1,50 @@
+#ifndef _UNWIND_THREAD_DUMP_H_
+#define _UNWIND_THREAD_DUMP_H_
+
+#include <signal.h>
+#include <stdint.h>
+
+#include <vector>
+
+struct ThreadDumpOptions {
+  // Signal used to stop threads, a handler is installed on first use.
+  int signo;
+  // Threads unwinding stopped threads, 0 means one per cpu.
+  int workers;
+  // Max threads stopped at the same time.
+  int wave_size;
+  // Time to wait for a thread to answer the signal.
+  uint64_t timeout_ns;
+  // Frames kept per thread.
+  int max_frames;
+
+  ThreadDumpOptions() : signo(SIGRTMIN + 4), workers(0), wave_size(256),
+      timeout_ns(100000000), max_frames(64) {
+  }
+};
+
+// Flags of ThreadStackGroup.
+static constexpr uint16_t THREAD_DUMP_FINISHED = 1;
+static constexpr uint16_t THREAD_DUMP_UNRESOLVED = 2;
+// The threads didn't answer the signal in time, they have no frames.
+static constexpr uint16_t THREAD_DUMP_TIMEOUT = 4;
+
+// Threads with the same stack.
+struct ThreadStackGroup {
+  std::vector<uint64_t> pcs;
+  uint16_t flags;
+  std::vector<int> tids;
+};
+
+// Get stacks of all threads of the current process, grouped by identical
+// stacks, with the biggest group first.
+//
+// Threads are signaled in waves, with at most wave_size of them stopped at a
+// time. The signal handler only saves the registers and parks the thread,
+// while a pool of worker threads unwinds the parked threads from their live
+// stacks and releases them. Unwind tables of all maps are loaded before any
+// thread is stopped, and workers unwind in signal safe mode, so they never
+// wait for locks held by stopped threads.
+bool DumpAllThreads(const ThreadDumpOptions& options, std::vector<ThreadStackGroup>* groups);
+
+#endif  // _UNWIND_THREAD_DUMP_H_
@@ -3,11 +3,20 @@
 #include <inttypes.h>
 #include <limits.h>
 #include <stdio.h>
+#include <string.h>
+#include <sys/uio.h>
+#include <time.h>
+#include <ucontext.h>
+#include <unistd.h>
+
+#include <atomic>
 
 #include "dwarf_regmap.h"
 #include "dwarf_string.h"
 #include "elf_reader.h"
+#include "get_current_regs.h"
 #include "map.h"
+#include "prewarm.h"
 #include "read_utils.h"
 
 #undef DEBUG_UNWIND
@@ -19,7 +28,20 @@
 #define D(format...)
 #endif
 
-static constexpr int MAX_REGS = 32;
+// stdio isn't async signal safe, so errors aren't printed in signal safe mode.
+#define LOG_ERROR(signal_safe, format, ...)     \
+  do {                                          \
+    if (!(signal_safe)) {                       \
+      fprintf(stderr, format, ##__VA_ARGS__);   \
+    }                                           \
+  } while (0)
+
+static constexpr int MAX_REGS = 33;
+// Max nesting of DW_CFA_remember_state.
+static constexpr int MAX_CFA_STATES = 4;
+static constexpr int FRAME_RULE_CACHE_SIZE = 1024;
+// Max registers saved in memory by a frame in the frame rule cache.
+static constexpr int FRAME_RULE_MAX_OFFSETS = 16;
 
 enum class RegStateType {
   UNDEFINED,
@@ -70,25 +92,49 @@ struct RegValue {
   }
 };
 
+// The rules of a frame found by running cfa instructions up to pc. Only
+// rules Execute() supports are kept: cfa is a register plus an offset, and
+// each register is undefined, the same value, or saved at cfa plus an offset.
+struct FrameRule {
+  // The pc looked up, one less than the return address in caller frames.
+  uint64_t pc;
+  // Rules are only used with the maps they are found with, as dsos may be
+  // moved when maps are read again.
+  uint64_t maps_id;
+  Fde* fde;
+  uint64_t load_bias;
+  uint32_t module_id;
+  int cfa_regno;
+  uint64_t cfa_offset;
+  uint32_t same_value_regs;
+  int address_size;
+  int offset_count;
+  uint8_t offset_regs[FRAME_RULE_MAX_OFFSETS];
+  uint64_t offsets[FRAME_RULE_MAX_OFFSETS];
+};
+
 template <typename word_t>
 class CFAExecutor {
  public:
-  CFAExecutor(int sp_regno, const std::vector<int>& callee_save_regs)
-      : sp_regno_(sp_regno), callee_save_regs_(callee_save_regs) {
+  CFAExecutor(int sp_regno, const std::vector<int>& callee_save_regs, UnwindMemory* memory,
+              bool signal_safe)
+      : sp_regno_(sp_regno), callee_save_regs_(callee_save_regs), memory_(memory),
+        signal_safe_(signal_safe) {
   }
 
-  void Init(Fde* fde, word_t stop_loc) {
+  bool Init(Fde* fde, word_t stop_loc) {
     fde_ = fde;
     cie_ = fde->cie;
     if (fde_->section64 != cie_->section64) {
-      fprintf(stderr, "fde section64 != cie section64\n");
-      abort();
+      LOG_ERROR(signal_safe_, "fde section64 != cie section64\n");
+      return false;
     }
     section64_ = cie_->section64;
     stop_loc_ = stop_loc;
     current_loc_ = fde_->func_start;
     cfa_.regno = -1;
     cfa_.offset = (sizeof(word_t) == 4) ? UINT_MAX : ULLONG_MAX;
+    state_count_ = 0;
     for (int i = 0; i < MAX_REGS; ++i) {
       regs_[i].type = RegStateType::UNDEFINED;
     }
@@ -97,14 +143,19 @@ class CFAExecutor {
     }
     D("CFAExecutor, fde [0x%" PRIx64 "-0x%" PRIx64 "], stop_loc 0x%" PRIx64 "\n",
       fde_->func_start, fde_->func_end, static_cast<uint64_t>(stop_loc_));
+    return true;
   }
 
   bool Execute(const RegValue<word_t> old_regs[], RegValue<word_t> new_regs[]);
-  bool ExecuteInstructions(const std::vector<char>& insts);
+  bool ExecuteInstructions(const ByteRange& insts);
+  // Get the rules of the last Execute(), return false if they don't fit.
+  bool GetFrameRule(FrameRule* rule) const;
 
  private:
   const int sp_regno_;
   const std::vector<int>& callee_save_regs_;
+  UnwindMemory* memory_;
+  const bool signal_safe_;
   Fde* fde_;
   Cie* cie_;
   bool section64_;
@@ -112,26 +163,37 @@ class CFAExecutor {
   word_t current_loc_;
   Cfa<word_t> cfa_;
   RegState<word_t> regs_[MAX_REGS];
+  // Rules after executing cie instructions, used by DW_CFA_restore.
+  RegState<word_t> initial_regs_[MAX_REGS];
+  struct State {
+    Cfa<word_t> cfa;
+    RegState<word_t> regs[MAX_REGS];
+  };
+  State states_[MAX_CFA_STATES];
+  int state_count_;
 };
 
 template <typename word_t>
 bool CFAExecutor<word_t>::Execute(const RegValue<word_t> old_regs[], RegValue<word_t> new_regs[]) {
   D("execute cie insts\n");
   if (!ExecuteInstructions(cie_->insts)) {
-    fprintf(stderr, "execute cie instructions failed\n");
+    LOG_ERROR(signal_safe_, "execute cie instructions failed\n");
     return false;
   }
+  for (int i = 0; i < MAX_REGS; ++i) {
+    initial_regs_[i] = regs_[i];
+  }
   D("execute fde insts\n");
   if (!ExecuteInstructions(fde_->insts)) {
-    fprintf(stderr, "execute fde instructions failed\n");
+    LOG_ERROR(signal_safe_, "execute fde instructions failed\n");
     return false;
   }
   if (cfa_.regno == -1 || cfa_.offset == ULLONG_MAX) {
-    fprintf(stderr, "cfa not valid\n");
+    LOG_ERROR(signal_safe_, "cfa not valid\n");
     return false;
   }
   if (cfa_.regno >= MAX_REGS || !old_regs[cfa_.regno].valid) {
-    fprintf(stderr, "cfa needs unavailable reg %d\n", cfa_.regno);
+    LOG_ERROR(signal_safe_, "cfa needs unavailable reg %d\n", cfa_.regno);
     return false;
   }
   word_t cfa_value = old_regs[cfa_.regno].value + cfa_.offset;
@@ -151,17 +213,16 @@ bool CFAExecutor<word_t>::Execute(const RegValue<word_t> old_regs[], RegValue<wo
       }
     } else if (type == RegStateType::OFFSET_N) {
       word_t addr = cfa_value + regs_[i].offset_n.offset;
-      word_t value;
-
-      if (cie_->address_size == 4) {
-        value = *(uint32_t*)addr;
-      } else {
-        value = *(uint64_t*)addr;
+      uint64_t data = 0;
+      if (!memory_->Read(addr, &data, cie_->address_size)) {
+        LOG_ERROR(signal_safe_, "can't read memory at 0x%" PRIx64 "\n", static_cast<uint64_t>(addr));
+        return false;
       }
+      word_t value = (cie_->address_size == 4) ? static_cast<uint32_t>(data) : data;
       new_regs[i].SetValue(value);
     } else {
-      fprintf(stderr, "unexpected RegStateType %d\n", type);
-      abort();
+      LOG_ERROR(signal_safe_, "unexpected RegStateType %d\n", type);
+      return false;
     }
   }
   // cfa is the sp of the previous frame.
@@ -170,9 +231,31 @@ bool CFAExecutor<word_t>::Execute(const RegValue<word_t> old_regs[], RegValue<wo
 }
 
 template <typename word_t>
-bool CFAExecutor<word_t>::ExecuteInstructions(const std::vector<char>& insts) {
-  const char* begin = insts.data();
-  const char* end = begin + insts.size();
+bool CFAExecutor<word_t>::GetFrameRule(FrameRule* rule) const {
+  rule->cfa_regno = cfa_.regno;
+  rule->cfa_offset = cfa_.offset;
+  rule->same_value_regs = 0;
+  rule->address_size = cie_->address_size;
+  rule->offset_count = 0;
+  for (int i = 0; i < MAX_REGS; ++i) {
+    if (regs_[i].type == RegStateType::SAME_VALUE) {
+      rule->same_value_regs |= 1u << i;
+    } else if (regs_[i].type == RegStateType::OFFSET_N) {
+      if (rule->offset_count == FRAME_RULE_MAX_OFFSETS) {
+        return false;
+      }
+      rule->offset_regs[rule->offset_count] = i;
+      rule->offsets[rule->offset_count] = regs_[i].offset_n.offset;
+      rule->offset_count++;
+    }
+  }
+  return true;
+}
+
+template <typename word_t>
+bool CFAExecutor<word_t>::ExecuteInstructions(const ByteRange& insts) {
+  const char* begin = insts.begin;
+  const char* end = insts.end;
   const char* p = begin;
   while (p < end) {
     uint8_t inst = Read(p, 1);
@@ -198,7 +281,8 @@ bool CFAExecutor<word_t>::ExecuteInstructions(const std::vector<char>& insts) {
         }
       } else if (t == DW_CFA_restore) {
         uint8_t reg = inst & 0x3f;
-        abort();
+        regs_[reg] = initial_regs_[reg];
+        D("r%u = initial rule", reg);
       }
     } else {
       switch (inst) {
@@ -207,8 +291,8 @@ bool CFAExecutor<word_t>::ExecuteInstructions(const std::vector<char>& insts) {
         }
         case DW_CFA_set_loc: {
           uint64_t addr = Read(p, cie_->address_size);
-          abort();
-          break;
+          LOG_ERROR(signal_safe_, "unsupported cfa inst DW_CFA_set_loc\n");
+          return false;
         }
         case DW_CFA_advance_loc1:
         case DW_CFA_advance_loc2:
@@ -229,40 +313,76 @@ bool CFAExecutor<word_t>::ExecuteInstructions(const std::vector<char>& insts) {
           }
           break;
         }
-        case DW_CFA_offset_extended: {
+        case DW_CFA_offset_extended:
+        case DW_CFA_offset_extended_sf: {
           uint64_t reg = ReadULEB128(p);
-          uint64_t offset = ReadULEB128(p);
-          abort();
+          int64_t offset;
+          if (inst == DW_CFA_offset_extended) {
+            offset = ReadULEB128(p);
+          } else {
+            offset = ReadLEB128(p);
+          }
+          if (reg >= MAX_REGS) {
+            LOG_ERROR(signal_safe_, "unsupported reg %" PRIu64 " in cfa inst\n", reg);
+            return false;
+          }
+          int64_t add = offset * cie_->data_alignment_factor;
+          regs_[reg].SetOffsetN(add);
+          D("r%" PRIu64 " = mem(cfa + %" PRId64 ")", reg, add);
           break;
         }
         case DW_CFA_restore_extended: {
           uint64_t reg = ReadULEB128(p);
-          abort();
+          if (reg < MAX_REGS) {
+            regs_[reg] = initial_regs_[reg];
+          }
+          D("r%" PRIu64 " = initial rule", reg);
           break;
         }
         case DW_CFA_undefined: {
           uint64_t reg = ReadULEB128(p);
           D("r%" PRIu64 " = undefined", reg);
-          abort();
+          if (reg < MAX_REGS) {
+            regs_[reg].type = RegStateType::UNDEFINED;
+          }
           break;
         }
         case DW_CFA_same_value: {
           uint64_t reg = ReadULEB128(p);
-          abort();
+          D("r%" PRIu64 " = same value", reg);
+          if (reg < MAX_REGS) {
+            regs_[reg].type = RegStateType::SAME_VALUE;
+          }
           break;
         }
         case DW_CFA_register: {
           uint64_t reg1 = ReadULEB128(p);
           uint64_t reg2 = ReadULEB128(p);
-          abort();
-          break;
+          LOG_ERROR(signal_safe_, "unsupported cfa inst DW_CFA_register\n");
+          return false;
         }
         case DW_CFA_remember_state: {
-          abort();
+          if (state_count_ == MAX_CFA_STATES) {
+            LOG_ERROR(signal_safe_, "too many remembered cfa states\n");
+            return false;
+          }
+          State& state = states_[state_count_++];
+          state.cfa = cfa_;
+          for (int i = 0; i < MAX_REGS; ++i) {
+            state.regs[i] = regs_[i];
+          }
           break;
         }
         case DW_CFA_restore_state: {
-          abort();
+          if (state_count_ == 0) {
+            LOG_ERROR(signal_safe_, "no remembered cfa state to restore\n");
+            return false;
+          }
+          State& state = states_[--state_count_];
+          cfa_ = state.cfa;
+          for (int i = 0; i < MAX_REGS; ++i) {
+            regs_[i] = state.regs[i];
+          }
           break;
         }
         case DW_CFA_def_cfa: {
@@ -288,7 +408,8 @@ bool CFAExecutor<word_t>::ExecuteInstructions(const std::vector<char>& insts) {
         case DW_CFA_def_cfa_expression: {
            uint64_t len = ReadULEB128(p);
            D("cfa = TODO");
-           abort();
+           LOG_ERROR(signal_safe_, "unsupported cfa inst DW_CFA_def_cfa_expression\n");
+           return false;
            /*
            if (!ParseDwarfExpression(p, len, section64, cie->address_size)) {
              return false;
@@ -300,7 +421,8 @@ bool CFAExecutor<word_t>::ExecuteInstructions(const std::vector<char>& insts) {
         case DW_CFA_expression: {
           uint64_t reg = ReadULEB128(p);
           uint64_t len = ReadULEB128(p);
-          abort();
+          LOG_ERROR(signal_safe_, "unsupported cfa inst DW_CFA_expression\n");
+          return false;
           /*
           if (!ParseDwarfExpression(p, len, section64, cie->address_size)) {
             return false;
@@ -309,44 +431,42 @@ bool CFAExecutor<word_t>::ExecuteInstructions(const std::vector<char>& insts) {
           p += len;
           break;
         }
-        case DW_CFA_offset_extended_sf: {
-          uint64_t reg = ReadULEB128(p);
-          int64_t offset = ReadLEB128(p);
-          abort();
-          break;
-        }
         case DW_CFA_def_cfa_sf: {
           uint64_t reg = ReadULEB128(p);
           int64_t offset = ReadLEB128(p);
-          abort();
+          cfa_.regno = reg;
+          int64_t add = offset * cie_->data_alignment_factor;
+          cfa_.offset = add;
+          D("cfa = r%" PRIu64 " + off %" PRId64, reg, add);
           break;
         }
         case DW_CFA_def_cfa_offset_sf: {
           int64_t offset = ReadLEB128(p);
+          cfa_.offset = offset * cie_->data_alignment_factor;
           break;
         }
         case DW_CFA_val_offset: {
           uint64_t reg = ReadULEB128(p);
           uint64_t offset = ReadULEB128(p);
-          abort();
-          break;
+          LOG_ERROR(signal_safe_, "unsupported cfa inst DW_CFA_val_offset\n");
+          return false;
         }
         case DW_CFA_val_offset_sf: {
           uint64_t reg = ReadULEB128(p);
           int64_t offset = ReadLEB128(p);
-          abort();
-          break;
+          LOG_ERROR(signal_safe_, "unsupported cfa inst DW_CFA_val_offset_sf\n");
+          return false;
         }
         case DW_CFA_val_expression: {
           uint64_t reg = ReadULEB128(p);
           uint64_t len = ReadULEB128(p);
           p += len;
-          abort();
-          break;
+          LOG_ERROR(signal_safe_, "unsupported cfa inst DW_CFA_val_expression\n");
+          return false;
         }
         default: {
-          fprintf(stderr, "unknown cfa inst: 0x%x\n", inst);
-          abort();
+          LOG_ERROR(signal_safe_, "unknown cfa inst: 0x%x\n", inst);
+          return false;
         }
       }
     }
@@ -359,149 +479,546 @@ struct UnwindStruct_X86_64 {
   static const int reg_count = X86_64_REG_COUNT;
   static const std::unordered_map<int, const char*>& regname_map;
   static const int ip_regno = X86_64_RIP;
+  // The slot of the pc in signal contexts.
+  static const int signal_pc_regno = X86_64_RIP;
   static const int sp_regno = X86_64_RSP;
   using word_t = uint64_t;
   static const int PC_ADVANCE = 1;
   static const std::vector<int>& callee_save_regs;
+  // Registers saved by GET_CURRENT_REGS().
+  static const std::vector<int>& captured_regs;
 };
 const std::unordered_map<int, const char*>& UnwindStruct_X86_64::regname_map = X86_64_REG_NAME_MAP;
-const std::vector<int>& UnwindStruct_X86_64::callee_save_regs = *new std::vector<int>();
+const std::vector<int>& UnwindStruct_X86_64::callee_save_regs = *new std::vector<int>({
+    3, 6, 12, 13, 14, 15});
+const std::vector<int>& UnwindStruct_X86_64::captured_regs = *new std::vector<int>({
+    3, 6, 7, 12, 13, 14, 15, 16});
 
 struct UnwindStruct_X86 {
   static const int reg_count = X86_REG_COUNT;
   static const std::unordered_map<int, const char*>& regname_map;
   static const int ip_regno = X86_EIP;
+  // The slot of the pc in signal contexts.
+  static const int signal_pc_regno = X86_EIP;
   static const int sp_regno = X86_ESP;
   using word_t = uint32_t;
   static const int PC_ADVANCE = 1;
   static const std::vector<int>& callee_save_regs;
+  // Registers saved by GET_CURRENT_REGS().
+  static const std::vector<int>& captured_regs;
 };
 const std::unordered_map<int, const char*>& UnwindStruct_X86::regname_map = X86_REG_NAME_MAP;
-const std::vector<int>& UnwindStruct_X86::callee_save_regs = *new std::vector<int>();
+const std::vector<int>& UnwindStruct_X86::callee_save_regs = *new std::vector<int>({3, 5, 6, 7});
+const std::vector<int>& UnwindStruct_X86::captured_regs = *new std::vector<int>({
+    3, 4, 5, 6, 7, 8});
 
 struct UnwindStruct_AARCH64 {
   static const int reg_count = AARCH64_REG_COUNT;
   static const std::unordered_map<int, const char*>& regname_map;
   static const int ip_regno = AARCH64_IP;
+  // The slot of the pc in signal contexts, lr stays in ip_regno.
+  static const int signal_pc_regno = AARCH64_PC;
   static const int sp_regno = AARCH64_SP;
   using word_t = uint64_t;
   static const int PC_ADVANCE = 1;
   static const std::vector<int>& callee_save_regs;
+  // Registers saved by GET_CURRENT_REGS().
+  static const std::vector<int>& captured_regs;
 };
 const std::unordered_map<int, const char*>& UnwindStruct_AARCH64::regname_map = AARCH64_REG_NAME_MAP;
 const std::vector<int>& UnwindStruct_AARCH64::callee_save_regs = *new std::vector<int>({
     19, 20, 21, 22, 23, 24, 25, 26, 27, 28});
+const std::vector<int>& UnwindStruct_AARCH64::captured_regs = *new std::vector<int>({
+    19, 20, 21, 22, 23, 24, 25, 26, 27, 28, 29, 30, 31});
 
 struct UnwindStruct_ARM {
   static const int reg_count = ARM_REG_COUNT;
   static const std::unordered_map<int, const char*>& regname_map;
   static const int ip_regno = ARM_LR;
+  // The slot of the pc in signal contexts, lr stays in ip_regno.
+  static const int signal_pc_regno = ARM_PC;
   static const int sp_regno = ARM_SP;
   using word_t = uint32_t;
   static const int PC_ADVANCE = 8;
   static const std::vector<int>& callee_save_regs;
+  // Registers saved by GET_CURRENT_REGS().
+  static const std::vector<int>& captured_regs;
 };
 const std::unordered_map<int, const char*>& UnwindStruct_ARM::regname_map = ARM_REG_NAME_MAP;
 const std::vector<int>& UnwindStruct_ARM::callee_save_regs = *new std::vector<int>({4, 5, 6, 7, 8, 10, 11});
+const std::vector<int>& UnwindStruct_ARM::captured_regs = *new std::vector<int>({
+    4, 5, 6, 7, 8, 9, 10, 11, 13, 14, 15});
 
-extern "C" void GetCurrentRegs(void* mc);
+static uint64_t GetTimeInNs() {
+  timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return static_cast<uint64_t>(ts.tv_sec) * 1000000000 + ts.tv_nsec;
+}
 
-// Unwind steps:
-// 1. GetMContext
-// 2. Get map and map ip to dso and vaddr_in_file.
-// 3. get fde for current ip
-// 4. build a virtual table
-// 3. execute dwarf cfa instructions to ip
-// 4. get cfa value and register values
-template <typename UnwindStruct>
-bool UnwindInner() {
-  using word_t = typename UnwindStruct::word_t;
-  word_t current_regs[MAX_REGS];
+// Get the reader of the dso containing map, with its unwind table loaded.
+// In non-blocking mode, return nullptr if that can't be done without waiting,
+// and queue the dso to the BackgroundLoader. In signal safe mode, only use
+// the reader already set in map.
+static ElfReader* GetUnwindReader(Map* map, const UnwindOptions& options) {
+  bool non_blocking = options.non_blocking;
+  ElfReader* reader = map->dso_reader;
+  if (options.signal_safe) {
+    return (reader != nullptr && reader->IsUnwindSectionReady()) ? reader : nullptr;
+  }
+  if (reader == nullptr) {
+    if (non_blocking) {
+      reader = ElfReaderManager::FindElf(map->dso);
+    } else {
+      reader = ElfReaderManager::OpenElf(map->dso);
+    }
+    map->dso_reader = reader;
+  }
+  if (reader != nullptr && reader->IsUnwindSectionReady()) {
+    return reader;
+  }
+  if (non_blocking) {
+    BackgroundLoader::GetInstance().Queue(map->dso, std::vector<uint64_t>());
+    return nullptr;
+  }
+  if (reader == nullptr) {
+    fprintf(stderr, "failed to read dso %s\n", map->dso.c_str());
+    return nullptr;
+  }
+  if (!reader->ReadUnwindSection()) {
+    return nullptr;
+  }
+  return reader;
+}
 
-  GetCurrentRegs(current_regs);
+static_assert(MAX_REGS == UNWIND_MAX_REGS, "UnwindCursor has wrong register count");
 
-  word_t* p = current_regs;
-  for (int i = 0; i < 32; ++i) {
-    D("stack[0x%" PRIx64 "] = 0x%" PRIx64 "\n", static_cast<uint64_t>(reinterpret_cast<uintptr_t>(p)), static_cast<uint64_t>(*p));
-    p++;
-  }
-  RegValue<word_t> reg_values[MAX_REGS];
+// Validity of checked pages, in the low bits of page_cache_ entries.
+static constexpr uint64_t CHECKED_PAGE_SIZE = 4096;
+static constexpr uint64_t PAGE_VALID = 1;
+static constexpr uint64_t PAGE_INVALID = 2;
 
-  for (int i = 0; i < UnwindStruct::reg_count; ++i) {
-    reg_values[i].SetValue(current_regs[i]);
-    D("reg[%s] = 0x%" PRIx64 "\n", FindMap(UnwindStruct::regname_map, i), static_cast<uint64_t>(reg_values[i].value));
+bool CheckedMemory::SetStack(uint64_t sp, const MapTree* maps) {
+  uint64_t start;
+  uint64_t end;
+  if (!maps->GetReadableRange(sp, &start, &end)) {
+    return false;
   }
-  reg_values[UnwindStruct::ip_regno].SetValue(current_regs[UnwindStruct::ip_regno] - UnwindStruct::PC_ADVANCE);
+  stack_start_ = sp & ~(CHECKED_PAGE_SIZE - 1);
+  stack_end_ = end;
+  return true;
+}
 
-  MapTree map_tree;
-  map_tree.UpdateMaps();
+bool CheckedMemory::IsPageValid(uint64_t page) {
+  uint64_t& entry = page_cache_[(page / CHECKED_PAGE_SIZE) % PAGE_CACHE_SIZE];
+  if ((entry & ~(CHECKED_PAGE_SIZE - 1)) == page && entry != 0) {
+    return (entry & PAGE_VALID) != 0;
+  }
+  char c;
+  iovec local;
+  local.iov_base = &c;
+  local.iov_len = 1;
+  iovec remote;
+  remote.iov_base = reinterpret_cast<void*>(static_cast<uintptr_t>(page));
+  remote.iov_len = 1;
+  bool valid = process_vm_readv(getpid(), &local, 1, &remote, 1, 0) == 1;
+  entry = page | (valid ? PAGE_VALID : PAGE_INVALID);
+  return valid;
+}
 
-  RegValue<word_t> reg_values2[MAX_REGS];
-  RegValue<word_t>* rp1 = reg_values;
-  RegValue<word_t>* rp2 = reg_values2;
-  CFAExecutor<word_t> executor(UnwindStruct::sp_regno, UnwindStruct::callee_save_regs);
-  while (rp1[UnwindStruct::ip_regno].valid) {
-    word_t ip = rp1[UnwindStruct::ip_regno].value;
-    printf("ip 0x%" PRIx64 "\n", static_cast<uint64_t>(ip));
-    Map* map = map_tree.GetMapForIp(ip);
-    if (map == nullptr) {
-      fprintf(stderr, "can't get map for ip\n");
-      return false;
-    }
-    printf("map: [0x%" PRIx64 " - 0x%" PRIx64 "], dso %s\n", map->start, map->end, map->dso.c_str());
-    if (map->dso_reader == nullptr) {
-      map->dso_reader = ElfReaderManager::OpenElf(map->dso);
-      if (map->dso_reader == nullptr) {
-        fprintf(stderr, "failed to read dso %s\n", map->dso.c_str());
+bool CheckedMemory::Read(uint64_t addr, void* buf, size_t size) {
+  uint64_t end = addr + size;
+  if (end < addr || end > UINTPTR_MAX) {
+    return false;
+  }
+  if (addr < stack_start_ || end > stack_end_) {
+    for (uint64_t page = addr & ~(CHECKED_PAGE_SIZE - 1); page < end;
+         page += CHECKED_PAGE_SIZE) {
+      if (!IsPageValid(page)) {
         return false;
       }
     }
-    word_t vaddr_in_file = ip - map->start + map->dso_reader->GetMinVaddr();
-    D("vaddr_in_file = 0x%" PRIx64 "\n", static_cast<uint64_t>(vaddr_in_file));
-    if (!map->dso_reader->ReadUnwindSection()) {
+  }
+  const void* p = reinterpret_cast<const void*>(static_cast<uintptr_t>(addr));
+  // Constant sizes let the copies be single loads.
+  if (size == 8) {
+    memcpy(buf, p, 8);
+  } else if (size == 4) {
+    memcpy(buf, p, 4);
+  } else {
+    memcpy(buf, p, size);
+  }
+  return true;
+}
+
+UnwindCursor::UnwindCursor(const UnwindOptions& options)
+    : options_(options), deadline_(0), stack_set_(false), pc_(0), caller_frame_(false),
+      module_id_(UNKNOWN_MODULE_ID), vaddr_in_file_(0), last_fde_(nullptr), load_bias_(0),
+      finished_(false), unresolved_(false) {
+  for (int i = 0; i < MAX_REGS; ++i) {
+    valid_[i] = false;
+    regs_[i] = 0;
+  }
+}
+
+template <typename UnwindStruct>
+void UnwindCursor::InitInner(const void* regs, bool exact_pc) {
+  using word_t = typename UnwindStruct::word_t;
+  const word_t* current_regs = static_cast<const word_t*>(regs);
+  for (int i = 0; i < MAX_REGS; ++i) {
+    valid_[i] = false;
+  }
+  for (auto& i : UnwindStruct::captured_regs) {
+    valid_[i] = true;
+    regs_[i] = current_regs[i];
+    D("reg[%s] = 0x%" PRIx64 "\n", FindMap(UnwindStruct::regname_map, i), regs_[i]);
+  }
+  if (exact_pc) {
+    // On arm and arm64 the return address slot keeps lr, which is the return
+    // address of a leaf function until it saves it.
+    pc_ = current_regs[UnwindStruct::signal_pc_regno];
+  } else {
+    pc_ = static_cast<word_t>(current_regs[UnwindStruct::ip_regno] - UnwindStruct::PC_ADVANCE);
+  }
+  if (!exact_pc || UnwindStruct::signal_pc_regno == UnwindStruct::ip_regno) {
+    regs_[UnwindStruct::ip_regno] = pc_;
+  }
+  caller_frame_ = false;
+  finished_ = false;
+  unresolved_ = false;
+  deadline_ = 0;
+  if (options_.time_budget_ns != 0) {
+    deadline_ = GetTimeInNs() + options_.time_budget_ns;
+  }
+}
+
+// Frame rules of pcs unwound in the current process, shared by all threads.
+// Each entry has a sequence number, odd while the entry is written. Writers
+// take an entry by a compare-and-swap and give up if another one has it,
+// readers copy an entry and check the sequence number is unchanged. So no one
+// waits, and signal handlers can use the cache.
+struct FrameRuleEntry {
+  std::atomic<uint32_t> seq;
+  FrameRule rule;
+};
+
+static FrameRuleEntry frame_rule_cache[FRAME_RULE_CACHE_SIZE];
+
+static FrameRuleEntry& GetFrameRuleEntry(uint64_t pc) {
+  return frame_rule_cache[(pc * 0x9e3779b97f4a7c15ULL) >> 54];
+}
+
+static_assert(FRAME_RULE_CACHE_SIZE == 1 << (64 - 54), "frame rule hash doesn't fit the cache");
+
+static bool FindFrameRule(uint64_t pc, const MapTree* maps, FrameRule* rule) {
+  FrameRuleEntry& entry = GetFrameRuleEntry(pc);
+  uint32_t seq = entry.seq.load(std::memory_order_acquire);
+  if (seq & 1) {
+    return false;
+  }
+  memcpy(rule, &entry.rule, sizeof(FrameRule));
+  std::atomic_thread_fence(std::memory_order_acquire);
+  if (entry.seq.load(std::memory_order_relaxed) != seq) {
+    return false;
+  }
+  return rule->pc == pc && rule->maps_id == maps->GetId();
+}
+
+static void AddFrameRule(const FrameRule& rule) {
+  FrameRuleEntry& entry = GetFrameRuleEntry(rule.pc);
+  uint32_t seq = entry.seq.load(std::memory_order_relaxed);
+  if ((seq & 1) || !entry.seq.compare_exchange_strong(seq, seq + 1, std::memory_order_relaxed)) {
+    return;
+  }
+  std::atomic_thread_fence(std::memory_order_release);
+  memcpy(&entry.rule, &rule, sizeof(FrameRule));
+  entry.seq.store(seq + 2, std::memory_order_release);
+}
+
+template <typename UnwindStruct>
+bool UnwindCursor::StepByRule(const FrameRule& rule) {
+  using word_t = typename UnwindStruct::word_t;
+  module_id_ = rule.module_id;
+  vaddr_in_file_ = static_cast<word_t>(pc_ - rule.load_bias);
+  last_fde_ = rule.fde;
+  load_bias_ = rule.load_bias;
+  if (!valid_[rule.cfa_regno]) {
+    return false;
+  }
+  word_t cfa_value = regs_[rule.cfa_regno] + static_cast<word_t>(rule.cfa_offset);
+  uint64_t new_regs[MAX_REGS];
+  bool new_valid[MAX_REGS];
+  for (int i = 0; i < MAX_REGS; ++i) {
+    new_valid[i] = valid_[i] && (rule.same_value_regs & (1u << i));
+    new_regs[i] = new_valid[i] ? regs_[i] : 0;
+  }
+  UnwindMemory* memory = (options_.memory != nullptr) ? options_.memory : &local_memory_;
+  for (int i = 0; i < rule.offset_count; ++i) {
+    word_t addr = cfa_value + static_cast<word_t>(rule.offsets[i]);
+    uint64_t data = 0;
+    if (!memory->Read(addr, &data, rule.address_size)) {
+      LOG_ERROR(options_.signal_safe, "can't read memory at 0x%" PRIx64 "\n", static_cast<uint64_t>(addr));
       return false;
     }
-    Fde* fde = map->dso_reader->GetFdeForVaddrInFile(vaddr_in_file);
-    if (fde == nullptr) {
-      fprintf(stderr, "can't get fde for vaddr\n");
-      return false;
+    int reg = rule.offset_regs[i];
+    new_regs[reg] = static_cast<word_t>((rule.address_size == 4) ? static_cast<uint32_t>(data)
+                                                                   : data);
+    new_valid[reg] = true;
+  }
+  // cfa is the sp of the previous frame.
+  new_regs[UnwindStruct::sp_regno] = cfa_value;
+  new_valid[UnwindStruct::sp_regno] = true;
+  for (int i = 0; i < MAX_REGS; ++i) {
+    valid_[i] = new_valid[i];
+    regs_[i] = new_regs[i];
+  }
+  if (!valid_[UnwindStruct::ip_regno]) {
+    finished_ = true;
+    return false;
+  }
+  pc_ = regs_[UnwindStruct::ip_regno];
+  caller_frame_ = true;
+  return true;
+}
+
+// Unwind steps:
+// 1. Get map and map ip to dso and vaddr_in_file.
+// 2. get fde for current ip
+// 3. execute dwarf cfa instructions to ip
+// 4. get cfa value and register values
+template <typename UnwindStruct>
+bool UnwindCursor::StepInner() {
+  using word_t = typename UnwindStruct::word_t;
+  if (finished_ || unresolved_) {
+    return false;
+  }
+  module_id_ = UNKNOWN_MODULE_ID;
+  vaddr_in_file_ = pc_;
+  last_fde_ = nullptr;
+  D("ip 0x%" PRIx64 "\n", pc_);
+  if (deadline_ != 0 && GetTimeInNs() >= deadline_) {
+    D("unwind time budget is used up\n");
+    return false;
+  }
+  // The process maps are got again at each Step(), as they are only kept from
+  // being freed while the guard lives. So cursors can be dropped without
+  // being destroyed.
+  ProcessMapsGuard maps_guard;
+  MapTree* maps = (options_.maps != nullptr) ? options_.maps : MapTree::GetProcessMaps();
+  if (!stack_set_) {
+    stack_set_ = true;
+    uint64_t sp = regs_[UnwindStruct::sp_regno];
+    if (options_.memory == nullptr && !local_memory_.SetStack(sp, maps) &&
+        !options_.signal_safe && options_.maps == nullptr) {
+      // Otherwise each read from the stack is checked.
+      maps = MapTree::RefreshProcessMapsForStack(maps, sp);
+      local_memory_.SetStack(sp, maps);
     }
-    D("fde func[0x%" PRIx64 "-0x%" PRIx64 "]\n", fde->func_start, fde->func_end);
-    executor.Init(fde, vaddr_in_file);
-    if (!executor.Execute(rp1, rp2)) {
-      return false;
+  }
+  // Rules are only cached for the current process, whose maps are shared.
+  bool use_rule_cache = (options_.maps == nullptr && options_.memory == nullptr);
+  // The pc of a caller frame is a return address, which is the start of the
+  // next function if the call is to a noreturn function ending the caller.
+  // Like libgcc, look up the call instead.
+  uint64_t lookup_pc = caller_frame_ ? pc_ - 1 : pc_;
+  FrameRule rule;
+  if (use_rule_cache && FindFrameRule(lookup_pc, maps, &rule)) {
+    return StepByRule<UnwindStruct>(rule);
+  }
+  Map* map = maps->GetMapForIp(lookup_pc);
+  if (map == nullptr && !options_.signal_safe && options_.maps == nullptr) {
+    maps = MapTree::RefreshProcessMapsForIp(maps, lookup_pc);
+    map = maps->GetMapForIp(lookup_pc);
+  }
+  if (map == nullptr) {
+    LOG_ERROR(options_.signal_safe, "can't get map for ip\n");
+    return false;
+  }
+  D("map: [0x%" PRIx64 " - 0x%" PRIx64 "], dso %s\n", map->start, map->end, map->dso.c_str());
+  ElfReader* reader = GetUnwindReader(map, options_);
+  if (reader == nullptr) {
+    // The dso may be opened without its unwind table loaded.
+    ElfReader* dso_reader = map->dso_reader;
+    if (dso_reader != nullptr) {
+      module_id_ = dso_reader->GetModuleId();
+      vaddr_in_file_ = pc_ - map->start + dso_reader->GetMinVaddr();
     }
-    for (int i = 0; i < MAX_REGS; ++i) {
-      const char* name = FindMap(UnwindStruct::regname_map, i);
-      D("rp2[%s(%d)] = %d, 0x%" PRIx64 "\n", name, i, rp2[i].valid, static_cast<uint64_t>(rp2[i].value));
+    unresolved_ = options_.non_blocking || options_.signal_safe;
+    return false;
+  }
+  word_t vaddr_in_file = lookup_pc - map->start + reader->GetMinVaddr();
+  D("vaddr_in_file = 0x%" PRIx64 "\n", static_cast<uint64_t>(vaddr_in_file));
+  module_id_ = reader->GetModuleId();
+  vaddr_in_file_ = pc_ - map->start + reader->GetMinVaddr();
+  // In signal safe mode, an Fde the reader would allocate is built on the
+  // stack instead, and isn't kept after the step.
+  Fde signal_safe_fde;
+  Fde* fde = options_.signal_safe
+                 ? reader->GetFdeForVaddrInFileSignalSafe(vaddr_in_file, &signal_safe_fde)
+                 : reader->GetFdeForVaddrInFile(vaddr_in_file);
+  if (fde == nullptr) {
+    LOG_ERROR(options_.signal_safe, "can't get fde for vaddr\n");
+    return false;
+  }
+  D("fde func[0x%" PRIx64 "-0x%" PRIx64 "]\n", fde->func_start, fde->func_end);
+  bool fde_kept = (fde != &signal_safe_fde);
+  last_fde_ = fde_kept ? fde : nullptr;
+  load_bias_ = map->start - reader->GetMinVaddr();
+  RegValue<word_t> old_regs[MAX_REGS];
+  RegValue<word_t> new_regs[MAX_REGS];
+  for (int i = 0; i < MAX_REGS; ++i) {
+    if (valid_[i]) {
+      old_regs[i].SetValue(regs_[i]);
     }
-    RegValue<word_t>* tmp = rp1;
-    rp1 = rp2;
-    rp2 = tmp;
   }
+  CFAExecutor<word_t> executor(UnwindStruct::sp_regno, UnwindStruct::callee_save_regs,
+                               (options_.memory != nullptr) ? options_.memory : &local_memory_,
+                               options_.signal_safe);
+  if (!executor.Init(fde, vaddr_in_file) || !executor.Execute(old_regs, new_regs)) {
+    return false;
+  }
+  if (use_rule_cache && fde_kept && executor.GetFrameRule(&rule)) {
+    rule.pc = lookup_pc;
+    rule.maps_id = maps->GetId();
+    rule.fde = fde;
+    rule.load_bias = load_bias_;
+    rule.module_id = module_id_;
+    AddFrameRule(rule);
+  }
+  for (int i = 0; i < MAX_REGS; ++i) {
+    const char* name = FindMap(UnwindStruct::regname_map, i);
+    D("new_regs[%s(%d)] = %d, 0x%" PRIx64 "\n", name, i, new_regs[i].valid, static_cast<uint64_t>(new_regs[i].value));
+    valid_[i] = new_regs[i].valid;
+    regs_[i] = new_regs[i].value;
+  }
+  if (!valid_[UnwindStruct::ip_regno]) {
+    finished_ = true;
+    return false;
+  }
+  pc_ = regs_[UnwindStruct::ip_regno];
+  caller_frame_ = true;
   return true;
 }
 
-bool Unwind() {
+void UnwindCursor::Init(const void* regs) {
+#if defined(__x86_64__)
+  InitInner<UnwindStruct_X86_64>(regs, false);
+#elif defined(__i386__)
+  InitInner<UnwindStruct_X86>(regs, false);
+#elif defined(__aarch64__)
+  InitInner<UnwindStruct_AARCH64>(regs, false);
+#elif defined(__arm__)
+  InitInner<UnwindStruct_ARM>(regs, false);
+#endif
+}
+
+void UnwindCursor::InitFromSignalContext(const void* regs) {
+#if defined(__x86_64__)
+  InitInner<UnwindStruct_X86_64>(regs, true);
+#elif defined(__i386__)
+  InitInner<UnwindStruct_X86>(regs, true);
+#elif defined(__aarch64__)
+  InitInner<UnwindStruct_AARCH64>(regs, true);
+#elif defined(__arm__)
+  InitInner<UnwindStruct_ARM>(regs, true);
+#endif
+}
+
+bool UnwindCursor::Step() {
 #if defined(__x86_64__)
-  return UnwindInner<UnwindStruct_X86_64>();
+  return StepInner<UnwindStruct_X86_64>();
 #elif defined(__i386__)
-  return UnwindInner<UnwindStruct_X86>();
+  return StepInner<UnwindStruct_X86>();
 #elif defined(__aarch64__)
-  return UnwindInner<UnwindStruct_AARCH64>();
+  return StepInner<UnwindStruct_AARCH64>();
 #elif defined(__arm__)
-  return UnwindInner<UnwindStruct_ARM>();
+  return StepInner<UnwindStruct_ARM>();
 #else
   return false;
 #endif
 }
 
-void funcInBetween() {
-  Unwind();
+bool UnwindCursor::GetReg(int regno, uint64_t* value) const {
+  if (regno < 0 || regno >= MAX_REGS || !valid_[regno]) {
+    return false;
+  }
+  *value = regs_[regno];
+  return true;
 }
 
-int main() {
+bool Unwind(const UnwindOptions& options, std::vector<UnwindFrame>* frames) {
+  uint64_t current_regs[MAX_REGS];
+  GET_CURRENT_REGS(current_regs);
+  return UnwindFromRegs(current_regs, options, frames);
+}
 
-  funcInBetween();
-  return 0;
+static bool UnwindCursorToFrames(UnwindCursor& cursor, std::vector<UnwindFrame>* frames) {
+  while (true) {
+    UnwindFrame frame;
+    frame.pc = cursor.GetPc();
+    frame.unresolved = false;
+    frames->push_back(frame);
+    bool stepped = cursor.Step();
+    cursor.GetLastRelPc(&frames->back().module_id, &frames->back().vaddr_in_file);
+    if (!stepped) {
+      break;
+    }
+  }
+  frames->back().unresolved = cursor.IsUnresolved();
+  return cursor.Finished();
+}
+
+bool UnwindFromRegs(const void* regs, const UnwindOptions& options,
+                    std::vector<UnwindFrame>* frames) {
+  UnwindCursor cursor(options);
+  cursor.Init(regs);
+  return UnwindCursorToFrames(cursor, frames);
+}
+
+bool UnwindFromSignalContext(const void* regs, const UnwindOptions& options,
+                             std::vector<UnwindFrame>* frames) {
+  UnwindCursor cursor(options);
+  cursor.InitFromSignalContext(regs);
+  return UnwindCursorToFrames(cursor, frames);
+}
+
+void GetRegsFromUcontext(void* ucontext, uintptr_t* regs) {
+  const mcontext_t& mc = static_cast<ucontext_t*>(ucontext)->uc_mcontext;
+#if defined(__x86_64__)
+  static constexpr int GREGS[] = {
+    REG_RAX, REG_RDX, REG_RCX, REG_RBX, REG_RSI, REG_RDI, REG_RBP, REG_RSP,
+    REG_R8, REG_R9, REG_R10, REG_R11, REG_R12, REG_R13, REG_R14, REG_R15, REG_RIP,
+  };
+  for (size_t i = 0; i < sizeof(GREGS) / sizeof(GREGS[0]); ++i) {
+    regs[i] = mc.gregs[GREGS[i]];
+  }
+#elif defined(__i386__)
+  static constexpr int GREGS[] = {
+    REG_EAX, REG_EDX, REG_ECX, REG_EBX, REG_ESP, REG_EBP, REG_ESI, REG_EDI, REG_EIP,
+  };
+  for (size_t i = 0; i < sizeof(GREGS) / sizeof(GREGS[0]); ++i) {
+    regs[i] = mc.gregs[GREGS[i]];
+  }
+#elif defined(__aarch64__)
+  for (int i = 0; i < 31; ++i) {
+    regs[i] = mc.regs[i];
+  }
+  regs[31] = mc.sp;
+  // Unlike GET_CURRENT_REGS(), slot 30 keeps lr, and the pc has its own slot.
+  regs[32] = mc.pc;
+#elif defined(__arm__)
+  // r0 to r15, lr and pc included.
+  const unsigned long* r = &mc.arm_r0;
+  for (int i = 0; i < 16; ++i) {
+    regs[i] = r[i];
+  }
+#endif
+}
+
+bool Unwind() {
+  std::vector<UnwindFrame> frames;
+  bool result = Unwind(UnwindOptions(), &frames);
+  for (auto& frame : frames) {
+    printf("ip 0x%" PRIx64 "\n", frame.pc);
+  }
+  return result;
 }
@@ -1,6 +1,202 @@
 #ifndef _UNWIND_UNWIND_H_
 #define _UNWIND_UNWIND_H_
 
+#include <stddef.h>
+#include <stdint.h>
+
+#include <vector>
+
+class MapTree;
+struct Fde;
+struct FrameRule;
+
+// Memory of the unwound thread.
+class UnwindMemory {
+ public:
+  virtual ~UnwindMemory() {
+  }
+
+  // Return false if [addr, addr + size) isn't available.
+  virtual bool Read(uint64_t addr, void* buf, size_t size) = 0;
+};
+
+// Reads memory of the current process without faulting. Reads in the stack of
+// the unwound thread, from its first sp to the end of the readable map holding
+// it in the map snapshot, are plain loads. Other pages are checked once with
+// process_vm_readv() and remembered in a small cache, so a corrupt cfa fails
+// the read instead of crashing.
+class CheckedMemory : public UnwindMemory {
+ public:
+  CheckedMemory() : stack_start_(0), stack_end_(0) {
+    for (auto& entry : page_cache_) {
+      entry = 0;
+    }
+  }
+
+  // Return false if sp isn't in a readable map known by maps.
+  bool SetStack(uint64_t sp, const MapTree* maps);
+
+  bool Read(uint64_t addr, void* buf, size_t size) override;
+
+ private:
+  static constexpr int PAGE_CACHE_SIZE = 8;
+
+  bool IsPageValid(uint64_t page);
+
+  uint64_t stack_start_;
+  uint64_t stack_end_;
+  // Page address | PAGE_VALID or PAGE_INVALID, 0 if unused.
+  uint64_t page_cache_[PAGE_CACHE_SIZE];
+};
+
+struct UnwindOptions {
+  // Stop unwinding after this time, 0 means no limit.
+  uint64_t time_budget_ns;
+  // Don't open dsos or read unwind tables in the calling thread. When
+  // reaching a dso whose unwind table isn't loaded, the frame is marked
+  // unresolved, the unwind stops there, and the dso is queued to the
+  // BackgroundLoader. So later unwinds can get the full stack.
+  bool non_blocking;
+  // Only use maps and unwind tables already loaded, without taking locks or
+  // allocating memory, so it can run in signal handlers. Frames in dsos not
+  // loaded are marked unresolved like in non_blocking mode.
+  bool signal_safe;
+  // Unwind a thread not in the current process, like one in a core file.
+  // When set, maps are used as they are, and stack memory is read from memory
+  // instead of the checked memory of the current process.
+  MapTree* maps;
+  UnwindMemory* memory;
+
+  UnwindOptions() : time_budget_ns(0), non_blocking(false), signal_safe(false),
+      maps(nullptr), memory(nullptr) {
+  }
+};
+
+struct UnwindFrame {
+  uint64_t pc;
+  // The unwind table for pc isn't loaded, callers of this frame are unknown.
+  bool unresolved;
+  // pc relocated to the dso: the module id of the dso (see
+  // ElfReaderManager::GetModule()) and the vaddr of pc in the dso file. They
+  // don't depend on where the dso is loaded, so frames of different
+  // processes can be aggregated without symbolizing them first. If the dso of
+  // pc isn't known, module_id is UNKNOWN_MODULE_ID and vaddr_in_file is pc.
+  uint32_t module_id;
+  uint64_t vaddr_in_file;
+};
+
+// Registers are word sized values in dwarf register order. On arm64, whose
+// dwarf registers end with sp at 31, slot 32 holds the pc of signal contexts.
+static constexpr int UNWIND_MAX_REGS = 33;
+
+// Unwinds a thread one frame at a time. Nothing is computed for frames the
+// caller doesn't step to, so getting the top few frames is cheap.
+class UnwindCursor {
+ public:
+  explicit UnwindCursor(const UnwindOptions& options = UnwindOptions());
+
+  // Start from registers saved by GET_CURRENT_REGS(): word sized values in
+  // dwarf register order of the current arch.
+  void Init(const void* regs);
+
+  // Like Init(), for registers of an interrupted or stopped thread, like those
+  // converted from a signal context by GetRegsFromUcontext() or read from a
+  // core file. Their pc is the next instruction to run rather than an address
+  // in the capture code, so it is used as is. On arm and arm64 it is in the pc
+  // slot (15 and 32), and lr keeps the return address of a leaf function.
+  void InitFromSignalContext(const void* regs);
+
+  // Move to the caller frame. Return false if there is no caller frame or
+  // it can't be found, Finished() and IsUnresolved() tell which.
+  bool Step();
+
+  uint64_t GetPc() const {
+    return pc_;
+  }
+
+  // GetPc() is a return address, not the pc of the first frame. The call is
+  // before it, and after a call to a noreturn function the return address is
+  // in the next function, so look up GetPc() - 1 instead, like Step().
+  bool IsCallerFrame() const {
+    return caller_frame_;
+  }
+
+  // Return false if the register isn't known in the current frame.
+  bool GetReg(int regno, uint64_t* value) const;
+
+  // The previous Step() reached the end of the stack.
+  bool Finished() const {
+    return finished_;
+  }
+
+  // In non-blocking mode, the unwind table for pc isn't loaded yet.
+  bool IsUnresolved() const {
+    return unresolved_;
+  }
+
+  // Get the module id and vaddr_in_file (see UnwindFrame) of the pc the last
+  // Step() started from, which are found while stepping.
+  void GetLastRelPc(uint32_t* module_id, uint64_t* vaddr_in_file) const {
+    *module_id = module_id_;
+    *vaddr_in_file = vaddr_in_file_;
+  }
+
+  // Get the Fde the last Step() started from, and the load bias of its dso
+  // (the vaddr in file plus load bias is the address in memory). Return
+  // nullptr if no Fde was found, or in signal safe mode if the Fde came from
+  // a shared index (see SharedIndex::FindFde()).
+  Fde* GetLastFde(uint64_t* load_bias) const {
+    *load_bias = load_bias_;
+    return last_fde_;
+  }
+
+ private:
+  template <typename UnwindStruct>
+  void InitInner(const void* regs, bool exact_pc);
+  template <typename UnwindStruct>
+  bool StepInner();
+  // Step with rules found for the same pc before.
+  template <typename UnwindStruct>
+  bool StepByRule(const FrameRule& rule);
+
+  UnwindOptions options_;
+  uint64_t deadline_;
+  // The stack range of local_memory_ is set from the maps on the first
+  // Step(), so the first frame doesn't need them.
+  bool stack_set_;
+  bool valid_[UNWIND_MAX_REGS];
+  uint64_t regs_[UNWIND_MAX_REGS];
+  uint64_t pc_;
+  // pc_ is a return address, not the pc of the first frame.
+  bool caller_frame_;
+  // The module id and vaddr_in_file of the pc Step() last started from.
+  uint32_t module_id_;
+  uint64_t vaddr_in_file_;
+  Fde* last_fde_;
+  uint64_t load_bias_;
+  bool finished_;
+  bool unresolved_;
+  CheckedMemory local_memory_;
+};
+
+// Unwind the current thread, and print pcs of all frames.
 bool Unwind();
 
+// Unwind the current thread into frames. Return true if the whole stack is
+// unwound, otherwise frames contain the part unwound before stopping.
+bool Unwind(const UnwindOptions& options, std::vector<UnwindFrame>* frames);
+
+// Like above, but start from regs in the layout of GET_CURRENT_REGS(), which
+// may belong to another thread or process.
+bool UnwindFromRegs(const void* regs, const UnwindOptions& options,
+                    std::vector<UnwindFrame>* frames);
+
+// Like above, for regs taken by UnwindCursor::InitFromSignalContext().
+bool UnwindFromSignalContext(const void* regs, const UnwindOptions& options,
+                             std::vector<UnwindFrame>* frames);
+
+// Convert registers in a signal context to the layout of GET_CURRENT_REGS(),
+// to be unwound with UnwindCursor::InitFromSignalContext().
+void GetRegsFromUcontext(void* ucontext, uintptr_t* regs);
+
 #endif  // _UNWIND_UNWIND_H_
@@ -0,0 +1,36 @@
+// Unwind all threads of a core file, and print pcs as dso and vaddr_in_file.
+
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "core_file.h"
+
+int main(int argc, char** argv) {
+  if (argc < 2) {
+    fprintf(stderr, "usage: unwind_core <core_file> [jobs]\n");
+    exit(1);
+  }
+  int jobs = (argc > 2) ? atoi(argv[2]) : 1;
+  std::unique_ptr<CoreFile> core = CoreFile::Open(argv[1]);
+  if (core == nullptr) {
+    return 1;
+  }
+  std::vector<std::vector<UnwindFrame>> stacks;
+  core->UnwindAllThreads(jobs, &stacks);
+  const std::vector<CoreThread>& threads = core->GetThreads();
+  for (size_t i = 0; i < threads.size(); ++i) {
+    printf("thread %d, signal %d\n", threads[i].tid, threads[i].signo);
+    for (auto& frame : stacks[i]) {
+      ElfReader* module = ElfReaderManager::GetModule(frame.module_id);
+      if (module != nullptr) {
+        printf("  0x%016" PRIx64 "  %s+0x%" PRIx64 "\n", frame.pc, module->GetFileName().c_str(),
+               frame.vaddr_in_file);
+      } else {
+        Map* map = core->GetMaps()->GetMapForIp(frame.pc);
+        printf("  0x%016" PRIx64 "  %s\n", frame.pc, (map != nullptr) ? map->dso.c_str() : "???");
+      }
+    }
+  }
+  return 0;
+}
@@ -0,0 +1,239 @@
+#include "unwind_daemon.h"
+
+#include <errno.h>
+#include <poll.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <algorithm>
+
+#include "get_current_regs.h"
+
+static_assert(SAMPLE_MAX_REGS == UNWIND_MAX_REGS, "SampleSlot has wrong register count");
+
+// Don't read maps of a target again more often than this.
+static constexpr uint64_t MAPS_REFRESH_INTERVAL_NS = 100000000;
+// How long to wait for connections when all rings are empty.
+static constexpr int IDLE_POLL_MS = 10;
+
+static uint64_t GetTimeInNs() {
+  timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return static_cast<uint64_t>(ts.tv_sec) * 1000000000 + ts.tv_nsec;
+}
+
+// Serves memory from the stack bytes copied in a sample. The bytes are in
+// the ring, but start and size are checked copies.
+class SampleMemory : public UnwindMemory {
+ public:
+  SampleMemory(uint64_t start, const char* stack, size_t stack_size)
+      : start_(start), stack_(stack), stack_size_(stack_size) {
+  }
+
+  bool Read(uint64_t addr, void* buf, size_t size) override {
+    if (addr < start_ || addr - start_ >= stack_size_ || size > stack_size_ - (addr - start_)) {
+      return false;
+    }
+    memcpy(buf, stack_ + (addr - start_), size);
+    return true;
+  }
+
+ private:
+  const uint64_t start_;
+  const char* const stack_;
+  const size_t stack_size_;
+};
+
+UnwindDaemon::~UnwindDaemon() {
+  while (!connections_.empty()) {
+    CloseConnection(connections_.size() - 1);
+  }
+  if (listen_fd_ != -1) {
+    close(listen_fd_);
+    unlink(socket_path_.c_str());
+  }
+}
+
+bool UnwindDaemon::Listen(const char* socket_path) {
+  sockaddr_un addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  if (strlen(socket_path) >= sizeof(addr.sun_path)) {
+    fprintf(stderr, "socket path %s is too long\n", socket_path);
+    return false;
+  }
+  strcpy(addr.sun_path, socket_path);
+  listen_fd_ = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  if (listen_fd_ == -1) {
+    fprintf(stderr, "failed to create socket: %s\n", strerror(errno));
+    return false;
+  }
+  unlink(socket_path);
+  // Restrict the socket before listen(), so no one else can connect. Peers
+  // are still checked in AcceptConnection(), as root ignores the mode.
+  if (bind(listen_fd_, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) != 0 ||
+      chmod(socket_path, 0600) != 0 || listen(listen_fd_, 16) != 0) {
+    fprintf(stderr, "failed to listen on %s: %s\n", socket_path, strerror(errno));
+    return false;
+  }
+  socket_path_ = socket_path;
+  return true;
+}
+
+void UnwindDaemon::AcceptConnection() {
+  int sock = accept4(listen_fd_, nullptr, nullptr, SOCK_CLOEXEC);
+  if (sock == -1) {
+    return;
+  }
+  ucred cred;
+  socklen_t cred_len = sizeof(cred);
+  if (getsockopt(sock, SOL_SOCKET, SO_PEERCRED, &cred, &cred_len) != 0) {
+    close(sock);
+    return;
+  }
+  if (cred.uid != geteuid()) {
+    fprintf(stderr, "pid %d of uid %d isn't allowed to connect\n", cred.pid, cred.uid);
+    close(sock);
+    return;
+  }
+  char data;
+  iovec iov;
+  iov.iov_base = &data;
+  iov.iov_len = 1;
+  char control[CMSG_SPACE(sizeof(int))];
+  msghdr msg;
+  memset(&msg, 0, sizeof(msg));
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  msg.msg_control = control;
+  msg.msg_controllen = sizeof(control);
+  if (TEMP_FAILURE_RETRY(recvmsg(sock, &msg, MSG_CMSG_CLOEXEC)) != 1) {
+    close(sock);
+    return;
+  }
+  cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+  if (cmsg == nullptr || cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS) {
+    fprintf(stderr, "pid %d sent no sample ring\n", cred.pid);
+    close(sock);
+    return;
+  }
+  int fd;
+  memcpy(&fd, CMSG_DATA(cmsg), sizeof(int));
+  Connection conn;
+  conn.sock = sock;
+  conn.pid = cred.pid;
+  conn.ring = SampleRing::Attach(fd);
+  if (conn.ring == nullptr) {
+    close(sock);
+    return;
+  }
+  Target& target = targets_[conn.pid];
+  if (target.connections++ == 0) {
+    target.maps_time_ns = 0;
+  }
+  connections_.push_back(std::move(conn));
+}
+
+void UnwindDaemon::CloseConnection(size_t index) {
+  Connection& conn = connections_[index];
+  auto it = targets_.find(conn.pid);
+  if (it != targets_.end() && --it->second.connections == 0) {
+    targets_.erase(it);
+  }
+  close(conn.sock);
+  connections_.erase(connections_.begin() + index);
+}
+
+MapTree* UnwindDaemon::RefreshMaps(pid_t pid, bool force) {
+  Target& target = targets_[pid];
+  uint64_t now = GetTimeInNs();
+  if (target.maps == nullptr || (force && now - target.maps_time_ns >= MAPS_REFRESH_INTERVAL_NS)) {
+    std::unique_ptr<MapTree> maps(new MapTree);
+    if (maps->UpdateMaps(pid) || target.maps == nullptr) {
+      target.maps = std::move(maps);
+    }
+    target.maps_time_ns = now;
+  }
+  return target.maps.get();
+}
+
+void UnwindDaemon::UnwindSample(Connection& conn, const SampleSlot* slot) {
+  // The target can write the slot while it is unwound, so the fields are
+  // copied once, and the stack size is clamped to the ring.
+  uintptr_t regs[SAMPLE_MAX_REGS];
+  memcpy(regs, slot->regs, sizeof(regs));
+  int tid = slot->tid;
+  uint32_t stack_size = slot->stack_size;
+  stack_size = std::min(stack_size, conn.ring->StackBytes());
+  uint32_t flags = slot->flags;
+  SampleMemory memory(regs[CURRENT_REGS_SP], slot->stack, stack_size);
+  UnwindOptions options;
+  options.memory = &memory;
+  options.maps = RefreshMaps(conn.pid, false);
+  for (int i = 0; i < 2; ++i) {
+    frames_.clear();
+    bool finished = (flags & SAMPLE_FROM_SIGNAL_CONTEXT)
+                        ? UnwindFromSignalContext(regs, options, &frames_)
+                        : UnwindFromRegs(regs, options, &frames_);
+    if (finished ||
+        options.maps->GetMapForIp(frames_.back().pc) != nullptr) {
+      break;
+    }
+    // The target may have loaded a dso since the maps were read.
+    MapTree* maps = RefreshMaps(conn.pid, true);
+    if (maps == options.maps) {
+      break;
+    }
+    options.maps = maps;
+  }
+  callback_(conn.pid, tid, frames_);
+}
+
+size_t UnwindDaemon::DrainRings() {
+  size_t count = 0;
+  for (auto& conn : connections_) {
+    uint64_t left = conn.ring->SlotCount();
+    SampleSlot* slot;
+    while (left-- > 0 && (slot = conn.ring->Peek()) != nullptr) {
+      UnwindSample(conn, slot);
+      conn.ring->Pop();
+      ++count;
+    }
+  }
+  return count;
+}
+
+void UnwindDaemon::Run(const std::atomic<bool>& stop) {
+  std::vector<pollfd> fds;
+  while (!stop) {
+    // Busy rings are drained again right away, but connections are still
+    // polled between passes.
+    size_t count = DrainRings();
+    fds.resize(connections_.size() + 1);
+    fds[0].fd = listen_fd_;
+    fds[0].events = POLLIN;
+    for (size_t i = 0; i < connections_.size(); ++i) {
+      fds[i + 1].fd = connections_[i].sock;
+      fds[i + 1].events = POLLIN;
+    }
+    if (poll(fds.data(), fds.size(), (count != 0) ? 0 : IDLE_POLL_MS) <= 0) {
+      continue;
+    }
+    // A target closes its socket when it exits, drain its ring before
+    // dropping it. Nothing is added to it anymore, so one pass is enough.
+    for (size_t i = connections_.size(); i > 0; --i) {
+      if (fds[i].revents != 0) {
+        DrainRings();
+        CloseConnection(i - 1);
+      }
+    }
+    if (fds[0].revents & POLLIN) {
+      AcceptConnection();
+    }
+  }
+}
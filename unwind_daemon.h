@@ -0,0 +1,71 @@
+#ifndef _UNWIND_UNWIND_DAEMON_H_
+#define _UNWIND_UNWIND_DAEMON_H_
+
+#include <sys/types.h>
+
+#include <atomic>
+#include <functional>
+#include <map>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "map.h"
+#include "sample_ring.h"
+#include "unwind.h"
+
+// Unwinds samples of other processes out of process. Targets connect with
+// SampleClient and send the fd of their SampleRing, the daemon drains the
+// rings and unwinds each sample against the copied stack bytes. Only
+// processes of the daemon's euid can connect.
+//
+// Maps are cached per target process, and read again from /proc/<pid>/maps
+// when a pc hits no map. Unwind tables are cached per dso by
+// ElfReaderManager, so they are shared by all targets.
+class UnwindDaemon {
+ public:
+  using SampleCallback =
+      std::function<void(pid_t pid, int tid, const std::vector<UnwindFrame>& frames)>;
+
+  explicit UnwindDaemon(SampleCallback callback) : listen_fd_(-1), callback_(callback) {
+  }
+
+  ~UnwindDaemon();
+
+  bool Listen(const char* socket_path);
+
+  // Accept targets and unwind their samples until stop is set.
+  void Run(const std::atomic<bool>& stop);
+
+  // Unwind the samples in all rings now, at most one ring's worth per ring,
+  // so a target sampling as fast as it is drained can't starve the others.
+  // Return how many were unwound.
+  size_t DrainRings();
+
+ private:
+  struct Target {
+    std::unique_ptr<MapTree> maps;
+    uint64_t maps_time_ns;
+    int connections;
+  };
+
+  struct Connection {
+    int sock;
+    pid_t pid;
+    std::unique_ptr<SampleRing> ring;
+  };
+
+  void AcceptConnection();
+  void CloseConnection(size_t index);
+  void UnwindSample(Connection& conn, const SampleSlot* slot);
+  MapTree* RefreshMaps(pid_t pid, bool force);
+
+  int listen_fd_;
+  std::string socket_path_;
+  SampleCallback callback_;
+  std::vector<Connection> connections_;
+  std::map<pid_t, Target> targets_;
+  std::vector<UnwindFrame> frames_;
+};
+
+#endif  // _UNWIND_UNWIND_DAEMON_H_
@@ -0,0 +1,52 @@
+// Unwind samples sent by SampleClient of other processes, and print frames of
+// each sample as module_id+vaddr_in_file, until interrupted. Then print the
+// modules, so frames of all processes can be aggregated by module offset.
+
+#include <inttypes.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "unwind_daemon.h"
+
+static std::atomic<bool> stop(false);
+
+static void StopHandler(int) {
+  stop = true;
+}
+
+int main(int argc, char** argv) {
+  if (argc < 2) {
+    fprintf(stderr, "usage: unwind_daemon <socket_path>\n");
+    exit(1);
+  }
+  uint64_t samples = 0;
+  UnwindDaemon daemon([&](pid_t pid, int tid, const std::vector<UnwindFrame>& frames) {
+    printf("%d/%d:", pid, tid);
+    for (auto& frame : frames) {
+      if (frame.module_id != UNKNOWN_MODULE_ID) {
+        printf(" %u+0x%" PRIx64, frame.module_id, frame.vaddr_in_file);
+      } else {
+        printf(" 0x%" PRIx64, frame.pc);
+      }
+    }
+    printf("\n");
+    ++samples;
+  });
+  if (!daemon.Listen(argv[1])) {
+    return 1;
+  }
+  signal(SIGINT, StopHandler);
+  signal(SIGTERM, StopHandler);
+  daemon.Run(stop);
+  for (uint32_t i = 0; i < ElfReaderManager::GetModuleCount(); ++i) {
+    ElfReader* module = ElfReaderManager::GetModule(i);
+    printf("module %u ", i);
+    for (unsigned char c : module->GetBuildId()) {
+      printf("%02x", c);
+    }
+    printf(" %s\n", module->GetFileName().c_str());
+  }
+  fprintf(stderr, "unwound %" PRIu64 " samples\n", samples);
+  return 0;
+}
@@ -0,0 +1,11 @@
+#include "unwind.h"
+
+void funcInBetween() {
+  Unwind();
+}
+
+int main() {
+
+  funcInBetween();
+  return 0;
+}
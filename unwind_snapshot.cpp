@@ -0,0 +1,40 @@
+// Unwind all threads of a snapshot, and print pcs as dso and vaddr_in_file.
+// Dsos are looked up in symbol_dir first, see snapshot.h.
+
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "snapshot.h"
+
+int main(int argc, char** argv) {
+  if (argc < 2) {
+    fprintf(stderr, "usage: unwind_snapshot <snapshot_file> [symbol_dir]\n");
+    exit(1);
+  }
+  std::unique_ptr<Snapshot> snapshot = Snapshot::Open(argv[1], (argc > 2) ? argv[2] : "");
+  if (snapshot == nullptr) {
+    return 1;
+  }
+  for (auto& module : snapshot->GetModules()) {
+    if (module.local_path.empty() && module.name.find('[') != 0) {
+      fprintf(stderr, "no matching file for %s\n", module.name.c_str());
+    }
+  }
+  for (auto& thread : snapshot->GetThreads()) {
+    printf("thread %d, signal %d\n", thread.tid, thread.signo);
+    std::vector<UnwindFrame> frames;
+    snapshot->UnwindThread(thread, &frames);
+    for (auto& frame : frames) {
+      ElfReader* module = ElfReaderManager::GetModule(frame.module_id);
+      if (module != nullptr) {
+        printf("  0x%016" PRIx64 "  %s+0x%" PRIx64 "\n", frame.pc, module->GetFileName().c_str(),
+               frame.vaddr_in_file);
+      } else {
+        Map* map = snapshot->GetMaps()->GetMapForIp(frame.pc);
+        printf("  0x%016" PRIx64 "  %s\n", frame.pc, (map != nullptr) ? map->dso.c_str() : "???");
+      }
+    }
+  }
+  return 0;
+}